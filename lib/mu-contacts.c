@@ -22,170 +22,337 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>   /* for pow */
 
 #include "mu-contacts.h"
 #include "mu-util.h"
 #include "mu-str.h"
 
-#define EMAIL_KEY	"email"
-#define NAME_KEY	"name"
-#define TSTAMP_KEY	"tstamp"
-#define PERSONAL_KEY	"personal"
+/*
+ * the contacts cache is a binary file: a header, followed by an array
+ * of fixed-size records, sorted by their key (the case-folded e-mail
+ * address), an array of completion tokens, sorted by token, the record
+ * indices sorted by generation, and a table of 0-terminated strings
+ * the records and tokens refer to. We mmap the file read-only, so
+ * opening it does not depend on its size; contacts added (or changed)
+ * afterwards are kept in a hash table, and merged with the records
+ * when we write a new file.
+ *
+ * e-mail addresses that differ only in case are the same contact; we
+ * keep the address as we first saw it for display.
+ *
+ * the file uses the host's byte order, and is replaced atomically.
+ */
+#define CACHE_MAGIC	"mucntcts"
+#define CACHE_VERSION	4
+#define CACHE_NO_STR	G_MAXUINT32
+
+struct _CacheHeader {
+	char	magic[8];
+	guint32 version;
+	guint32 num;		/* number of records */
+	guint32 strsize;	/* size of the string table */
+	guint32 tokennum;	/* number of completion tokens */
+	guint32 generation;	/* the latest generation */
+	guint32 reserved;
+};
+typedef struct _CacheHeader CacheHeader;
+
+struct _CacheRecord {
+	guint32 email;		/* offset in the string table */
+	guint32 name;		/* offset, or CACHE_NO_STR */
+	gint64	tstamp;
+	guint32 personal;
+	guint32 freq;		/* number of times seen */
+	guint32 generation;	/* when the record last changed */
+	guint32 key;		/* offset of the case-folded address */
+};
+typedef struct _CacheRecord CacheRecord;
+
+/* a word of the normalized name of a contact, or its lower-cased
+ * e-mail address, for prefix completion */
+struct _CacheToken {
+	guint32 token;		/* offset in the string table */
+	guint32 rec;		/* index of the record */
+};
+typedef struct _CacheToken CacheToken;
 
 
 /* note: 'personal' here means a mail where my e-mail addresses is explicitly
  * in one of the address fields, ie., it's not some mailing list message */
 struct _ContactInfo {
-	gchar *  _name, *_email;
-	gboolean _personal;
-	time_t   _tstamp;
+	const char *_key;    /* the case-folded address; NULL for
+			      * unused slots */
+	const char *_email, *_name;
+	gboolean    _personal;
+	time_t      _tstamp;
+	guint32     _freq;
+	guint32     _generation;
+	const char *_tokens; /* the completion tokens, each
+			      * 0-terminated, followed by an empty
+			      * one; NULL in a MuContactsDelta */
 };
 typedef struct _ContactInfo ContactInfo;
 
-static void contact_info_destroy (ContactInfo *cinfo);
-static ContactInfo *contact_info_new (char *email, char *name,
-				      gboolean personal, time_t tstamp);
+/* a hash table of ContactInfo, by key, with open addressing (linear
+ * probing) so a lookup is a single scan of an array; the strings are
+ * interned in a string chunk, and freed in one go */
+struct _ContactTable {
+	ContactInfo	*_slots;
+	guint		 _size;	     /* a power of 2 */
+	guint		 _used;
+	GStringChunk	*_strs;
+};
+typedef struct _ContactTable ContactTable;
+
+#define TABLE_MIN_SIZE 64
+
+/* the contacts seen during some run of indexing, to be merged with
+ * mu_contacts_merge */
+struct _MuContactsDelta {
+	ContactTable _table;
+};
+
+static char* clean_str (const char *str);
+static char* get_key (const char *email);
+static void  contact_info_set_tokens (ContactTable *tbl, ContactInfo *cinfo);
 
 struct _MuContacts {
-        GKeyFile      *_ccache;
 	gchar         *_path;
 
-	GHashTable    *_hash;
+	GMappedFile	  *_map;     /* the cache file, or NULL */
+	const CacheRecord *_recs;    /* the records in _map */
+	guint32		   _num;
+	const CacheToken  *_tokens;  /* the tokens in _map */
+	guint32		   _tokennum;
+	const guint32	  *_gens;    /* record indices, by generation */
+	const char	  *_strs;    /* the string table in _map */
+	guint32		   _strsize;
+
+	ContactTable   _table;	     /* the contacts added or changed
+				      * since loading */
+	size_t	       _added;	     /* the ones not in _recs */
+	guint32	       _generation;  /* bumped for each change */
 	gboolean       _dirty;
 };
 
 
-/*
- * we use the e-mail address to create a key in the GKeyFile, but we
- * have to mutilate a bit so that it's (a) *cough* practically-unique
- * and (b) valid as a GKeyFile group name (ie., valid utf8, no control
- * chars, no '[' or ']')
- */
 static const char*
-encode_email_address (const char *addr)
+rec_str (MuContacts *self, guint32 offset)
 {
-	static char enc[254 + 1]; /* max size for an e-mail addr */
-	char *cur;
+	return offset < self->_strsize ? self->_strs + offset : NULL;
+}
+
+
+static gboolean
+check_cache (const char *data, gsize len, const char *path)
+{
+	const CacheHeader *hdr;
+	gsize size;
+
+	hdr = (const CacheHeader*)data;
+	if (len < sizeof(CacheHeader) ||
+	    memcmp (hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0) {
+		g_warning ("%s is not a contacts cache; ignoring", path);
+		return FALSE;
+	}
 
-	if (!addr)
+	if (hdr->version != CACHE_VERSION) {
+		g_warning ("%s has unsupported version %u; ignoring",
+			   path, hdr->version);
 		return FALSE;
+	}
 
-	/* make sure chars are with {' ' .. '~'}, and not '[' ']' */
-	for (cur = strncpy(enc, addr, sizeof(enc)); *cur != '\0'; ++cur)
-		if (!isalnum(*cur))
-			*cur = 'A' +  (*cur % ('Z' - 'A'));
+	/* the records, the tokens, the generation index and the
+	 * strings, the last of which must be terminated */
+	size = sizeof(CacheHeader) +
+		hdr->num * sizeof(CacheRecord) +
+		hdr->tokennum * sizeof(CacheToken) +
+		hdr->num * sizeof(guint32) +
+		hdr->strsize;
+	if (len != size ||
+	    (hdr->strsize > 0 && data[len - 1] != '\0')) {
+		g_warning ("%s is corrupt; ignoring", path);
+		return FALSE;
+	}
 
-	return enc;
+	return TRUE;
 }
 
-static GKeyFile*
-load_key_file (const char *path)
+
+/* map the cache file; this is O(1), we don't look at the records
+ * until we need them */
+static gboolean
+load_cache (MuContacts *self)
 {
 	GError *err;
-	GKeyFile *keyfile;
-	gboolean file_exists;
-
-	err	    = NULL;
-
-	/* of course this is racy, but it's only for giving more
-	 * meaningful errors to users */
-	file_exists = TRUE;
-	if (access(path, F_OK) != 0) {
-		if (errno != ENOENT) {
-			g_warning ("cannot open %s: %s", path, strerror(errno));
-			return NULL;
-		}
-		file_exists = FALSE;
-	}
+	const char *data;
+	gsize len;
 
 	err = NULL;
-	keyfile = g_key_file_new ();
-
-	if (file_exists && !g_key_file_load_from_file
-	    (keyfile, path, G_KEY_FILE_KEEP_COMMENTS, &err)) {
-		g_warning ("could not load keyfile %s: %s", path, err->message);
+	self->_map = g_mapped_file_new (self->_path, FALSE, &err);
+	if (!self->_map) {
+		gboolean noent;
+		noent = g_error_matches (err, G_FILE_ERROR,
+					 G_FILE_ERROR_NOENT);
+		if (!noent)
+			g_warning ("cannot open %s: %s", self->_path,
+				   err->message);
 		g_error_free (err);
-		g_key_file_free (keyfile);
-		return NULL;
+		return noent; /* no cache yet is fine */
 	}
-	return keyfile;
+
+	data = g_mapped_file_get_contents (self->_map);
+	len  = g_mapped_file_get_length (self->_map);
+	if (!check_cache (data, len, self->_path)) {
+		g_mapped_file_unref (self->_map);
+		self->_map = NULL;
+		return TRUE; /* start afresh */
+	}
+
+	self->_num     = ((const CacheHeader*)data)->num;
+	self->_strsize = ((const CacheHeader*)data)->strsize;
+	self->_tokennum = ((const CacheHeader*)data)->tokennum;
+	self->_generation = ((const CacheHeader*)data)->generation;
+	self->_recs    = (const CacheRecord*)(data + sizeof(CacheHeader));
+	self->_tokens  = (const CacheToken*)(self->_recs + self->_num);
+	self->_gens    = (const guint32*)(self->_tokens + self->_tokennum);
+	self->_strs    = (const char*)(self->_gens + self->_num);
+
+	return TRUE;
 }
 
 
-static gboolean
-get_values (GKeyFile *kfile, const gchar *group,
-	    gchar **email, gchar **name, gboolean *personal, size_t *tstamp)
+static void
+unload_cache (MuContacts *self)
 {
-	GError *err;
-	err = NULL;
+	if (self->_map)
+		g_mapped_file_unref (self->_map);
+
+	self->_map     = NULL;
+	self->_recs    = NULL;
+	self->_tokens  = NULL;
+	self->_gens    = NULL;
+	self->_strs    = NULL;
+	self->_num     = self->_strsize = self->_tokennum = 0;
+}
 
-	do {
-		*email = g_key_file_get_value (kfile, group, EMAIL_KEY, &err);
-		if (!*email)
-			break;
 
-		*tstamp = (time_t)g_key_file_get_integer (kfile, group, TSTAMP_KEY, &err);
-		if (err)
+/* binary search for the record for key */
+static const CacheRecord*
+find_record (MuContacts *self, const char *key)
+{
+	guint32 lo, hi;
+
+	for (lo = 0, hi = self->_num; lo < hi;) {
+		guint32 mid;
+		int cmp;
+		mid = lo + (hi - lo) / 2;
+		cmp = g_strcmp0 (rec_str (self, self->_recs[mid].key), key);
+		if (cmp == 0)
+			return &self->_recs[mid];
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+
+static void
+table_init (ContactTable *tbl)
+{
+	tbl->_size  = TABLE_MIN_SIZE;
+	tbl->_used  = 0;
+	tbl->_slots = g_new0 (ContactInfo, tbl->_size);
+	tbl->_strs  = g_string_chunk_new (4096);
+}
+
+
+static void
+table_uninit (ContactTable *tbl)
+{
+	g_free (tbl->_slots);
+	if (tbl->_strs)
+		g_string_chunk_free (tbl->_strs);
+
+	memset (tbl, 0, sizeof(ContactTable));
+}
+
+
+/* the slot for key: either the one with that key, or the empty one
+ * where it would go */
+static ContactInfo*
+table_slot (ContactInfo *slots, guint size, const char *key)
+{
+	guint u;
+
+	for (u = g_str_hash (key) & (size - 1); slots[u]._key;
+	     u = (u + 1) & (size - 1))
+		if (strcmp (slots[u]._key, key) == 0)
 			break;
 
-		*personal = g_key_file_get_boolean (kfile, group, PERSONAL_KEY, NULL);
-		*name = g_key_file_get_value (kfile, group, NAME_KEY, NULL);
+	return &slots[u];
+}
 
-		return TRUE;
 
-	} while (0);
+static ContactInfo*
+table_lookup (ContactTable *tbl, const char *key)
+{
+	ContactInfo *cinfo;
 
-	g_warning ("error getting value for %s: %s",
-		   group, err->message ? err->message: "error");
-	g_clear_error (&err);
+	cinfo = table_slot (tbl->_slots, tbl->_size, key);
 
-	return FALSE;
+	return cinfo->_key ? cinfo : NULL;
 }
 
 
-static gboolean
-deserialize_cache (MuContacts *self)
-{
-	gchar **groups;
-	gsize i, len;
-
-	groups = g_key_file_get_groups (self->_ccache, &len);
-	for (i = 0; i != len; ++i) {
-		ContactInfo *cinfo;
-		char *name, *email;
-		size_t tstamp;
-		gboolean personal;
-		if (!get_values (self->_ccache, groups[i],
-				 &email, &name, &personal, &tstamp))
-			continue; /* ignore this one... */
-
-		cinfo = contact_info_new (email, name, personal, tstamp);
-
-		/* note, we're using the groups[i], so don't free with g_strfreev */
-		g_hash_table_insert (self->_hash, groups[i],
-				     cinfo);
-	}
+/* double the number of slots; the strings stay where they are */
+static void
+table_grow (ContactTable *tbl)
+{
+	ContactInfo *slots;
+	guint u, size;
 
-	g_free (groups);
-	return TRUE;
+	size  = tbl->_size * 2;
+	slots = g_new0 (ContactInfo, size);
+
+	for (u = 0; u != tbl->_size; ++u)
+		if (tbl->_slots[u]._key)
+			*table_slot (slots, size, tbl->_slots[u]._key) =
+				tbl->_slots[u];
+
+	g_free (tbl->_slots);
+	tbl->_slots = slots;
+	tbl->_size  = size;
 }
 
-static gboolean
-set_comment (GKeyFile *kfile)
+
+static const char*
+table_intern (ContactTable *tbl, const char *str)
 {
-	GError *err;
-	const char *comment =
-		" automatically generated -- do not edit";
+	return str ? g_string_chunk_insert_const (tbl->_strs, str) : NULL;
+}
 
-	err = NULL;
-	if (!g_key_file_set_comment (kfile, NULL, NULL, comment, &err)) {
-		g_warning ("could not write comment to keyfile: %s",
-			   err->message);
-		g_error_free (err);
-		return FALSE;
-	}
 
-	return TRUE;
+/* a new, empty contact for key, which must not be in the table yet;
+ * we keep the table at most 3/4 full, so probe sequences are short */
+static ContactInfo*
+table_insert (ContactTable *tbl, const char *key)
+{
+	ContactInfo *cinfo;
+
+	if ((tbl->_used + 1) * 4 > tbl->_size * 3)
+		table_grow (tbl);
+
+	cinfo = table_slot (tbl->_slots, tbl->_size, key);
+	memset (cinfo, 0, sizeof(ContactInfo));
+	cinfo->_key = table_intern (tbl, key);
+	++tbl->_used;
+
+	return cinfo;
 }
 
 
@@ -198,18 +365,14 @@ mu_contacts_new (const gchar *path)
 	self = g_new0 (MuContacts, 1);
 
 	self->_path = g_strdup (path);
-	self->_hash = g_hash_table_new_full
-		(g_str_hash, g_str_equal, g_free,
-		 (GDestroyNotify)contact_info_destroy);
+	table_init (&self->_table);
 
-	self->_ccache  = load_key_file (path);
-	if (!self->_ccache || !set_comment (self->_ccache)) {
+	if (!load_cache (self)) {
 		mu_contacts_destroy (self);
 		return NULL;
 	}
-	deserialize_cache (self);
-	MU_WRITE_LOG("deserialized contacts from cache %s",
-		     path);
+	MU_WRITE_LOG("mapped contacts cache %s (%u contacts)",
+		     path, self->_num);
 
 	self->_dirty = FALSE;
 	return self;
@@ -221,45 +384,209 @@ mu_contacts_clear (MuContacts *self)
 {
 	g_return_if_fail (self);
 
-	if (self->_ccache)
-		g_key_file_free (self->_ccache);
+	unload_cache (self);
+	table_uninit (&self->_table);
+	table_init (&self->_table);
 
-	g_hash_table_remove_all (self->_hash);
+	self->_added = 0;
+	self->_dirty = TRUE; /* so we write an empty cache */
+	/* note: we keep the generation, it only goes up */
+}
 
-	self->_ccache = g_key_file_new ();
-	self->_dirty = FALSE;
+
+
+/* new sightings of a known contact: count them, and take the name
+ * from them if they are more recent and have one; return TRUE if the
+ * name (or 'personal') changed. name is clean already. */
+static gboolean
+contact_info_update (ContactTable *tbl, ContactInfo *cinfo,
+		     const char *name, gboolean personal, time_t tstamp,
+		     guint32 freq)
+{
+	cinfo->_freq += freq;
+
+	if (cinfo->_tstamp >= tstamp)
+		return FALSE;
+
+	cinfo->_tstamp = tstamp;
+	if (mu_str_is_empty (name))
+		return FALSE;
+
+	if (g_strcmp0 (name, cinfo->_name) == 0 &&
+	    cinfo->_personal == personal)
+		return FALSE;
+
+	cinfo->_name	 = table_intern (tbl, name);
+	cinfo->_personal = personal;
+
+	return TRUE;
 }
 
 
+/* add freq sightings of a contact, with a clean key, email and
+ * name */
+static gboolean
+add_contact (MuContacts *self, const char *key, const char *email,
+	     const char *name, gboolean personal, time_t tstamp,
+	     guint32 freq)
+{
+	ContactInfo *cinfo;
+	const CacheRecord *rec;
+
+	self->_dirty = TRUE; /* at least, the frequency changes */
+
+	cinfo = table_lookup (&self->_table, key);
+	if (!cinfo && (rec = find_record (self, key))) {
+		/* copy the record, so we can update it */
+		cinfo = table_insert (&self->_table, key);
+		cinfo->_email	   = table_intern (&self->_table,
+						   rec_str (self, rec->email));
+		cinfo->_name	   = table_intern (&self->_table,
+						   rec_str (self, rec->name));
+		cinfo->_personal   = rec->personal ? TRUE : FALSE;
+		cinfo->_tstamp	   = (time_t)rec->tstamp;
+		cinfo->_freq	   = rec->freq;
+		cinfo->_generation = rec->generation;
+		contact_info_set_tokens (&self->_table, cinfo);
+	} else if (!cinfo) {
+		cinfo = table_insert (&self->_table, key);
+		cinfo->_email	   = table_intern (&self->_table, email);
+		cinfo->_name	   = table_intern (&self->_table, name);
+		cinfo->_personal   = personal;
+		cinfo->_tstamp	   = tstamp;
+		cinfo->_freq	   = freq;
+		cinfo->_generation = ++self->_generation;
+		contact_info_set_tokens (&self->_table, cinfo);
+		++self->_added;
+		return TRUE;
+	}
+
+	if (!contact_info_update (&self->_table, cinfo, name, personal,
+				  tstamp, freq))
+		return FALSE;
+
+	cinfo->_generation = ++self->_generation;
+	contact_info_set_tokens (&self->_table, cinfo);
+	return TRUE;
+}
+
 
 gboolean
 mu_contacts_add (MuContacts *self, const char *email, const char *name,
 		 gboolean personal, time_t tstamp)
 {
-	ContactInfo *cinfo;
-	const char* group;
+	char *key, *cemail, *cname;
+	gboolean rv;
 
 	g_return_val_if_fail (self, FALSE);
 	g_return_val_if_fail (email, FALSE);
 
-	/* add the info, if either there is no info for this email
-	 * yet, *OR* the new one is more recent and does not have an
-	 * empty name */
-	group = encode_email_address (email);
+	key    = get_key (email);
+	cemail = clean_str (email);
+	cname  = clean_str (name);
+
+	rv = add_contact (self, key, cemail, cname, personal, tstamp, 1);
+
+	g_free (key);
+	g_free (cemail);
+	g_free (cname);
+
+	return rv;
+}
+
+
+MuContactsDelta*
+mu_contacts_delta_new (void)
+{
+	MuContactsDelta *delta;
+
+	delta = g_new0 (MuContactsDelta, 1);
+	table_init (&delta->_table);
+
+	return delta;
+}
 
-	cinfo = (ContactInfo*) g_hash_table_lookup (self->_hash, group);
-	if (!cinfo || (cinfo->_tstamp < tstamp && !mu_str_is_empty(name))) {
-		ContactInfo *ci;
-		ci = contact_info_new (g_strdup(email),
-				       name ? g_strdup(name) : NULL, personal,
-				       tstamp);
 
-		g_hash_table_insert (self->_hash, g_strdup(group), ci);
+void
+mu_contacts_delta_destroy (MuContactsDelta *delta)
+{
+	if (!delta)
+		return;
 
-		return self->_dirty = TRUE;
+	table_uninit (&delta->_table);
+	g_free (delta);
+}
+
+
+void
+mu_contacts_delta_add (MuContactsDelta *delta, const char *email,
+		       const char *name, gboolean personal, time_t tstamp)
+{
+	ContactInfo *cinfo;
+	char *key, *cname;
+
+	g_return_if_fail (delta);
+	g_return_if_fail (email);
+
+	key   = get_key (email);
+	cname = clean_str (name);
+
+	cinfo = table_lookup (&delta->_table, key);
+	if (cinfo)
+		contact_info_update (&delta->_table, cinfo, cname, personal,
+				     tstamp, 1);
+	else {
+		char *cemail;
+		cemail = clean_str (email);
+		cinfo = table_insert (&delta->_table, key);
+		cinfo->_email	 = table_intern (&delta->_table, cemail);
+		cinfo->_name	 = table_intern (&delta->_table, cname);
+		cinfo->_personal = personal;
+		cinfo->_tstamp	 = tstamp;
+		cinfo->_freq	 = 1;
+		g_free (cemail);
 	}
 
-	return FALSE;
+	g_free (key);
+	g_free (cname);
+}
+
+
+size_t
+mu_contacts_merge (MuContacts *self, MuContactsDelta *delta)
+{
+	size_t changed;
+	guint u;
+
+	g_return_val_if_fail (self, 0);
+	g_return_val_if_fail (delta, 0);
+
+	if (delta->_table._used == 0)
+		return 0;
+
+	for (u = changed = 0; u != delta->_table._size; ++u) {
+		const ContactInfo *cinfo;
+		cinfo = &delta->_table._slots[u];
+		if (cinfo->_key &&
+		    add_contact (self, cinfo->_key, cinfo->_email,
+				 cinfo->_name, cinfo->_personal,
+				 cinfo->_tstamp, cinfo->_freq))
+			++changed;
+	}
+
+	table_uninit (&delta->_table);
+	table_init (&delta->_table);
+
+	return changed;
+}
+
+
+guint32
+mu_contacts_generation (MuContacts *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->_generation;
 }
 
 struct _EachContactData {
@@ -270,30 +597,82 @@ struct _EachContactData {
 };
 typedef struct _EachContactData	 EachContactData;
 
-static void /* email will never be NULL, but ci->_name may be */
-each_contact (const char *group, ContactInfo *ci, EachContactData *ecdata)
+/* email will never be NULL, but name may be */
+static void
+each_contact (const char *email, const char *name, gboolean personal,
+	      time_t tstamp, EachContactData *ecdata)
 {
-	if (!ci->_email)
-		g_warning ("missing email: %u", (unsigned)ci->_tstamp);
-
 	/* ignore this contact if we have a regexp, and it matches
 	 * neither email nor name (if we have a name) */
 	while (ecdata->_rx) { /* note, only once */
-		if (g_regex_match (ecdata->_rx, ci->_email, 0, NULL))
+		if (g_regex_match (ecdata->_rx, email, 0, NULL))
 			break; /* email matches? continue! */
-		if (!ci->_name)
+		if (!name)
 			return; /* email did not match, no name? ignore this one */
-		if (g_regex_match (ecdata->_rx, ci->_name, 0, NULL))
+		if (g_regex_match (ecdata->_rx, name, 0, NULL))
 			break; /* name matches? continue! */
 		return; /* nothing matched, ignore this one */
 	}
 
-	ecdata->_func (ci->_email, ci->_name, ci->_personal,
-		       ci->_tstamp, ecdata->_user_data);
+	ecdata->_func (email, name, personal, tstamp, ecdata->_user_data);
 
 	++ecdata->_num;
 }
 
+
+/* the contacts added or changed since loading, with a generation
+ * after generation */
+static void
+each_contact_info (MuContacts *self, guint32 generation,
+		   EachContactData *ecdata)
+{
+	guint u;
+
+	for (u = 0; u != self->_table._size; ++u) {
+		const ContactInfo *ci;
+		ci = &self->_table._slots[u];
+		if (ci->_key && ci->_generation > generation)
+			each_contact (ci->_email, ci->_name, ci->_personal,
+				      ci->_tstamp, ecdata);
+	}
+}
+
+
+/* whether a record was updated since loading; if so, we use the
+ * ContactInfo instead */
+static gboolean
+rec_is_updated (MuContacts *self, const CacheRecord *rec)
+{
+	const char *key;
+
+	key = rec_str (self, rec->key);
+
+	return !key || table_lookup (&self->_table, key);
+}
+
+
+/* the records, except the ones that were updated since */
+static void
+each_record (MuContacts *self, EachContactData *ecdata)
+{
+	guint32 u;
+
+	for (u = 0; u != self->_num; ++u) {
+		const CacheRecord *rec;
+		const char *email;
+
+		rec   = &self->_recs[u];
+		email = rec_str (self, rec->email);
+		if (!email || rec_is_updated (self, rec))
+			continue;
+
+		each_contact (email, rec_str (self, rec->name),
+			      rec->personal ? TRUE : FALSE,
+			      (time_t)rec->tstamp, ecdata);
+	}
+}
+
+
 gboolean
 mu_contacts_foreach (MuContacts *self, MuContactsForeachFunc func,
 		     gpointer user_data, const char *pattern, size_t *num)
@@ -322,9 +701,8 @@ mu_contacts_foreach (MuContacts *self, MuContactsForeachFunc func,
 	ecdata._user_data = user_data;
 	ecdata._num       = 0;
 
-	g_hash_table_foreach (self->_hash,
-			      (GHFunc)each_contact,
-			      &ecdata);
+	each_record (self, &ecdata);
+	each_contact_info (self, 0, &ecdata);
 
 	if (ecdata._rx)
 		g_regex_unref (ecdata._rx);
@@ -335,46 +713,632 @@ mu_contacts_foreach (MuContacts *self, MuContactsForeachFunc func,
 	return TRUE;
 }
 
+
+/* the index in _gens of the first record changed after generation */
+static guint32
+first_since (MuContacts *self, guint32 generation)
+{
+	guint32 lo, hi;
+
+	for (lo = 0, hi = self->_num; lo < hi;) {
+		guint32 mid, idx;
+		mid = lo + (hi - lo) / 2;
+		idx = self->_gens[mid];
+		if (idx < self->_num &&
+		    self->_recs[idx].generation <= generation)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+gboolean
+mu_contacts_foreach_since (MuContacts *self, guint32 generation,
+			   MuContactsForeachFunc func, gpointer user_data,
+			   size_t *num)
+{
+	EachContactData ecdata;
+	guint32 u;
+
+	g_return_val_if_fail (self, FALSE);
+	g_return_val_if_fail (func, FALSE);
+
+	ecdata._func	  = func;
+	ecdata._user_data = user_data;
+	ecdata._rx	  = NULL;
+	ecdata._num	  = 0;
+
+	/* the records changed since, in generation order */
+	for (u = first_since (self, generation); u < self->_num; ++u) {
+		const CacheRecord *rec;
+		const char *email;
+		if (self->_gens[u] >= self->_num)
+			continue;
+		rec   = &self->_recs[self->_gens[u]];
+		email = rec_str (self, rec->email);
+		if (!email || rec_is_updated (self, rec))
+			continue; /* updated since; see below */
+		each_contact (email, rec_str (self, rec->name),
+			      rec->personal ? TRUE : FALSE,
+			      (time_t)rec->tstamp, &ecdata);
+	}
+
+	/* and the ones changed since loading */
+	each_contact_info (self, generation, &ecdata);
+
+	if (num)
+		*num = ecdata._num;
+
+	return TRUE;
+}
+
+
+typedef void (*TokenFunc) (const char *token, gpointer user_data);
+
+/* call func for each of the completion tokens of a contact: the
+ * words of its normalized, lower-cased name, and its lower-cased
+ * e-mail address */
+static void
+foreach_token (const char *email, const char *name, TokenFunc func,
+	       gpointer user_data)
+{
+	char *str, *cur, *word;
+
+	str = g_ascii_strdown (email, -1);
+	func (str, user_data);
+	g_free (str);
+
+	str = name ? mu_str_normalize (name, TRUE, NULL) : NULL;
+	if (!str)
+		return;
+
+	/* words are separated by ascii non-alphanumerics */
+	for (cur = word = str; ; ++cur) {
+		gboolean end, sep;
+		end = (*cur == '\0');
+		sep = end || ((guchar)*cur < 0x80 && !isalnum ((guchar)*cur));
+		if (!sep)
+			continue;
+		*cur = '\0';
+		if (cur > word)
+			func (word, user_data);
+		if (end)
+			break;
+		word = cur + 1;
+	}
+
+	g_free (str);
+}
+
+
+static void
+each_token_append (const char *token, GString *tokens)
+{
+	if (*token)
+		g_string_append_len (tokens, token, strlen (token) + 1);
+}
+
+
+/* get the tokens for a contact in the table once, when it's added or
+ * its name changes, rather than for every completion; the old ones
+ * stay in the string chunk until the table goes */
+static void
+contact_info_set_tokens (ContactTable *tbl, ContactInfo *cinfo)
+{
+	GString *tokens;
+
+	tokens = g_string_sized_new (64);
+	foreach_token (cinfo->_email, cinfo->_name,
+		       (TokenFunc)each_token_append, tokens);
+
+	/* this adds the terminating empty token */
+	cinfo->_tokens = g_string_chunk_insert_len (tbl->_strs, tokens->str,
+						    tokens->len);
+	g_string_free (tokens, TRUE);
+}
+
+
+struct _Candidate {
+	double		 score;
+	const char	*email, *name;
+	gboolean	 personal;
+	time_t		 tstamp;
+};
+typedef struct _Candidate Candidate;
+
+/* frecency: the number of times we have seen a contact, halved for
+ * every month since we last saw it */
+static double
+frecency (guint32 freq, time_t tstamp, time_t now)
+{
+	double months;
+
+	months = now > tstamp ? (now - tstamp) / (30 * 24 * 3600.0) : 0;
+
+	return freq * pow (0.5, months);
+}
+
+
+static int
+cmp_candidate (const Candidate *c1, const Candidate *c2)
+{
+	if (c1->score != c2->score)
+		return c1->score > c2->score ? -1 : 1;
+
+	return strcmp (c1->email, c2->email);
+}
+
+
+/* the best candidates so far; with a limit, we keep only that many,
+ * in a heap with the worst one on top, so we can replace it when we
+ * find a better one */
+struct _Candidates {
+	GArray *arr;
+	size_t	limit; /* 0 for no limit */
+};
+typedef struct _Candidates Candidates;
+
+static void
+swap_candidates (Candidate *c1, Candidate *c2)
+{
+	Candidate tmp;
+
+	tmp = *c1;
+	*c1 = *c2;
+	*c2 = tmp;
+}
+
+
+static void
+heap_up (Candidate *heap, guint u)
+{
+	while (u > 0) {
+		guint parent;
+		parent = (u - 1) / 2;
+		if (cmp_candidate (&heap[parent], &heap[u]) >= 0)
+			break;
+		swap_candidates (&heap[parent], &heap[u]);
+		u = parent;
+	}
+}
+
+
+static void
+heap_down (Candidate *heap, guint len, guint u)
+{
+	for (;;) {
+		guint child, worst;
+
+		worst = u;
+		child = 2 * u + 1;
+		if (child < len &&
+		    cmp_candidate (&heap[child], &heap[worst]) > 0)
+			worst = child;
+		if (child + 1 < len &&
+		    cmp_candidate (&heap[child + 1], &heap[worst]) > 0)
+			worst = child + 1;
+		if (worst == u)
+			break;
+
+		swap_candidates (&heap[u], &heap[worst]);
+		u = worst;
+	}
+}
+
+
+static void
+add_candidate (Candidates *cands, const char *email, const char *name,
+	       gboolean personal, time_t tstamp, guint32 freq, time_t now)
+{
+	Candidate cand, *heap;
+
+	cand.score    = frecency (freq, tstamp, now);
+	cand.email    = email;
+	cand.name     = name;
+	cand.personal = personal;
+	cand.tstamp   = tstamp;
+
+	if (cands->limit == 0 || cands->arr->len < cands->limit) {
+		g_array_append_val (cands->arr, cand);
+		if (cands->limit != 0)
+			heap_up ((Candidate*)cands->arr->data,
+				 cands->arr->len - 1);
+		return;
+	}
+
+	heap = (Candidate*)cands->arr->data;
+	if (cmp_candidate (&cand, &heap[0]) < 0) {
+		heap[0] = cand;
+		heap_down (heap, cands->arr->len, 0);
+	}
+}
+
+
+/* the index of the first token that is not less than prefix */
+static guint32
+lower_bound (MuContacts *self, const char *prefix)
+{
+	guint32 lo, hi;
+
+	for (lo = 0, hi = self->_tokennum; lo < hi;) {
+		guint32 mid;
+		mid = lo + (hi - lo) / 2;
+		if (g_strcmp0 (rec_str (self, self->_tokens[mid].token),
+			       prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/* the records with some token starting with prefix; these are a
+ * contiguous range of the sorted tokens */
+static void
+complete_records (MuContacts *self, const char *prefix, gboolean personal,
+		  Candidates *cands, time_t now)
+{
+	GHashTable *seen;
+	guint32 u;
+
+	seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	for (u = lower_bound (self, prefix); u < self->_tokennum; ++u) {
+		const CacheToken *tok;
+		const CacheRecord *rec;
+		const char *token, *email;
+
+		tok   = &self->_tokens[u];
+		token = rec_str (self, tok->token);
+		if (!token || !g_str_has_prefix (token, prefix))
+			break;
+
+		/* the same record may have multiple matching tokens */
+		if (tok->rec >= self->_num || g_hash_table_lookup
+		    (seen, GUINT_TO_POINTER(tok->rec + 1)))
+			continue;
+		g_hash_table_insert (seen, GUINT_TO_POINTER(tok->rec + 1),
+				     GUINT_TO_POINTER(TRUE));
+
+		rec   = &self->_recs[tok->rec];
+		email = rec_str (self, rec->email);
+		if (!email || (personal && !rec->personal))
+			continue;
+		if (rec_is_updated (self, rec))
+			continue; /* updated since; see complete_added */
+
+		add_candidate (cands, email, rec_str (self, rec->name),
+			       rec->personal ? TRUE : FALSE,
+			       (time_t)rec->tstamp, rec->freq, now);
+	}
+
+	g_hash_table_destroy (seen);
+}
+
+
+/* the contacts added or updated since loading the cache; we have no
+ * tokens for those in the file, but there are usually not many, and
+ * we got their tokens when adding them */
+static void
+complete_added (MuContacts *self, const char *prefix, gboolean personal,
+		Candidates *cands, time_t now)
+{
+	guint u;
+
+	for (u = 0; u != self->_table._size; ++u) {
+		const ContactInfo *ci;
+		const char *token;
+
+		ci = &self->_table._slots[u];
+		if (!ci->_key || (personal && !ci->_personal))
+			continue;
+
+		for (token = ci->_tokens; token && *token;
+		     token += strlen (token) + 1)
+			if (g_str_has_prefix (token, prefix)) {
+				add_candidate (cands, ci->_email, ci->_name,
+					       ci->_personal, ci->_tstamp,
+					       ci->_freq, now);
+				break;
+			}
+	}
+}
+
+
+gboolean
+mu_contacts_complete (MuContacts *self, const char *prefix,
+		      gboolean personal, size_t limit,
+		      MuContactsForeachFunc func, gpointer user_data,
+		      size_t *num)
+{
+	Candidates cands;
+	char *norm;
+	time_t now;
+	guint u;
+
+	g_return_val_if_fail (self, FALSE);
+	g_return_val_if_fail (prefix, FALSE);
+	g_return_val_if_fail (func, FALSE);
+
+	norm = mu_str_normalize (prefix, TRUE, NULL);
+	if (!norm)
+		return FALSE;
+	g_strstrip (norm);
+
+	now	    = time (NULL);
+	cands.arr   = g_array_new (FALSE, FALSE, sizeof(Candidate));
+	cands.limit = limit;
+	complete_records (self, norm, personal, &cands, now);
+	complete_added (self, norm, personal, &cands, now);
+	/* with a limit, only the best ones are left */
+	g_array_sort (cands.arr, (GCompareFunc)cmp_candidate);
+
+	for (u = 0; u != cands.arr->len; ++u) {
+		const Candidate *cand;
+		cand = &g_array_index (cands.arr, Candidate, u);
+		func (cand->email, cand->name, cand->personal, cand->tstamp,
+		      user_data);
+	}
+
+	if (num)
+		*num = u;
+
+	g_array_free (cands.arr, TRUE);
+	g_free (norm);
+
+	return TRUE;
+}
+
+
+/* add a string to the string table, and return its offset */
+static guint32
+add_str (GString *strs, const char *str)
+{
+	guint32 offset;
+
+	if (!str)
+		return CACHE_NO_STR;
+
+	offset = (guint32)strs->len;
+	g_string_append_len (strs, str, strlen(str) + 1);
+
+	return offset;
+}
+
+
+static void
+add_record (GArray *recs, GString *strs, const char *key,
+	    const char *email, const char *name, gboolean personal,
+	    time_t tstamp, guint32 freq, guint32 generation)
+{
+	CacheRecord rec;
+
+	memset (&rec, 0, sizeof(rec));
+
+	rec.email    = add_str (strs, email);
+	/* usually, the address is in lower-case already */
+	rec.key	     = strcmp (key, email) == 0 ?
+		rec.email : add_str (strs, key);
+	rec.name     = add_str (strs, name);
+	rec.personal = personal ? 1 : 0;
+	rec.tstamp   = (gint64)tstamp;
+	rec.freq     = freq;
+	rec.generation = generation;
+
+	g_array_append_val (recs, rec);
+}
+
+
+struct _TokenData {
+	GArray	*tokens;
+	GString *strs;
+	guint32	 rec;
+};
+typedef struct _TokenData TokenData;
+
+static void
+each_token_add (const char *token, TokenData *tdata)
+{
+	CacheToken tok;
+
+	tok.token = add_str (tdata->strs, token);
+	tok.rec	  = tdata->rec;
+
+	g_array_append_val (tdata->tokens, tok);
+}
+
+
+static int
+cmp_token (const CacheToken *tok1, const CacheToken *tok2, GString *strs)
+{
+	return strcmp (strs->str + tok1->token, strs->str + tok2->token);
+}
+
+
+/* the sorted completion tokens for the records */
+static GArray*
+get_tokens (GArray *recs, GString *strs)
+{
+	TokenData tdata;
+
+	tdata.tokens = g_array_sized_new (FALSE, FALSE, sizeof(CacheToken),
+					  recs->len * 3);
+	tdata.strs   = strs;
+
+	for (tdata.rec = 0; tdata.rec != recs->len; ++tdata.rec) {
+		const CacheRecord *rec;
+		rec = &g_array_index (recs, CacheRecord, tdata.rec);
+		foreach_token (strs->str + rec->email,
+			       rec->name == CACHE_NO_STR ? NULL :
+			       strs->str + rec->name,
+			       (TokenFunc)each_token_add, &tdata);
+	}
+
+	/* sort only when done adding, as strs->str may move */
+	g_array_sort_with_data (tdata.tokens, (GCompareDataFunc)cmp_token,
+				strs);
+
+	return tdata.tokens;
+}
+
+
+static int
+cmp_contact_info (ContactInfo **ci1, ContactInfo **ci2)
+{
+	return strcmp ((*ci1)->_key, (*ci2)->_key);
+}
+
+
+/* merge the (sorted) records with the (sorted) new contacts, in the
+ * order of their keys */
 static void
-each_keyval (const char *group, ContactInfo *cinfo, MuContacts *self)
+merge_records (MuContacts *self, GArray *recs, GString *strs)
 {
-	/* use set value so the string do not necessarily have to be
-	 * valid utf-8 */
-	if (cinfo->_name)
-		g_key_file_set_value (self->_ccache, group, NAME_KEY,
-				       cinfo->_name);
+	GPtrArray *added;
+	guint32 u, v;
+
+	added = g_ptr_array_sized_new (self->_table._used);
+	for (u = 0; u != self->_table._size; ++u)
+		if (self->_table._slots[u]._key)
+			g_ptr_array_add (added, &self->_table._slots[u]);
+	g_ptr_array_sort (added, (GCompareFunc)cmp_contact_info);
+
+	for (u = v = 0; u != self->_num || v != added->len;) {
+		const CacheRecord *rec;
+		const ContactInfo *cinfo;
+		int cmp;
+
+		rec   = u < self->_num ? &self->_recs[u] : NULL;
+		cinfo = v < added->len ? added->pdata[v] : NULL;
+		cmp   = !rec ? 1 : !cinfo ? -1 :
+			g_strcmp0 (rec_str (self, rec->key), cinfo->_key);
+
+		if (cmp < 0) {
+			if (rec_str (self, rec->key) &&
+			    rec_str (self, rec->email))
+				add_record (recs, strs,
+					    rec_str (self, rec->key),
+					    rec_str (self, rec->email),
+					    rec_str (self, rec->name),
+					    rec->personal, (time_t)rec->tstamp,
+					    rec->freq, rec->generation);
+			++u;
+			continue;
+		}
+
+		add_record (recs, strs, cinfo->_key, cinfo->_email,
+			    cinfo->_name, cinfo->_personal, cinfo->_tstamp,
+			    cinfo->_freq, cinfo->_generation);
+		u += cmp == 0 ? 1 : 0; /* the new one replaces the record */
+		++v;
+	}
 
-	g_key_file_set_value (self->_ccache, group, EMAIL_KEY,
-			       cinfo->_email);
-	g_key_file_set_boolean (self->_ccache, group, PERSONAL_KEY,
-				cinfo->_personal);
-	g_key_file_set_integer (self->_ccache, group, TSTAMP_KEY,
-				(int)cinfo->_tstamp);
+	g_ptr_array_free (added, TRUE);
 }
 
+
+static int
+cmp_generation (const guint32 *idx1, const guint32 *idx2, GArray *recs)
+{
+	guint32 gen1, gen2;
+
+	gen1 = g_array_index (recs, CacheRecord, *idx1).generation;
+	gen2 = g_array_index (recs, CacheRecord, *idx2).generation;
+
+	if (gen1 != gen2)
+		return gen1 < gen2 ? -1 : 1;
+
+	return *idx1 < *idx2 ? -1 : (*idx1 > *idx2);
+}
+
+
+/* the record indices, sorted by generation */
+static GArray*
+get_generations (GArray *recs)
+{
+	GArray *gens;
+	guint32 u;
+
+	gens = g_array_sized_new (FALSE, FALSE, sizeof(guint32), recs->len);
+	for (u = 0; u != recs->len; ++u)
+		g_array_append_val (gens, u);
+
+	g_array_sort_with_data (gens, (GCompareDataFunc)cmp_generation,
+				recs);
+	return gens;
+}
+
+
+/* put the sections of the cache file together */
+static GString*
+get_cache_data (MuContacts *self, GArray *recs, GArray *tokens,
+		GArray *gens, GString *strs)
+{
+	CacheHeader hdr;
+	GString *data;
+
+	memset (&hdr, 0, sizeof(hdr));
+	memcpy (hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version    = CACHE_VERSION;
+	hdr.num	       = recs->len;
+	hdr.strsize    = strs->len;
+	hdr.tokennum   = tokens->len;
+	hdr.generation = self->_generation;
+
+	data = g_string_sized_new (sizeof(hdr) + recs->len *
+				   sizeof(CacheRecord) + tokens->len *
+				   sizeof(CacheToken) + gens->len *
+				   sizeof(guint32) + strs->len);
+	g_string_append_len (data, (const char*)&hdr, sizeof(hdr));
+	g_string_append_len (data, recs->data,
+			     recs->len * sizeof(CacheRecord));
+	g_string_append_len (data, tokens->data,
+			     tokens->len * sizeof(CacheToken));
+	g_string_append_len (data, gens->data,
+			     gens->len * sizeof(guint32));
+	g_string_append_len (data, strs->str, strs->len);
+
+	return data;
+}
+
+
+/* write a new cache file; g_file_set_contents replaces the old one
+ * atomically, and our mapping of the old one stays valid */
 static gboolean
 serialize_cache (MuContacts *self)
 {
-	gchar *data;
-	gsize len;
+	GArray *recs, *tokens, *gens;
+	GString *data, *strs;
+	GError *err;
 	gboolean rv;
 
-	g_hash_table_foreach (self->_hash, (GHFunc)each_keyval, self);
+	recs = g_array_sized_new (FALSE, FALSE, sizeof(CacheRecord),
+				  self->_num + self->_added);
+	strs = g_string_sized_new (self->_strsize + 64 * self->_added);
+	merge_records (self, recs, strs);
+	tokens = get_tokens (recs, strs);
+	gens   = get_generations (recs);
+	data   = get_cache_data (self, recs, tokens, gens, strs);
 
-	/* Note: err arg is unused */
-	data = g_key_file_to_data (self->_ccache, &len, NULL);
-	if (len) {
-		GError *err;
-		err = NULL;
-		rv = g_file_set_contents (self->_path, data, len, &err);
-		if (!rv) {
-			g_warning ("failed to serialize cache to %s: %s",
-				   self->_path, err->message);
-			g_error_free (err);
-		}
-		g_free (data);
+	err = NULL;
+	rv  = g_file_set_contents (self->_path, data->str, data->len, &err);
+	if (!rv) {
+		g_warning ("failed to serialize cache to %s: %s",
+			   self->_path, err->message);
+		g_error_free (err);
 	}
 
+	g_string_free (data, TRUE);
+	g_string_free (strs, TRUE);
+	g_array_free (gens, TRUE);
+	g_array_free (tokens, TRUE);
+	g_array_free (recs, TRUE);
+
 	return rv;
 }
 
@@ -384,74 +1348,55 @@ mu_contacts_destroy (MuContacts *self)
 	if (!self)
 		return;
 
-	if (self->_ccache && self->_dirty) {
+	if (self->_dirty) {
 		serialize_cache (self);
 		MU_WRITE_LOG("serialized contacts cache %s",
 			     self->_path);
 	}
 
-	if (self->_ccache)
-		g_key_file_free (self->_ccache);
-
+	unload_cache (self);
 	g_free (self->_path);
 
-	if (self->_hash)
-		g_hash_table_destroy (self->_hash);
+	table_uninit (&self->_table);
 
 	g_free (self);
 }
 
 
 
-static void
-clear_str (char* str)
+/* a copy of str, with ctrl chars replaced by '_', since they could
+ * screw up the output, and without surrounding whitespace */
+static char*
+clean_str (const char *str)
 {
-	/* replace ctrl chars with '_' */
-	while (str && *str) {
-		if (iscntrl (*str))
-			*str = '_';
-		++str;
-	}
+	char *cur, *clean;
 
-	if (str)
-		g_strstrip (str);
-}
-
-/* note, we will *own* the name, email we get, and we'll free them in
- * the end... */
-static ContactInfo *
-contact_info_new (char *email, char *name, gboolean personal, time_t tstamp)
-{
-	ContactInfo *cinfo;
-
-	/* email should not be NULL, name can */
-	g_return_val_if_fail (email, NULL);
-
-	cinfo = g_slice_new (ContactInfo);
-
-	/* we need to clear the strings from control chars because
-	 * they could screw up the keyfile */
-	clear_str (email);
-	clear_str (name);
+	if (!str)
+		return NULL;
 
-	cinfo->_email    = email;
-	cinfo->_name     = name;
-	cinfo->_personal = personal;
-	cinfo->_tstamp   = tstamp;
+	clean = g_strdup (str);
+	for (cur = clean; *cur; ++cur)
+		if (iscntrl (*cur))
+			*cur = '_';
 
-	return cinfo;
+	return g_strstrip (clean);
 }
 
-static void
-contact_info_destroy (ContactInfo *cinfo)
+
+/* the key for an e-mail address: the clean, case-folded address */
+static char*
+get_key (const char *email)
 {
-	if (!cinfo)
-		return;
+	char *clean, *key;
 
-	g_free (cinfo->_email);
-	g_free (cinfo->_name);
+	clean = clean_str (email);
+	if (g_utf8_validate (clean, -1, NULL))
+		key = g_utf8_casefold (clean, -1);
+	else
+		key = g_ascii_strdown (clean, -1);
 
-	g_slice_free (ContactInfo, cinfo);
+	g_free (clean);
+	return key;
 }
 
 
@@ -460,5 +1405,5 @@ mu_contacts_count (MuContacts *self)
 {
 	g_return_val_if_fail (self, 0);
 
-	return g_hash_table_size (self->_hash);
+	return self->_num + self->_added;
 }
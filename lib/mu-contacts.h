@@ -43,8 +43,10 @@ MuContacts* mu_contacts_new (const gchar *ccachefile)
 
 /**
  * add a contacts; if there's a contact with this e-mail address
- * already, it will not updated unless the timestamp of this one is
- * higher and has a non-empty name
+ * (ignoring case) already, its name will not updated unless the timestamp of this one
+ * is higher and has a non-empty name. Either way, we count how often
+ * we have seen the contact, and when we saw it last, for ranking
+ * completions (see mu_contacts_complete)
  *
  * @param contacts a contacts object
  * @param email e-mail address of the contact (not NULL)
@@ -53,11 +55,60 @@ MuContacts* mu_contacts_new (const gchar *ccachefile)
  *        appears in one of the address fields)
  * @param tstamp timestamp for this address
  *
- * @return TRUE if succeeded, FALSE otherwise
+ * @return TRUE if the contact was added or got a new name, FALSE
+ * otherwise
  */
 gboolean mu_contacts_add (MuContacts *self, const char *email,
 			  const char* name, gboolean personal, time_t tstamp);
 
+
+struct _MuContactsDelta;
+typedef struct _MuContactsDelta MuContactsDelta;
+
+/**
+ * create a new, empty set of contact changes; during indexing, each
+ * indexer can collect its contacts in its own delta, and merge it
+ * with the contacts (mu_contacts_merge) when it commits, so the
+ * contacts are only touched once per batch. Use
+ * mu_contacts_delta_destroy when you no longer need it.
+ *
+ * @return a new MuContactsDelta
+ */
+MuContactsDelta* mu_contacts_delta_new (void) G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * add a contact to a delta; this works like mu_contacts_add
+ *
+ * @param delta a delta
+ * @param email e-mail address of the contact (not NULL)
+ * @param name name of the contact (or NULL)
+ * @param personal whether the contact is 'personal'
+ * @param tstamp timestamp for this address
+ */
+void mu_contacts_delta_add (MuContactsDelta *delta, const char *email,
+			    const char* name, gboolean personal,
+			    time_t tstamp);
+
+/**
+ * destroy a delta
+ *
+ * @param delta a delta, or NULL
+ */
+void mu_contacts_delta_destroy (MuContactsDelta *delta);
+
+/**
+ * merge the contacts in a delta with the contacts, and empty the
+ * delta, so it can be used for the next batch. A delta is not
+ * thread-safe, nor is MuContacts; with multiple indexers, each needs
+ * its own delta, and they need to take turns merging.
+ *
+ * @param self a contacts object
+ * @param delta a delta
+ *
+ * @return the number of contacts that were added or got a new name
+ */
+size_t mu_contacts_merge (MuContacts *self, MuContactsDelta *delta);
+
 /**
  * destroy the Contacts object
  *
@@ -122,6 +173,61 @@ typedef void (*MuContactsForeachFunc) (const char *email, const char *name,
 gboolean mu_contacts_foreach (MuContacts *self, MuContactsForeachFunc func,
 			      gpointer user_data, const char* pattern, size_t *num);
 
+
+/**
+ * get the current generation of the contacts; each change to a
+ * contact (adding it, or changing its name) gets a new, higher
+ * generation number, which is kept in the cache
+ *
+ * @param self contacts object
+ *
+ * @return the generation of the latest change
+ */
+guint32 mu_contacts_generation (MuContacts *self);
+
+
+/**
+ * call a function for each contact that changed after the given
+ * generation (see mu_contacts_generation), in the order of the
+ * changes; this only looks at the changed contacts, so frontends can
+ * cheaply update their list of contacts
+ *
+ * @param self contacts object
+ * @param generation a generation number, or 0 for all contacts
+ * @param func callback function to be called for each
+ * @param user_data user data to pass to the callback
+ * @param num receives the number of contacts found, or NULL
+ *
+ * @return TRUE if the function succeeded, FALSE otherwise
+ */
+gboolean mu_contacts_foreach_since (MuContacts *self, guint32 generation,
+				    MuContactsForeachFunc func,
+				    gpointer user_data, size_t *num);
+
+
+/**
+ * call a function for the contacts for which a word of the
+ * (normalized, lower-case) name or the e-mail address starts with
+ * prefix, the most useful ones first: contacts we have seen more
+ * often, and more recently, rank higher. This uses the completion
+ * index in the contacts cache, so it does not have to look at all
+ * contacts.
+ *
+ * @param self contacts object
+ * @param prefix the prefix to complete (not NULL)
+ * @param personal if TRUE, only consider 'personal' contacts
+ * @param limit the maximum number of contacts, or 0 for no limit
+ * @param func callback function to be called for each
+ * @param user_data user data to pass to the callback
+ * @param num receives the number of contacts found, or NULL
+ *
+ * @return TRUE if the function succeeded, FALSE otherwise
+ */
+gboolean mu_contacts_complete (MuContacts *self, const char *prefix,
+			       gboolean personal, size_t limit,
+			       MuContactsForeachFunc func, gpointer user_data,
+			       size_t *num);
+
 G_END_DECLS
 
 #endif /*__MU_CONTACTS_H__*/
@@ -39,35 +39,80 @@ typedef struct _Path Path;
 static Path* path_new (guint initial);
 static void  path_destroy (Path *p);
 static void  path_inc (Path *p, guint index);
-static gchar* path_to_string (Path *p, const char* frmt);
 
-MuContainer*
-mu_container_new (MuMsg *msg, guint docid, const char *msgid)
-{
-	MuContainer *c;
+/* the arena is a list of fixed-size blocks, so the containers never
+ * move */
+#define ARENA_BLOCK_SIZE 1024
 
-	g_return_val_if_fail (!msg || docid != 0, NULL);
+struct _MuContainerArena {
+	GPtrArray	*blocks;
+	guint		 num;
+};
 
-	c = g_slice_new0 (MuContainer);
-	if (msg)
-		c->msg = mu_msg_ref (msg);
+MuContainerArena*
+mu_container_arena_new (void)
+{
+	MuContainerArena *arena;
 
-	c->docid = docid;
-	c->msgid = msgid;
+	arena	      = g_slice_new0 (MuContainerArena);
+	arena->blocks = g_ptr_array_new_with_free_func (g_free);
 
-	return c;
+	return arena;
 }
 
 void
-mu_container_destroy (MuContainer *c)
+mu_container_arena_destroy (MuContainerArena *arena)
 {
-	if (!c)
+	if (!arena)
 		return;
 
-	if (c->msg)
-		mu_msg_unref (c->msg);
+	g_ptr_array_free (arena->blocks, TRUE);
+	g_slice_free (MuContainerArena, arena);
+}
 
-	g_slice_free (MuContainer, c);
+guint
+mu_container_arena_size (MuContainerArena *arena)
+{
+	g_return_val_if_fail (arena, 0);
+
+	return arena->num;
+}
+
+MuContainer*
+mu_container_arena_get (MuContainerArena *arena, guint idx)
+{
+	MuContainer *block;
+
+	g_return_val_if_fail (arena, NULL);
+	g_return_val_if_fail (idx < arena->num, NULL);
+
+	block = (MuContainer*)g_ptr_array_index (arena->blocks,
+						 idx / ARENA_BLOCK_SIZE);
+	return &block[idx % ARENA_BLOCK_SIZE];
+}
+
+
+MuContainer*
+mu_container_new (MuContainerArena *arena, MuContainerMsg *msg, guint docid,
+		  const char *msgid)
+{
+	MuContainer *c;
+
+	g_return_val_if_fail (arena, NULL);
+	g_return_val_if_fail (!msg || docid != 0, NULL);
+
+	if (arena->num % ARENA_BLOCK_SIZE == 0)
+		g_ptr_array_add (arena->blocks,
+				 g_new0 (MuContainer, ARENA_BLOCK_SIZE));
+
+	c = mu_container_arena_get (arena, arena->num++);
+
+	c->msg   = msg;
+	c->docid = docid;
+	c->msgid = msgid;
+	c->idx	 = c->set = arena->num - 1;
+
+	return c;
 }
 
 
@@ -197,23 +242,24 @@ mu_container_remove_child (MuContainer *c, MuContainer *child)
 	return c;
 }
 
-typedef void (*MuContainerPathForeachFunc) (MuContainer*, gpointer, Path*);
+typedef gboolean (*MuContainerPathForeachFunc) (MuContainer*, gpointer,
+						 Path*, guint);
 
 static void
 mu_container_path_foreach_real (MuContainer *c, guint level, Path *path,
 			     MuContainerPathForeachFunc func, gpointer user_data)
 {
-	if (!c)
-		return;
+	/* iterate over the siblings, so we only recurse as deep as
+	 * the thread, even for a long list of siblings */
+	for (; c; c = c->next) {
 
-	path_inc (path, level);
-	func (c, user_data, path);
+		path_inc (path, level);
+		func (c, user_data, path, level);
 
-	/* children */
-	mu_container_path_foreach_real (c->child, level + 1, path, func, user_data);
-
-	/* siblings */
-	mu_container_path_foreach_real (c->next, level, path, func, user_data);
+		/* children */
+		mu_container_path_foreach_real (c->child, level + 1, path,
+						func, user_data);
+	}
 }
 
 static void
@@ -268,46 +314,41 @@ mu_container_splice_children (MuContainer *parent, MuContainer *child)
 }
 
 
-static GSList*
-mu_container_to_list (MuContainer *c)
-{
-	GSList *lst;
-
-	for (lst = NULL; c; c = c->next)
-		lst = g_slist_prepend (lst, c);
-
-	return lst;
-}
-
-
-static MuContainer*
-mu_container_from_list (GSList *lst)
-{
-	MuContainer *c, *cur;
-
-	if (!lst)
-		return NULL;
-
-	for (c = cur = (MuContainer*)lst->data; cur; lst = g_slist_next(lst)) {
-		cur->next = lst ? (MuContainer*)lst->data : NULL;
-		cur=cur->next;
-	}
-
-	return c;
-}
-
 struct _SortFuncData {
 	MuMsgFieldId         mfid;
 	gboolean             revert;
 	gpointer             user_data;
+	GPtrArray	    *siblings; /* scratch space for sorting */
 };
 typedef struct _SortFuncData SortFuncData;
 
 
 static int
-sort_func_wrapper (MuContainer *a, MuContainer *b, SortFuncData *data)
+cmp_msg (MuContainerMsg *m1, MuContainerMsg *m2, MuMsgFieldId mfid)
+{
+	if (mu_msg_field_is_numeric (mfid)) {
+		if (m1->sortnum != m2->sortnum)
+			return m1->sortnum < m2->sortnum ? -1 : 1;
+	} else {
+		int diff;
+		/* the keys are normalized already, so we can use strcmp */
+		diff = g_strcmp0 (m1->sortkey, m2->sortkey);
+		if (diff != 0)
+			return diff;
+	}
+
+	/* keep equal messages in the order of the matches */
+	return m1->rank < m2->rank ? -1 : (m1->rank > m2->rank ? 1 : 0);
+}
+
+
+static int
+sort_func_wrapper (MuContainer **ap, MuContainer **bp, SortFuncData *data)
 {
-	MuContainer *a1, *b1;
+	MuContainer *a, *b, *a1, *b1;
+
+	a = *ap;
+	b = *bp;
 
 	/* use the first non-empty 'left child' message if this one
 	 * is */
@@ -322,16 +363,17 @@ sort_func_wrapper (MuContainer *a, MuContainer *b, SortFuncData *data)
 		return -1;
 
 	if (data->revert)
-		return mu_msg_cmp (b1->msg, a1->msg, data->mfid);
+		return cmp_msg (b1->msg, a1->msg, data->mfid);
 	else
-		return mu_msg_cmp (a1->msg, b1->msg, data->mfid);
+		return cmp_msg (a1->msg, b1->msg, data->mfid);
 }
 
 static MuContainer*
 mu_container_sort_real (MuContainer *c, SortFuncData *sfdata)
 {
-	GSList *lst;
+	GPtrArray *sibs;
 	MuContainer *cur;
+	guint u;
 
 	if (!c)
 		return NULL;
@@ -340,15 +382,21 @@ mu_container_sort_real (MuContainer *c, SortFuncData *sfdata)
 		if (cur->child)
 			cur->child = mu_container_sort_real (cur->child, sfdata);
 
-	/* sort siblings */
-	lst = mu_container_to_list (c);
-	lst = g_slist_sort_with_data(lst,
-				     (GCompareDataFunc)sort_func_wrapper,
-				     sfdata);
-	c = mu_container_from_list (lst);
-	g_slist_free (lst);
+	/* sort siblings, as an array */
+	sibs = sfdata->siblings;
+	g_ptr_array_set_size (sibs, 0);
+	for (cur = c; cur; cur = cur->next)
+		g_ptr_array_add (sibs, cur);
 
-	return c;
+	g_ptr_array_sort_with_data (sibs, (GCompareDataFunc)sort_func_wrapper,
+				    sfdata);
+
+	for (u = 0; u != sibs->len; ++u)
+		((MuContainer*)g_ptr_array_index (sibs, u))->next =
+			u + 1 < sibs->len ?
+			(MuContainer*)g_ptr_array_index (sibs, u + 1) : NULL;
+
+	return (MuContainer*)g_ptr_array_index (sibs, 0);
 }
 
 
@@ -358,14 +406,18 @@ mu_container_sort (MuContainer *c, MuMsgFieldId mfid, gboolean revert,
 {
 	SortFuncData sfdata;
 
+	g_return_val_if_fail (c, NULL);
+	g_return_val_if_fail (mu_msg_field_id_is_valid(mfid), NULL);
+
 	sfdata.mfid	 = mfid;
 	sfdata.revert	 = revert;
 	sfdata.user_data = user_data;
+	sfdata.siblings	 = g_ptr_array_new ();
 
-	g_return_val_if_fail (c, NULL);
-	g_return_val_if_fail (mu_msg_field_id_is_valid(mfid), NULL);
+	c = mu_container_sort_real (c, &sfdata);
+	g_ptr_array_free (sfdata.siblings, TRUE);
 
-	return mu_container_sort_real (c, &sfdata);
+	return c;
 }
 
 
@@ -393,18 +445,14 @@ mu_container_reachable (MuContainer *haystack, MuContainer *needle)
 static gboolean
 dump_container (MuContainer *c)
 {
-	const gchar* subject;
-
 	if (!c) {
 		g_print ("<empty>\n");
 		return TRUE;
 	}
 
-	subject =  (c->msg) ? mu_msg_get_subject (c->msg) : "<none>";
-
-	g_print ("[%s][%s m:%p p:%p docid:%u %s]\n",c->msgid, subject, (void*)c,
+	g_print ("[%s m:%p p:%p docid:%u %s]\n",c->msgid, (void*)c,
 		 (void*)c->parent, c->docid,
-		 c->msg ? mu_msg_get_path (c->msg) : "");
+		 c->msg ? c->msg->path : "");
 
 	return TRUE;
 }
@@ -452,7 +500,7 @@ path_inc (Path *p, guint index)
 {
 	if (index + 1 >= p->_len) {
 		p->_data = g_renew (int, p->_data, 2 * p->_len);
-		memset (&p->_data[p->_len], 0, p->_len);
+		memset (&p->_data[p->_len], 0, p->_len * sizeof(int));
 		p->_len *= 2;
 	}
 
@@ -461,155 +509,111 @@ path_inc (Path *p, guint index)
 }
 
 
-static gchar*
-path_to_string (Path *p, const char* frmt)
-{
-	char *str;
-	guint u;
-
-	if (!p->_data)
-		return NULL;
-
-	for (u = 0, str = NULL; p->_data[u] != 0; ++u) {
-
-		char segm[16];
-		snprintf (segm, sizeof(segm), frmt, p->_data[u] - 1);
-
-		if (!str)
-			str = g_strdup (segm);
-		else {
-			gchar *tmp;
-			tmp = g_strdup_printf ("%s:%s", str, segm);
-			g_free (str);
-			str = tmp;
-		}
-	}
-
-	return str;
-}
-
-static unsigned
-count_colons (const char *str)
-{
-	unsigned num;
-
-	num = 0;
-	while (str++ && *str)
-		if (*str == ':')
-			++num;
-
-	return num;
-}
-
-
-
-static MuMsgIterThreadInfo*
-thread_info_new (gchar *threadpath, gboolean root, gboolean child,
-		 gboolean empty_parent, gboolean has_child, gboolean is_dup)
+/* the total number of path segments for the messages in the tree */
+static gboolean
+count_segments (MuContainer *c, gsize *segnum, Path *path, guint level)
 {
-	MuMsgIterThreadInfo *ti;
-
-	ti		     = g_slice_new (MuMsgIterThreadInfo);
-	ti->threadpath	     = threadpath;
-	ti->level            = count_colons (threadpath); /* hacky... */
-
-	ti->prop  = 0;
-	ti->prop |= root         ? MU_MSG_ITER_THREAD_PROP_ROOT         : 0;
-	ti->prop |= child        ? MU_MSG_ITER_THREAD_PROP_FIRST_CHILD  : 0;
-	ti->prop |= empty_parent ? MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT : 0;
-	ti->prop |= is_dup       ? MU_MSG_ITER_THREAD_PROP_DUP          : 0;
-	ti->prop |= has_child    ? MU_MSG_ITER_THREAD_PROP_HAS_CHILD    : 0;
-
-	return ti;
-}
+	if (c->msg)
+		*segnum += level + 1;
 
-static void
-thread_info_destroy (MuMsgIterThreadInfo *ti)
-{
-	if (ti) {
-		g_free (ti->threadpath);
-		g_slice_free (MuMsgIterThreadInfo, ti);
-	}
+	return TRUE;
 }
 
 
 struct _ThreadInfo {
-	GHashTable		*hash;
-	const char*		 format;
+	MuMsgIterThreadInfo	*info;	 /* indexed by rank */
+	size_t			 matchnum;
+	guint32			*segs;	 /* the next free path segment */
+	guint			 order;
+	guint8			 width;
 };
 typedef struct _ThreadInfo	 ThreadInfo;
 
 
-static void
-add_to_thread_info_hash (GHashTable *thread_info_hash, MuContainer *c,
-			 char *threadpath)
+static MuMsgIterThreadProp
+get_thread_prop (MuContainer *c)
 {
-	gboolean is_root, first_child, empty_parent, is_dup, has_child;
+	MuMsgIterThreadProp prop;
+
+	prop = 0;
 
 	/* 'root' means we're a child of the dummy root-container */
-	is_root = (c->parent == NULL);
+	if (!c->parent)
+		prop |= MU_MSG_ITER_THREAD_PROP_ROOT;
+	else {
+		if (c->parent->child == c)
+			prop |= MU_MSG_ITER_THREAD_PROP_FIRST_CHILD;
+		if (!c->parent->msg)
+			prop |= MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT;
+	}
 
-	first_child  = is_root ? FALSE : (c->parent->child == c);
-	empty_parent = is_root ? FALSE : (!c->parent->msg);
-	is_dup	     = c->flags & MU_CONTAINER_FLAG_DUP;
-	has_child    = c->child ? TRUE : FALSE;
+	if (c->flags & MU_CONTAINER_FLAG_DUP)
+		prop |= MU_MSG_ITER_THREAD_PROP_DUP;
+	if (c->child)
+		prop |= MU_MSG_ITER_THREAD_PROP_HAS_CHILD;
 
-	g_hash_table_insert (thread_info_hash,
-			     GUINT_TO_POINTER(c->docid),
-			     thread_info_new (threadpath,
-					      is_root,
-					      first_child,
-					      empty_parent,
-					      has_child,
-					      is_dup));
+	return prop;
 }
 
-/* device a format string that is the minimum size to fit up to
- * matchnum matches -- returns static memory */
-static const char*
-thread_segment_format_string (size_t matchnum)
+
+static gboolean
+add_thread_info (MuContainer *c, ThreadInfo *tinfo, Path *path, guint level)
 {
-	unsigned digitnum;
-	static char frmt[16];
+	MuMsgIterThreadInfo *ti;
+	guint u;
 
-	/* get the number of digits needed in a hex-representation of
-	 * matchnum */
-	digitnum = (unsigned) (ceil (log(matchnum)/log(16)));
-	snprintf (frmt, sizeof(frmt),"%%0%ux", digitnum);
+	if (!c->msg) /* empty containers only take up a path segment */
+		return TRUE;
 
-	return frmt;
-}
+	g_return_val_if_fail (c->msg->rank < tinfo->matchnum, FALSE);
 
-static gboolean
-add_thread_info (MuContainer *c, ThreadInfo *ti, Path *path)
-{
-	gchar *pathstr;
+	ti	  = &tinfo->info[c->msg->rank];
+	ti->path  = tinfo->segs;
+	ti->level = level;
+	ti->order = tinfo->order++;
+	ti->width = tinfo->width;
+	ti->prop  = get_thread_prop (c);
 
-	pathstr = path_to_string (path, ti->format);
-	add_to_thread_info_hash (ti->hash, c, pathstr);
+	for (u = 0; u <= level; ++u)
+		*tinfo->segs++ = (guint32)path->_data[u] - 1;
 
 	return TRUE;
 }
 
 
-GHashTable*
-mu_container_thread_info_hash_new (MuContainer *root_set, size_t matchnum)
+/* the minimum number of hex digits to fit up to matchnum matches */
+static guint8
+thread_segment_width (size_t matchnum)
 {
-	ThreadInfo ti;
+	return (guint8) (ceil (log(matchnum)/log(16)));
+}
+
+
+MuMsgIterThreadInfo*
+mu_container_thread_info_new (MuContainer *root_set, size_t matchnum)
+{
+	ThreadInfo tinfo;
+	gsize segnum;
 
 	g_return_val_if_fail (root_set, NULL);
 	g_return_val_if_fail (matchnum > 0, NULL);
 
-	/* create hash docid => thread-info */
-	ti.hash = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-					 NULL,
-					 (GDestroyNotify)thread_info_destroy);
+	segnum = 0;
+	mu_container_path_foreach (root_set,
+				   (MuContainerPathForeachFunc)count_segments,
+				   &segnum);
 
-	ti.format     = thread_segment_format_string (matchnum);
+	/* allocate the info and the path segments in one block */
+	tinfo.info     = g_malloc0 (matchnum * sizeof(MuMsgIterThreadInfo) +
+				    segnum * sizeof(guint32));
+	tinfo.matchnum = matchnum;
+	tinfo.segs     = (guint32*)(tinfo.info + matchnum);
+	tinfo.order    = 0;
+	tinfo.width    = thread_segment_width (matchnum);
 
 	mu_container_path_foreach (root_set,
-				(MuContainerPathForeachFunc)add_thread_info,
-				&ti);
+				   (MuContainerPathForeachFunc)add_thread_info,
+				   &tinfo);
 
-	return ti.hash;
+	return tinfo.info;
 }
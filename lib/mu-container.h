@@ -22,6 +22,7 @@
 
 #include <glib.h>
 #include <mu-msg.h>
+#include <mu-msg-iter.h>
 
 enum _MuContainerFlag {
 	MU_CONTAINER_FLAG_NONE    = 0,
@@ -32,6 +33,24 @@ enum _MuContainerFlag {
 
 typedef guint8 MuContainerFlag;
 
+/*
+ * the information about a message the threader needs; this is read
+ * from the value slots of the matches, so we don't need to create a
+ * MuMsg for each of them
+ */
+struct _MuContainerMsg {
+	const char *msgid;   /* the message-id, or the path if there's none */
+	const char *path;
+	GSList     *refs;    /* list of message-ids of the references */
+	const char *parent;  /* msgid of the parent stored at index time */
+	const char *sortkey; /* sort key, for sorting by string fields */
+	gint64      sortnum; /* value, for sorting by numeric fields */
+	guint       rank;    /* the position of the message in the matches */
+	const char *subject; /* interned key of the normalized subject, or NULL */
+	gboolean    is_reply; /* whether the subject had a Re:/Fwd: prefix */
+};
+typedef struct _MuContainerMsg MuContainerMsg;
+
 /*
  * MuContainer data structure, as seen in JWZs document:
  *     http://www.jwz.org/doc/threading.html
@@ -39,32 +58,70 @@ typedef guint8 MuContainerFlag;
 struct _MuContainer {
 	struct _MuContainer *parent, *child, *next;
 	MuContainerFlag flags;
-	MuMsg *msg;
+	guint8 rank;		/* union-find rank */
+	MuContainerMsg *msg;
 	guint docid;
+	guint idx;		/* our index in the arena */
+	guint set;		/* union-find parent (an arena index) */
 	const char* msgid;
 };
 typedef struct _MuContainer MuContainer;
 
+/*
+ * containers are allocated from an arena, and all freed together
+ * when the arena is destroyed; each container has a fixed index in
+ * its arena
+ */
+struct _MuContainerArena;
+typedef struct _MuContainerArena MuContainerArena;
+
+/**
+ * create a new container arena
+ *
+ * @return a new arena; free with mu_container_arena_destroy
+ */
+MuContainerArena* mu_container_arena_new (void);
 
 /**
- * create a new Container object
+ * destroy an arena, and all the containers in it
  *
- * @param msg a MuMsg, or NULL; when it's NULL, docid should be 0
- * @param docid a Xapian docid, or 0
- * @param msgid a message id, or NULL
+ * @param arena an arena, or NULL
+ */
+void mu_container_arena_destroy (MuContainerArena *arena);
+
+/**
+ * get the number of containers in the arena
  *
- * @return a new Container instance, or NULL in case of error; free
- * with mu_container_destroy
+ * @param arena an arena
+ *
+ * @return the number of containers
  */
-MuContainer* mu_container_new (MuMsg *msg, guint docid, const char* msgid);
+guint mu_container_arena_size (MuContainerArena *arena);
 
+/**
+ * get the container with the given index
+ *
+ * @param arena an arena
+ * @param idx an index < mu_container_arena_size
+ *
+ * @return the container
+ */
+MuContainer* mu_container_arena_get (MuContainerArena *arena, guint idx);
 
 /**
- * free a Container object
+ * create a new Container object in an arena
+ *
+ * @param arena an arena
+ * @param msg a MuContainerMsg, or NULL; when it's NULL, docid should
+ * be 0. The container does not take ownership of the msg
+ * @param docid a Xapian docid, or 0
+ * @param msgid a message id, or NULL
  *
- * @param c a Container object, or NULL
+ * @return a new Container instance, or NULL in case of error; it
+ * is freed with the arena
  */
-void       mu_container_destroy (MuContainer *c);
+MuContainer* mu_container_new (MuContainerArena *arena, MuContainerMsg *msg,
+			       guint docid, const char* msgid);
 
 
 
@@ -170,6 +227,9 @@ typedef int (*MuContainerCmpFunc) (MuContainer *c1, MuContainer *c2,
  * siblings (children) will be sorted according to @func; if the
  * container is empty, the first non-empty 'leftmost' child is used.
  *
+ * the sorting uses the sortkey (for string fields) or sortnum (for
+ * numeric fields) of the containers' messages
+ *
  * @param c a container
  * @param mfid the field to sort by
  * @param revert if TRUE, revert the sorting order *
@@ -182,16 +242,18 @@ MuContainer* mu_container_sort (MuContainer *c, MuMsgFieldId mfid, gboolean reve
 
 
 /**
- * create a hashtable with maps document-ids to information about them,
- * ie. Xapian docid => MuMsgIterThreadInfo
+ * get the thread information for the messages in the tree, as an
+ * array indexed by the rank of the messages in the matches (see
+ * MuContainerMsg::rank)
  *
- * @param root_set the containers @param matchnum the number of
- * matches in the list (this is needed to determine the shortest
- * possible collation keys ('threadpaths') for the messages
+ * @param root_set the containers
+ * @param matchnum the number of matches in the list (this is needed
+ * to determine the shortest possible path segments for the messages)
  *
- * @return a hash; free with g_hash_table_destroy
+ * @return an array of matchnum elements (including the path segments
+ * they refer to); free with g_free
  */
-GHashTable* mu_container_thread_info_hash_new (MuContainer *root_set,
-					       size_t matchnum);
+MuMsgIterThreadInfo* mu_container_thread_info_new (MuContainer *root_set,
+						   size_t matchnum);
 
 #endif /*__MU_CONTAINER_H__*/
@@ -245,7 +245,8 @@ static const MuMsgField FIELD_DATA[] = {
 		FLAG_XAPIAN_TERM | FLAG_XAPIAN_PREFIX_ONLY
 	}
 
-	/* note, mu-store also use the 'Q' internal prefix for its uids */
+	/* note, mu-store also use the 'Q' internal prefix for its uids,
+	 * and 'V' for its thread-ids */
 };
 
 /* the MsgField data in an array, indexed by the MsgFieldId;
@@ -25,62 +25,49 @@
 #include <algorithm>
 #include <xapian.h>
 #include <string>
+#include <vector>
 
 #include "mu-util.h"
 #include "mu-msg.h"
 #include "mu-msg-iter.h"
 #include "mu-threader.h"
+#include "mu-date.h"
+#include "mu-store.h"
 
 /* just a guess... */
 #define MAX_FETCH_SIZE 10000
 
-class ThreadKeyMaker: public Xapian::KeyMaker {
-public:
-	ThreadKeyMaker (GHashTable *threadinfo): _threadinfo(threadinfo) {}
-	virtual std::string operator()(const Xapian::Document &doc) const  {
-		MuMsgIterThreadInfo *ti;
-		ti = (MuMsgIterThreadInfo*)g_hash_table_lookup
-			(_threadinfo,
-			 GUINT_TO_POINTER(doc.get_docid()));
-		return std::string (ti && ti->threadpath ? ti->threadpath : "");
-	}
-private:
-	GHashTable *_threadinfo;
-};
-
 
 struct _MuMsgIter {
 public:
 	_MuMsgIter (Xapian::Enquire &enq, size_t maxnum,
-		    gboolean threads, MuMsgFieldId sortfield, bool revert):
-		   _enq(enq), _thread_hash (0), _msg(0) {
-
-		_matches = _enq.get_mset (0, maxnum);
-
-		if (threads && !_matches.empty()) {
-
-			_matches.fetch();
-			_thread_hash = mu_threader_calculate
-				(this, _matches.size(), sortfield,
-				 revert ? TRUE: FALSE);
-
-			ThreadKeyMaker keymaker(_thread_hash);
-
-			enq.set_sort_by_key (&keymaker, false);
-			_matches = _enq.get_mset (0, maxnum);
-		}
+		    size_t checkatleast, gboolean threads, MuMsgFieldId sortfield, bool revert,
+		    bool group_subjects, bool stored_links):
+		   _enq(enq), _pos (0), _thread_info (0), _msg(0) {
 
+		_matches = _enq.get_mset (0, maxnum, checkatleast);
 		_cursor	 = _matches.begin();
 
 		/* this seems to make search slightly faster, some
 		 * non-scientific testing suggests. 5-10% or so */
 		if (_matches.size() <= MAX_FETCH_SIZE)
 			_matches.fetch ();
+
+		if (threads && !_matches.empty()) {
+			_thread_info = mu_threader_calculate
+				(this, _matches.size(), sortfield,
+				 revert ? TRUE: FALSE,
+				 group_subjects ? TRUE : FALSE,
+				 stored_links ? TRUE : FALSE);
+			/* don't re-run the query; simply visit the
+			 * matches we already have in thread order */
+			calculate_thread_order ();
+			set_cursor_pos (0);
+		}
 	}
 
 	~_MuMsgIter () {
-		if (_thread_hash)
-			g_hash_table_destroy (_thread_hash);
+		g_free (_thread_info);
 
 		set_msg (NULL);
 	}
@@ -89,10 +76,41 @@ public:
 	Xapian::MSet& matches() { return _matches; }
 
 	Xapian::MSet::const_iterator cursor () const { return _cursor; }
-	void set_cursor (Xapian::MSetIterator cur) { _cursor = cur; }
-	void cursor_next () { ++_cursor; }
 
-	GHashTable *thread_hash () { return _thread_hash; }
+	void cursor_reset () {
+		if (_order.empty())
+			_cursor = _matches.begin();
+		else
+			set_cursor_pos (0);
+	}
+
+	void cursor_next () {
+		if (_order.empty())
+			++_cursor;
+		else
+			set_cursor_pos (_pos + 1);
+	}
+
+	bool threaded () const { return _thread_info != NULL; }
+
+	/* the thread info for the current message, if any */
+	const MuMsgIterThreadInfo *thread_info () const {
+		if (!_thread_info || _pos >= _order.size())
+			return NULL;
+		else {
+			const MuMsgIterThreadInfo *ti;
+			ti = &_thread_info[_order[_pos]];
+			return ti->path ? ti : NULL;
+		}
+	}
+
+	/* storage for the strings in MuMsgIterRow */
+	std::string& row_str (MuMsgFieldId mfid) { return _row_strs[mfid]; }
+	std::string& subject_key_str () { return _subject_key_str; }
+	std::string& parent_str () { return _parent_str; }
+	std::string& sort_key_str (MuMsgFieldId mfid) {
+		return _sort_key_strs[mfid];
+	}
 
 	MuMsg *msg() { return _msg; }
 	MuMsg *set_msg (MuMsg *msg) {
@@ -102,17 +120,55 @@ public:
 	}
 
 private:
+	/* the permutation of the mset positions that gives us the
+	 * threaded order, based on the (depth-first) order in
+	 * _thread_info; matches without thread info go last */
+	void calculate_thread_order () {
+		std::vector<Xapian::doccount> rest;
+		Xapian::doccount idx, num;
+
+		num = _matches.size();
+		_order.assign (num, 0);
+
+		for (idx = 0; idx != num; ++idx) {
+			const MuMsgIterThreadInfo *ti;
+			ti = _thread_info ? &_thread_info[idx] : NULL;
+			if (ti && ti->path && ti->order < num)
+				_order[ti->order] = idx;
+			else
+				rest.push_back (idx);
+		}
+
+		std::copy (rest.begin(), rest.end(),
+			   _order.end() - rest.size());
+	}
+
+	void set_cursor_pos (size_t pos) {
+		_pos	= pos;
+		_cursor = _pos < _order.size() ?
+			_matches[_order[_pos]] : _matches.end();
+	}
+
 	const Xapian::Enquire		_enq;
 	Xapian::MSet			_matches;
 	Xapian::MSet::const_iterator	_cursor;
 
-	GHashTable      *_thread_hash;
+	std::vector<Xapian::doccount>	_order;
+	size_t				_pos;
+
+	MuMsgIterThreadInfo *_thread_info;
 	MuMsg		*_msg;
+
+	std::string	 _row_strs[MU_MSG_FIELD_ID_NUM];
+	std::string	 _subject_key_str;
+	std::string	 _parent_str;
+	std::string	 _sort_key_strs[MU_MSG_FIELD_ID_NUM];
 };
 
 MuMsgIter*
 mu_msg_iter_new (XapianEnquire *enq, size_t maxnum,
-		 gboolean threads, MuMsgFieldId sortfield, gboolean revert)
+		 size_t checkatleast, gboolean threads, MuMsgFieldId sortfield, gboolean revert,
+		 gboolean group_subjects, gboolean stored_links)
 {
 	g_return_val_if_fail (enq, NULL);
 	/* sortfield should be set to .._NONE when we're not threading */
@@ -122,8 +178,11 @@ mu_msg_iter_new (XapianEnquire *enq, size_t maxnum,
 			      sortfield == MU_MSG_FIELD_ID_NONE,
 			      FALSE);
 	try {
-		return new MuMsgIter ((Xapian::Enquire&)*enq, maxnum, threads,
-				      sortfield, revert ? true : false);
+		return new MuMsgIter ((Xapian::Enquire&)*enq, maxnum,
+				      checkatleast, threads,
+				      sortfield, revert ? true : false,
+				      group_subjects ? true : false,
+				      stored_links ? true : false);
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN(NULL);
 }
@@ -166,7 +225,7 @@ mu_msg_iter_reset (MuMsgIter *iter)
 	iter->set_msg (NULL);
 
 	try {
-		iter->set_cursor(iter->matches().begin());
+		iter->cursor_reset();
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN (FALSE);
 
@@ -219,26 +278,130 @@ mu_msg_iter_get_docid (MuMsgIter *iter)
 
 
 
+static void
+fill_row_field (MuMsgIter *iter, const Xapian::Document& doc,
+		MuMsgFieldId mfid, MuMsgIterRow *row)
+{
+	std::string& val (iter->row_str (mfid));
+
+	val = doc.get_value ((Xapian::valueno)mfid);
+	if (!mu_msg_field_is_numeric (mfid)) {
+		row->str[mfid] = val.empty() ? NULL : val.c_str();
+		return;
+	}
+
+	/* date is a special case, because we store dates as
+	 * strings; see mu-msg-doc.cc */
+	if (val.empty())
+		row->num[mfid] = 0;
+	else if (mfid == MU_MSG_FIELD_ID_DATE)
+		row->num[mfid] = (gint64)mu_date_str_to_time_t
+			(val.c_str(), FALSE/*utc*/);
+	else
+		row->num[mfid] = (gint64)Xapian::sortable_unserialise (val);
+}
+
+
+static void
+fill_row_sort_key (MuMsgIter *iter, const Xapian::Document& doc,
+		   MuMsgFieldId mfid, MuMsgIterRow *row)
+{
+	std::string& val (iter->sort_key_str (mfid));
+
+	val = doc.get_value
+		((Xapian::valueno)(MU_STORE_SLOT_SORT_KEY + mfid));
+	row->sort_key[mfid] = val.empty() ? NULL : val.c_str();
+}
+
+
+gboolean
+mu_msg_iter_get_row (MuMsgIter *iter, guint32 fields, MuMsgIterRow *row)
+{
+	g_return_val_if_fail (iter, FALSE);
+	g_return_val_if_fail (row, FALSE);
+	g_return_val_if_fail (!mu_msg_iter_is_done(iter), FALSE);
+
+	memset (row, 0, sizeof(MuMsgIterRow));
+
+	try {
+		const Xapian::Document doc (iter->cursor().get_document());
+		int mfid;
+
+		row->docid = doc.get_docid();
+		for (mfid = 0; mfid != MU_MSG_FIELD_ID_NUM; ++mfid) {
+			if (!(fields & MU_MSG_ITER_FIELD_MASK(mfid)))
+				continue;
+			if (mu_msg_field_xapian_value ((MuMsgFieldId)mfid))
+				fill_row_field (iter, doc, (MuMsgFieldId)mfid,
+						row);
+			if ((fields & MU_MSG_ITER_FIELD_SORT_KEYS) &&
+			    mu_store_field_has_sort_key ((MuMsgFieldId)mfid))
+				fill_row_sort_key (iter, doc,
+						   (MuMsgFieldId)mfid, row);
+		}
+
+		if (fields & MU_MSG_ITER_FIELD_SUBJECT_KEY) {
+			std::string& val (iter->subject_key_str());
+			val = doc.get_value
+				((Xapian::valueno)MU_STORE_SLOT_SUBJECT_KEY);
+			row->subject_key = val.empty() ? NULL : val.c_str();
+		}
+
+		if (fields & MU_MSG_ITER_FIELD_PARENT) {
+			std::string& val (iter->parent_str());
+			val = doc.get_value
+				((Xapian::valueno)MU_STORE_SLOT_PARENT);
+			row->parent = val.empty() ? NULL : val.c_str();
+		}
+
+		return TRUE;
+
+	} MU_XAPIAN_CATCH_BLOCK_RETURN (FALSE);
+}
+
+
+unsigned int
+mu_msg_iter_get_collapse_count (MuMsgIter *iter)
+{
+	g_return_val_if_fail (!mu_msg_iter_is_done(iter), 0);
+	try {
+		return iter->cursor().get_collapse_count();
+
+	} MU_XAPIAN_CATCH_BLOCK_RETURN (0);
+}
+
+
 const MuMsgIterThreadInfo*
 mu_msg_iter_get_thread_info (MuMsgIter *iter)
 {
+	const MuMsgIterThreadInfo *ti;
+
 	g_return_val_if_fail (!mu_msg_iter_is_done(iter), NULL);
-	g_return_val_if_fail (iter->thread_hash(), NULL);
+	g_return_val_if_fail (iter->threaded(), NULL);
 
-	try {
-		const MuMsgIterThreadInfo *ti;
-		unsigned int docid;
+	ti = iter->thread_info();
+	if (!ti)
+		g_printerr ("no ti for %u\n", mu_msg_iter_get_docid (iter));
 
-		docid = mu_msg_iter_get_docid (iter);
-		ti    = (const MuMsgIterThreadInfo*)g_hash_table_lookup
-			(iter->thread_hash(), GUINT_TO_POINTER(docid));
+	return ti;
+}
 
-		if (!ti)
-			g_printerr ("no ti for %u\n", docid);
 
-		return ti;
+gchar*
+mu_msg_iter_thread_info_path (const MuMsgIterThreadInfo *ti)
+{
+	GString *gstr;
+	guint u;
 
-	} MU_XAPIAN_CATCH_BLOCK_RETURN (NULL);
+	g_return_val_if_fail (ti, NULL);
+	g_return_val_if_fail (ti->path, NULL);
+
+	gstr = g_string_sized_new ((ti->level + 1) * (ti->width + 1));
+	for (u = 0; u <= ti->level; ++u)
+		g_string_append_printf (gstr, u == 0 ? "%0*x" : ":%0*x",
+					(int)ti->width, ti->path[u]);
+
+	return g_string_free (gstr, FALSE);
 }
 
 
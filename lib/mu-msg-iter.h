@@ -44,17 +44,27 @@ typedef struct _MuMsgIter MuMsgIter;
  * @param enq a Xapian::Enquire* cast to XapianEnquire* (because this
  * is C, not C++),providing access to search results
  * @param batchsize how many results to retrieve at once
+ * @param checkatleast check at least this many matches, even if
+ * batchsize is smaller, e.g. to get exact collapse counts; or 0
  * @param threads whether to calculate threads
  * @param sorting field when using threads; note, when 'threads' is
  * FALSE, this should be MU_MSG_FIELD_ID_NONE
  * @param if TRUE, revert the sorting order
+ * @param group_subjects if TRUE, group threads by subject (only
+ * when 'threads' is TRUE)
+ * @param stored_links if TRUE, lay out the threads from the parent
+ * links stored at index time, rather than with the JWZ algorithm
+ * (only when 'threads' is TRUE)
  *
  * @return a new MuMsgIter, or NULL in case of error
  */
 MuMsgIter *mu_msg_iter_new (XapianEnquire *enq,
-			    size_t batchsize, gboolean threads,
+			    size_t batchsize, size_t checkatleast,
+			    gboolean threads,
 			    MuMsgFieldId threadsortfield,
-			    gboolean revert) G_GNUC_WARN_UNUSED_RESULT;
+			    gboolean revert,
+			    gboolean group_subjects,
+			    gboolean stored_links) G_GNUC_WARN_UNUSED_RESULT;
 
 /**
  * get the next message (which you got from
@@ -120,6 +130,79 @@ MuMsg* mu_msg_iter_get_msg_floating (MuMsgIter *iter)
 unsigned int     mu_msg_iter_get_docid         (MuMsgIter *iter);
 
 
+/**
+ * get the number of other messages that were collapsed into the
+ * current one, ie. when the query was run with
+ * MU_QUERY_FLAG_COLLAPSE_THREADS, the number of hidden messages in
+ * the same thread
+ *
+ * @param iter a valid MuMsgIter iterator
+ *
+ * @return the number of collapsed messages (0 if there are none, or
+ * if the results were not collapsed)
+ */
+unsigned int     mu_msg_iter_get_collapse_count (MuMsgIter *iter);
+
+
+/* a projection of (some of) the fields of the current message; see
+ * mu_msg_iter_get_row */
+struct _MuMsgIterRow {
+	unsigned	 docid;
+
+	/* the string fields (string-lists as comma-separated
+	 * strings), or NULL if they were not requested or are
+	 * empty. These strings are owned by the MuMsgIter, and are
+	 * valid until the next call to mu_msg_iter_get_row,
+	 * mu_msg_iter_next or mu_msg_iter_destroy */
+	const char	*str[MU_MSG_FIELD_ID_NUM];
+
+	/* the numeric fields, or 0 if not requested */
+	gint64		 num[MU_MSG_FIELD_ID_NUM];
+
+	/* the subject key (see MU_STORE_SLOT_SUBJECT_KEY), or NULL if
+	 * not requested or not available; owned by the MuMsgIter, as
+	 * above */
+	const char	*subject_key;
+
+	/* the sort keys (see mu_store_field_has_sort_key) for the
+	 * requested fields, with MU_MSG_ITER_FIELD_SORT_KEYS; NULL if
+	 * not requested or not available; owned by the MuMsgIter */
+	const char	*sort_key[MU_MSG_FIELD_ID_NUM];
+
+	/* the message-id of the parent, as stored at index time (see
+	 * MU_STORE_SLOT_PARENT), or NULL if not requested or if there
+	 * is none; owned by the MuMsgIter */
+	const char	*parent;
+};
+typedef struct _MuMsgIterRow MuMsgIterRow;
+
+/* get the bit for some field in the fields-mask for mu_msg_iter_get_row */
+#define MU_MSG_ITER_FIELD_MASK(MFID) (1U << (MFID))
+/* the bit to request the subject key */
+#define MU_MSG_ITER_FIELD_SUBJECT_KEY (1U << 31)
+/* the bit to request the sort keys for the requested fields */
+#define MU_MSG_ITER_FIELD_SORT_KEYS   (1U << 30)
+/* the bit to request the parent message-id */
+#define MU_MSG_ITER_FIELD_PARENT      (1U << 29)
+
+/**
+ * get some of the fields of the current message, directly from the
+ * database values; this is much cheaper than getting a full MuMsg
+ * through mu_msg_iter_get_msg_floating, as it does not allocate
+ * anything per message. Only fields that are stored as values in
+ * the database can be retrieved this way (ie., not the body).
+ *
+ * @param iter a valid MuMsgIter iterator
+ * @param fields bitwise-OR'd MU_MSG_ITER_FIELD_MASK values for the
+ * fields we are interested in
+ * @param row a caller-owned MuMsgIterRow to receive the fields
+ *
+ * @return TRUE if it worked, FALSE otherwise
+ */
+gboolean mu_msg_iter_get_row (MuMsgIter *iter, guint32 fields,
+			      MuMsgIterRow *row);
+
+
 /**
  * calculate the message threads
  *
@@ -140,14 +223,29 @@ enum _MuMsgIterThreadProp {
 typedef guint8 MuMsgIterThreadProp;
 
 struct _MuMsgIterThreadInfo {
-	gchar *threadpath; /* a string decribing the thread-path in
-			    * such a way that we can sort by this
-			    * string to get the right order. */
-	guint level;       /* thread-depth -- [0...] */
+	const guint32 *path; /* the thread-path segments; there are
+			      * level + 1 of them. NULL if the message
+			      * is not part of the threads */
+	guint level;         /* thread-depth -- [0...] */
+	guint order;         /* the (depth-first) position of the
+			      * message in the thread order */
+	guint8 width;        /* the width (in hex digits) of a path
+			      * segment when rendered as a string */
 	MuMsgIterThreadProp prop;
 };
 typedef struct _MuMsgIterThreadInfo MuMsgIterThreadInfo;
 
+/**
+ * render the thread-path of a message as a string, such as
+ * "00001:00000:00003"; the segments are zero-padded hex numbers, so
+ * the strings sort (with strcmp) in thread order
+ *
+ * @param ti thread info for a message
+ *
+ * @return the thread path; free with g_free
+ */
+gchar* mu_msg_iter_thread_info_path (const MuMsgIterThreadInfo *ti);
+
 /**
  * get a the MuMsgThreaderInfo struct for this message; this only
  * works when you created the mu-msg-iter with threading enabled
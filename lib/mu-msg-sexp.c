@@ -17,6 +17,7 @@
 **
 */
 #include <string.h>
+#include <stdio.h>
 
 #include "mu-str.h"
 #include "mu-msg.h"
@@ -24,6 +25,46 @@
 #include "mu-msg-part.h"
 #include "mu-maildir.h"
 
+/*
+ * we append everything straight to the caller's GString, escaping as
+ * we go, so serializing a message does not need any temporary
+ * strings; with a GString that is reused, it does not allocate at
+ * all.
+ */
+
+static void
+append_uint (GString *gstr, unsigned u)
+{
+	char buf[16];
+	int len;
+
+	len = snprintf (buf, sizeof(buf), "%u", u);
+	g_string_append_len (gstr, buf, len);
+}
+
+
+static void
+append_int (GString *gstr, int i)
+{
+	char buf[16];
+	int len;
+
+	len = snprintf (buf, sizeof(buf), "%d", i);
+	g_string_append_len (gstr, buf, len);
+}
+
+
+static void
+append_sexp_attr_uint (GString *gstr, const char* elm, unsigned u)
+{
+	g_string_append (gstr, "\t:");
+	g_string_append (gstr, elm);
+	g_string_append_c (gstr, ' ');
+	append_uint (gstr, u);
+	g_string_append_c (gstr, '\n');
+}
+
+
 static void
 append_sexp_attr_list (GString *gstr, const char* elm, const GSList *lst)
 {
@@ -32,14 +73,14 @@ append_sexp_attr_list (GString *gstr, const char* elm, const GSList *lst)
 	if (!lst)
 		return; /* empty list, don't include */
 
-	g_string_append_printf (gstr, "\t:%s ( ", elm);
+	g_string_append (gstr, "\t:");
+	g_string_append (gstr, elm);
+	g_string_append (gstr, " ( ");
 
 	for (cur = lst; cur; cur = g_slist_next(cur)) {
-		char *str;
-		str = mu_str_escape_c_literal
-			((const gchar*)cur->data, TRUE);
-		g_string_append_printf (gstr, "%s ", str);
-		g_free (str);
+		mu_str_append_escaped_c_literal
+			(gstr, (const gchar*)cur->data, TRUE);
+		g_string_append_c (gstr, ' ');
 	}
 
 	g_string_append (gstr, ")\n");
@@ -49,15 +90,14 @@ append_sexp_attr_list (GString *gstr, const char* elm, const GSList *lst)
 static void
 append_sexp_attr (GString *gstr, const char* elm, const char *str)
 {
-	gchar *esc;
-
 	if (!str || strlen(str) == 0)
 		return; /* empty: don't include */
 
-	esc = mu_str_escape_c_literal (str, TRUE);
-
-	g_string_append_printf (gstr, "\t:%s %s\n", elm, esc);
-	g_free (esc);
+	g_string_append (gstr, "\t:");
+	g_string_append (gstr, elm);
+	g_string_append_c (gstr, ' ');
+	mu_str_append_escaped_c_literal (gstr, str, TRUE);
+	g_string_append_c (gstr, '\n');
 }
 
 
@@ -68,24 +108,25 @@ struct _ContactData {
 };
 typedef struct _ContactData ContactData;
 
-static gchar*
-get_name_addr_pair (MuMsgContact *c)
+static void
+append_name_addr_pair (GString *gstr, MuMsgContact *c)
 {
-	gchar *name, *addr, *pair;
-
-	name = (char*)mu_msg_contact_name(c);
-	addr = (char*)mu_msg_contact_address(c);
-
-	name = name ? mu_str_escape_c_literal (name, TRUE) : NULL;
-	addr = addr ? mu_str_escape_c_literal (addr, TRUE) : NULL;
+	const char *name, *addr;
 
-	pair = g_strdup_printf ("(%s . %s)",
-				name ? name : "nil",
-				addr ? addr : "nil");
-	g_free (name);
-	g_free (addr);
+	name = mu_msg_contact_name (c);
+	addr = mu_msg_contact_address (c);
 
-	return pair;
+	g_string_append_c (gstr, '(');
+	if (name)
+		mu_str_append_escaped_c_literal (gstr, name, TRUE);
+	else
+		g_string_append (gstr, "nil");
+	g_string_append (gstr, " . ");
+	if (addr)
+		mu_str_append_escaped_c_literal (gstr, addr, TRUE);
+	else
+		g_string_append (gstr, "nil");
+	g_string_append_c (gstr, ')');
 }
 
 static void
@@ -101,7 +142,6 @@ add_prefix_maybe (GString *gstr, gboolean *field, const char *prefix)
 static gboolean
 each_contact (MuMsgContact *c, ContactData *cdata)
 {
-	char *pair;
 	MuMsgContactType ctype;
 
 	ctype = mu_msg_contact_type (c);
@@ -138,9 +178,7 @@ each_contact (MuMsgContact *c, ContactData *cdata)
 
 	cdata->prev_ctype = ctype;
 
-	pair = get_name_addr_pair (c);
-	g_string_append (cdata->gstr, pair);
-	g_free (pair);
+	append_name_addr_pair (cdata->gstr, c);
 
 	return TRUE;
 }
@@ -164,7 +202,8 @@ append_sexp_contacts (GString *gstr, MuMsg *msg)
 }
 
 struct _FlagData {
-	char *flagstr;
+	GString *gstr;
+	gboolean any;
 	MuFlags msgflags;
 };
 typedef struct _FlagData FlagData;
@@ -175,15 +214,13 @@ each_flag (MuFlags flag, FlagData *fdata)
 	if (!(flag & fdata->msgflags))
 		return;
 
-	if (!fdata->flagstr)
-		fdata->flagstr = g_strdup (mu_flag_name(flag));
-	else {
-		gchar *tmp;
-		tmp = g_strconcat (fdata->flagstr, " ",
-				   mu_flag_name(flag), NULL);
-		g_free (fdata->flagstr);
-		fdata->flagstr = tmp;
-	}
+	if (!fdata->any)
+		g_string_append (fdata->gstr, "\t:flags (");
+	else
+		g_string_append_c (fdata->gstr, ' ');
+
+	g_string_append (fdata->gstr, mu_flag_name(flag));
+	fdata->any = TRUE;
 }
 
 static void
@@ -191,14 +228,13 @@ append_sexp_flags (GString *gstr, MuMsg *msg)
 {
 	FlagData fdata;
 
+	fdata.gstr     = gstr;
+	fdata.any      = FALSE;
 	fdata.msgflags = mu_msg_get_flags (msg);
-	fdata.flagstr  = NULL;
 
 	mu_flags_foreach ((MuFlagsForeachFunc)each_flag, &fdata);
-	if (fdata.flagstr)
-		g_string_append_printf (gstr, "\t:flags (%s)\n",
-					fdata.flagstr);
-	g_free (fdata.flagstr);
+	if (fdata.any)
+		g_string_append (gstr, ")\n");
 }
 
 static char*
@@ -223,7 +259,8 @@ get_temp_file (MuMsg *msg, unsigned index)
 
 
 struct _PartInfo {
-	char *parts;
+	GString *gstr;
+	gboolean any;
 	gboolean want_images;
 };
 typedef struct _PartInfo PartInfo;
@@ -242,40 +279,49 @@ static void
 each_part (MuMsg *msg, MuMsgPart *part, PartInfo *pinfo)
 {
 	const char *fname;
-	char *name, *tmp;
-	char *tmpfile;
+	GString *gstr;
 
+	gstr = pinfo->gstr;
+	if (!pinfo->any)
+		g_string_append (gstr, "\t:parts (");
+	pinfo->any = TRUE;
+
+	g_string_append (gstr, "(:index ");
+	append_int (gstr, part->index);
+
+	g_string_append (gstr, " :name ");
 	if (!(fname = mu_msg_part_file_name (part)))
 		fname = mu_msg_part_description (part);
 	if (fname)
-		name = mu_str_escape_c_literal (fname, TRUE);
+		mu_str_append_escaped_c_literal (gstr, fname, TRUE);
 	else
-		name = g_strdup_printf ("\"%s-%s-%d\"",
+		g_string_append_printf (gstr, "\"%s-%s-%d\"",
 					elvis (part->type, "application"),
 					elvis (part->subtype, "octet-stream"),
 					part->index);
 
-	tmpfile = NULL;
-	if (pinfo->want_images && g_ascii_strcasecmp (part->type, "image") == 0) {
-		char *tmp;
-		if ((tmp = get_temp_file (msg, part->index))) {
-			tmpfile = mu_str_escape_c_literal (tmp, TRUE);
-			g_free (tmp);
+	g_string_append (gstr, " :mime-type \"");
+	g_string_append (gstr, elvis (part->type, "application"));
+	g_string_append_c (gstr, '/');
+	g_string_append (gstr, elvis (part->subtype, "octet-stream"));
+	g_string_append_c (gstr, '"');
+
+	if (pinfo->want_images &&
+	    g_ascii_strcasecmp (part->type, "image") == 0) {
+		char *tmpfile;
+		if ((tmpfile = get_temp_file (msg, part->index))) {
+			g_string_append (gstr, " :temp");
+			mu_str_append_escaped_c_literal (gstr, tmpfile, TRUE);
+			g_free (tmpfile);
 		}
 	}
 
-	tmp = g_strdup_printf
-		("%s(:index %d :name %s :mime-type \"%s/%s\"%s%s "
-		 ":attachment %s :size %i)",
-		 elvis (pinfo->parts, ""), part->index, name,
-		 elvis (part->type, "application"),
-		 elvis (part->subtype, "octet-stream"),
-		 tmpfile ? " :temp" : "", tmpfile ? tmpfile : "",
-		 mu_msg_part_looks_like_attachment (part, TRUE) ? "t" : "nil",
-		 (int)part->size);
-
-	g_free (pinfo->parts);
-	pinfo->parts = tmp;
+	g_string_append (gstr, " :attachment ");
+	g_string_append (gstr, mu_msg_part_looks_like_attachment (part, TRUE) ?
+			 "t" : "nil");
+	g_string_append (gstr, " :size ");
+	append_int (gstr, (int)part->size);
+	g_string_append_c (gstr, ')');
 }
 
 
@@ -284,16 +330,15 @@ append_sexp_parts (GString *gstr, MuMsg *msg, gboolean want_images)
 {
 	PartInfo pinfo;
 
-	pinfo.parts       = NULL;
+	pinfo.gstr	  = gstr;
+	pinfo.any	  = FALSE;
 	pinfo.want_images = want_images;
 
 	mu_msg_part_foreach (msg, FALSE,
 			     (MuMsgPartForeachFunc)each_part, &pinfo);
 
-	if (pinfo.parts) {
-		g_string_append_printf (gstr, "\t:parts (%s)\n", pinfo.parts);
-		g_free (pinfo.parts);
-	}
+	if (pinfo.any)
+		g_string_append (gstr, ")\n");
 }
 
 
@@ -313,69 +358,116 @@ append_sexp_message_file_attr (GString *gstr, MuMsg *msg)
 static void
 append_sexp_thread_info (GString *gstr, const MuMsgIterThreadInfo *ti)
 {
-	g_string_append_printf
-		(gstr, "\t:thread (:path \"%s\":level %u%s%s%s%s)\n",
-		 ti->threadpath,
-		 ti->level,
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_FIRST_CHILD  ?
-		 " :first-child t" : "",
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT ?
-		 " :empty-parent t" : "",
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_DUP          ?
-		 " :duplicate t" : "",
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_HAS_CHILD    ?
-		 " :has-child t" : "");
-}
+	guint u;
+
+	/* the path, like mu_msg_iter_thread_info_path */
+	g_string_append (gstr, "\t:thread (:path \"");
+	for (u = 0; u <= ti->level; ++u) {
+		char buf[16];
+		int len;
+		len = snprintf (buf, sizeof(buf), u == 0 ? "%0*x" : ":%0*x",
+				(int)ti->width, ti->path[u]);
+		g_string_append_len (gstr, buf, MIN(len, (int)sizeof(buf) - 1));
+	}
 
+	g_string_append (gstr, "\":level ");
+	append_uint (gstr, ti->level);
 
-char*
-mu_msg_to_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
-		gboolean header_only, gboolean extract_images)
-{
-	GString *gstr;
-	time_t t;
-
-	g_return_val_if_fail (msg, NULL);
-	g_return_val_if_fail (!(header_only && extract_images), NULL);
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_FIRST_CHILD)
+		g_string_append (gstr, " :first-child t");
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT)
+		g_string_append (gstr, " :empty-parent t");
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_DUP)
+		g_string_append (gstr, " :duplicate t");
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_HAS_CHILD)
+		g_string_append (gstr, " :has-child t");
 
-	gstr = g_string_sized_new (header_only ? 1024 : 8192);
-	g_string_append (gstr, "(\n");
+	g_string_append (gstr, ")\n");
+}
 
-	if (docid != 0)
-		g_string_append_printf (gstr, "\t:docid %u\n", docid);
 
-	if (ti)
-		append_sexp_thread_info (gstr, ti);
+static void
+append_sexp_headers (GString *gstr, MuMsg *msg)
+{
+	time_t t;
 
 	append_sexp_attr (gstr, "subject", mu_msg_get_subject (msg));
 
 	t = mu_msg_get_date (msg);
 	/* weird time format for emacs 29-bit ints...*/
-	g_string_append_printf (gstr,"\t:date (%u %u 0)\n", (unsigned)(t >> 16),
-				(unsigned)(t & 0xffff));
-	g_string_append_printf (gstr, "\t:size %u\n",
-				(unsigned) mu_msg_get_size (msg));
+	g_string_append (gstr, "\t:date (");
+	append_uint (gstr, (unsigned)(t >> 16));
+	g_string_append_c (gstr, ' ');
+	append_uint (gstr, (unsigned)(t & 0xffff));
+	g_string_append (gstr, " 0)\n");
+
+	append_sexp_attr_uint (gstr, "size", (unsigned)mu_msg_get_size (msg));
 	append_sexp_attr (gstr, "message-id", mu_msg_get_msgid (msg));
 	append_sexp_attr (gstr, "path",	 mu_msg_get_path (msg));
 	append_sexp_attr (gstr, "maildir", mu_msg_get_maildir (msg));
 
-	g_string_append_printf (gstr, "\t:priority %s\n",
-				mu_msg_prio_name(mu_msg_get_prio(msg)));
+	g_string_append (gstr, "\t:priority ");
+	g_string_append (gstr, mu_msg_prio_name(mu_msg_get_prio(msg)));
+	g_string_append_c (gstr, '\n');
 
 	append_sexp_flags (gstr, msg);
+}
+
+
+void
+mu_msg_append_sexp_props (MuMsg *msg, GString *gstr, unsigned docid,
+			  const MuMsgIterThreadInfo *ti,
+			  MuMsgSexpFields fields)
+{
+	g_return_if_fail (msg);
+	g_return_if_fail (gstr);
+
+	if (docid != 0)
+		append_sexp_attr_uint (gstr, "docid", docid);
+
+	if (ti)
+		append_sexp_thread_info (gstr, ti);
+
+	if (fields & MU_MSG_SEXP_FIELD_HEADERS)
+		append_sexp_headers (gstr, msg);
 
 	/* headers are retrieved from the database, views from the message file
 	 * file attr things can only be gotten from the file (ie., mu
 	 * view), not from the database (mu find).  */
-	if (!header_only) {
+	if (fields & MU_MSG_SEXP_FIELD_FILE)
 		append_sexp_message_file_attr (gstr, msg);
-		append_sexp_parts (gstr, msg, extract_images);
-	}
+	if (fields & MU_MSG_SEXP_FIELD_PARTS)
+		append_sexp_parts (gstr, msg,
+				   fields & MU_MSG_SEXP_FIELD_IMAGES ?
+				   TRUE : FALSE);
 
 	/* note, some of the contacts info comes from the file, soe
 	 * this has to be after the previous */
-	append_sexp_contacts (gstr, msg);
+	if (fields & MU_MSG_SEXP_FIELD_CONTACTS)
+		append_sexp_contacts (gstr, msg);
+}
 
+
+char*
+mu_msg_to_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
+		gboolean header_only, gboolean extract_images)
+{
+	GString *gstr;
+	MuMsgSexpFields fields;
+
+	g_return_val_if_fail (msg, NULL);
+	g_return_val_if_fail (!(header_only && extract_images), NULL);
+
+	if (header_only)
+		fields = MU_MSG_SEXP_PROFILE_HEADERS;
+	else
+		fields = MU_MSG_SEXP_PROFILE_FULL |
+			(extract_images ? MU_MSG_SEXP_FIELD_IMAGES : 0);
+
+	gstr = g_string_sized_new (header_only ? 1024 : 8192);
+	g_string_append (gstr, "(\n");
+	mu_msg_append_sexp_props (msg, gstr, docid, ti, fields);
 	g_string_append (gstr, ")\n");
+
 	return g_string_free (gstr, FALSE);
 }
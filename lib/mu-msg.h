@@ -401,6 +401,47 @@ char* mu_msg_to_sexp (MuMsg *msg, unsigned docid,
 		      const struct _MuMsgIterThreadInfo *ti,
 		      gboolean headers_only, gboolean extract_images);
 
+
+/* the parts of a message to include in its sexp */
+enum _MuMsgSexpFields {
+	MU_MSG_SEXP_FIELD_NONE	   = 0,
+	/* subject, date, size, message-id, path, maildir, priority, flags */
+	MU_MSG_SEXP_FIELD_HEADERS  = 1 << 0,
+	/* from, to, cc, bcc, reply-to */
+	MU_MSG_SEXP_FIELD_CONTACTS = 1 << 1,
+	/* references, in-reply-to and the bodies; from the message file */
+	MU_MSG_SEXP_FIELD_FILE	   = 1 << 2,
+	/* the MIME-parts; from the message file */
+	MU_MSG_SEXP_FIELD_PARTS	   = 1 << 3,
+	/* extract image parts as temporary files, and link to those */
+	MU_MSG_SEXP_FIELD_IMAGES   = 1 << 4
+};
+typedef enum _MuMsgSexpFields MuMsgSexpFields;
+
+/* what we can get from the database, for message lists */
+#define MU_MSG_SEXP_PROFILE_HEADERS					\
+	(MU_MSG_SEXP_FIELD_HEADERS|MU_MSG_SEXP_FIELD_CONTACTS)
+/* everything, for viewing messages */
+#define MU_MSG_SEXP_PROFILE_FULL					\
+	(MU_MSG_SEXP_PROFILE_HEADERS|MU_MSG_SEXP_FIELD_FILE|		\
+	 MU_MSG_SEXP_FIELD_PARTS)
+
+/**
+ * append the properties of the sexp for a message (everything
+ * between the outer parentheses of mu_msg_to_sexp) to a GString,
+ * escaping directly into it; with a GString that is reused for many
+ * messages, this does not allocate.
+ *
+ * @param msg a valid message
+ * @param gstr the GString to append to
+ * @param docid the docid for this message, or 0
+ * @param ti thread info for the current message, or NULL
+ * @param fields the fields to include
+ */
+void mu_msg_append_sexp_props (MuMsg *msg, GString *gstr, unsigned docid,
+			       const struct _MuMsgIterThreadInfo *ti,
+			       MuMsgSexpFields fields);
+
 /**
  * move a message to another maildir; note that this does _not_ update
  * the database
@@ -22,6 +22,7 @@
 #include <cctype>
 #include <cstring>
 #include <stdlib.h>
+#include <set>
 
 #include <xapian.h>
 #include <glib/gstdio.h>
@@ -166,6 +167,8 @@ public:
 
 		mu_msg_field_foreach ((MuMsgFieldForeachFunc)add_prefix,
 				      &_qparser);
+		_qparser.add_boolean_prefix
+			("thread", std::string(1, MU_STORE_THREAD_ID_PREFIX));
 	}
 
 	~_MuQuery () { mu_store_unref (_store); }
@@ -179,6 +182,7 @@ public:
 		return *db;
 	}
 	Xapian::QueryParser& query_parser () { return _qparser; }
+	MuStore* store () { return _store; }
 
 private:
 	Xapian::QueryParser	_qparser;
@@ -309,9 +313,65 @@ mu_query_preprocess (const char *query, GError **err)
 }
 
 
+/* when the docids in the store are in date-order, we can sort by
+ * date simply by going through the matches in docid order, without
+ * looking up the date of each of them. xapian walks the posting lists
+ * in ascending docid order, so only for oldest-first it can stop after
+ * the first maxnum matches; newest-first still checks all of them, but
+ * only compares docids. for fields with a sort key, we sort by that
+ * key, so e.g. 'Re: foo' sorts with 'foo' */
+static void
+set_sort_order (MuQuery *self, Xapian::Enquire& enq,
+		MuMsgFieldId sortfieldid, gboolean revert)
+{
+	if (sortfieldid == MU_MSG_FIELD_ID_DATE &&
+	    mu_store_docids_in_date_order (self->store())) {
+		enq.set_weighting_scheme (Xapian::BoolWeight());
+		enq.set_docid_order (revert ?
+				     Xapian::Enquire::DESCENDING :
+				     Xapian::Enquire::ASCENDING);
+	} else if (mu_store_field_has_sort_key (sortfieldid))
+		enq.set_sort_by_value
+			((Xapian::valueno)(MU_STORE_SLOT_SORT_KEY + sortfieldid),
+			 revert ? true : false);
+	else
+		enq.set_sort_by_value ((Xapian::valueno)sortfieldid,
+				       revert ? true : false);
+}
+
+
+/* get a query that matches everything the original query matches,
+ * plus all the messages in the same threads; that is just one more
+ * term query, as the thread-ids are stored as terms at index time */
+static Xapian::Query
+get_related_query (Xapian::Enquire& enq, Xapian::doccount maxnum)
+{
+	static const std::string pfx (1, MU_STORE_THREAD_ID_PREFIX);
+	std::set<std::string> thread_terms;
+	Xapian::MSet mset;
+	Xapian::MSetIterator it;
+
+	mset = enq.get_mset (0, maxnum);
+	mset.fetch ();
+
+	for (it = mset.begin(); it != mset.end(); ++it) {
+		const std::string tid (it.get_document().get_value
+				       ((Xapian::valueno)MU_STORE_SLOT_THREAD_ID));
+		if (!tid.empty())
+			thread_terms.insert (pfx + tid);
+	}
+
+	return Xapian::Query (Xapian::Query::OP_OR,
+			      enq.get_query(),
+			      Xapian::Query (Xapian::Query::OP_OR,
+					     thread_terms.begin(),
+					     thread_terms.end()));
+}
+
+
 MuMsgIter*
-mu_query_run (MuQuery *self, const char* searchexpr, gboolean threads,
-	      MuMsgFieldId sortfieldid, gboolean revert, int maxnum,
+mu_query_run (MuQuery *self, const char* searchexpr,
+	      MuMsgFieldId sortfieldid, int maxnum, MuQueryFlags flags,
 	      GError **err)
 {
 	g_return_val_if_fail (self, NULL);
@@ -319,15 +379,33 @@ mu_query_run (MuQuery *self, const char* searchexpr, gboolean threads,
 	g_return_val_if_fail (mu_msg_field_id_is_valid (sortfieldid) ||
 			      sortfieldid == MU_MSG_FIELD_ID_NONE,
 			      NULL);
+	g_return_val_if_fail (!((flags & MU_QUERY_FLAG_THREADS) &&
+				(flags & MU_QUERY_FLAG_COLLAPSE_THREADS)),
+			      NULL);
 	try {
 		Xapian::Enquire enq (self->db());
+		gboolean threads, revert;
+
+		threads = flags & MU_QUERY_FLAG_THREADS ? TRUE : FALSE;
+		revert  = flags & MU_QUERY_FLAG_DESCENDING ? TRUE : FALSE;
+
+		/* when collapsing, xapian keeps the first message
+		 * (in sort order) for each thread; by default, we
+		 * want that to be the newest one */
+		if (flags & MU_QUERY_FLAG_COLLAPSE_THREADS) {
+			enq.set_collapse_key
+				((Xapian::valueno)MU_STORE_SLOT_THREAD_ID);
+			if (sortfieldid == MU_MSG_FIELD_ID_NONE) {
+				sortfieldid = MU_MSG_FIELD_ID_DATE;
+				revert	    = TRUE;
+			}
+		}
 
 		/* note, when our result will be *threaded*, we sort
 		 * in our threading code (mu-threader etc.), and don't
 		 * let Xapian do any sorting */
 		if (!threads && sortfieldid != MU_MSG_FIELD_ID_NONE)
-			enq.set_sort_by_value ((Xapian::valueno)sortfieldid,
-					       revert ? true : false);
+			set_sort_order (self, enq, sortfieldid, revert);
 		if (!mu_str_is_empty(searchexpr) &&
 		    g_strcmp0 (searchexpr, "\"\"") != 0) /* NULL or "" or """" */
 			enq.set_query(get_query (self, searchexpr, err));
@@ -336,12 +414,26 @@ mu_query_run (MuQuery *self, const char* searchexpr, gboolean threads,
 
 		enq.set_cutoff(0,0);
 
+		if (maxnum <= 0)
+			maxnum = self->db().get_doccount();
+
+		if (flags & MU_QUERY_FLAG_INCLUDE_RELATED)
+			enq.set_query (get_related_query (enq, maxnum));
+
+		/* with a maxnum, xapian may stop before it has seen
+		 * all the messages of a thread, and the collapse
+		 * counts would only be lower bounds; so when
+		 * collapsing, let it check all matches */
 		return mu_msg_iter_new (
 			reinterpret_cast<XapianEnquire*>(&enq),
-			maxnum <= 0 ? self->db().get_doccount() : maxnum,
+			maxnum,
+			flags & MU_QUERY_FLAG_COLLAPSE_THREADS ?
+			self->db().get_doccount() : 0,
 			threads,
 			threads ? sortfieldid : MU_MSG_FIELD_ID_NONE,
-			revert);
+			revert,
+			flags & MU_QUERY_FLAG_GROUP_SUBJECTS ? TRUE : FALSE,
+			flags & MU_QUERY_FLAG_STORED_THREADS ? TRUE : FALSE);
 
 	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN (err, MU_ERROR_XAPIAN, 0);
 }
@@ -64,19 +64,54 @@ void mu_query_destroy  (MuQuery *self);
 char* mu_query_version (MuQuery *store)
     G_GNUC_MALLOC G_GNUC_WARN_UNUSED_RESULT;
 
+enum _MuQueryFlags {
+	MU_QUERY_FLAG_NONE            = 0,
+
+	MU_QUERY_FLAG_THREADS	      = 1 << 0, /* calculate threads */
+	MU_QUERY_FLAG_DESCENDING      = 1 << 1, /* sort z->a */
+	MU_QUERY_FLAG_INCLUDE_RELATED = 1 << 2, /* include the other
+						 * messages in the
+						 * threads of the
+						 * matches */
+	MU_QUERY_FLAG_COLLAPSE_THREADS = 1 << 3, /* only return one
+						 * message per
+						 * thread; cannot be
+						 * combined with
+						 * _THREADS */
+	MU_QUERY_FLAG_GROUP_SUBJECTS  = 1 << 4, /* with _THREADS, also
+						 * group threads with
+						 * the same subject */
+	MU_QUERY_FLAG_STORED_THREADS  = 1 << 5  /* with _THREADS, use
+						 * the parent links
+						 * from the store */
+};
+typedef enum _MuQueryFlags MuQueryFlags;
+
 /**
  * run a Xapian query; for the syntax, please refer to the mu-find
  * manpage, or http://xapian.org/docs/queryparser.html
  *
  * @param self a valid MuQuery instance
  * @param expr the search expression; use "" to match all messages
- * @param threads calculate message-threads
  * @param sortfield the field id to sort by or MU_MSG_FIELD_ID_NONE if
  * sorting is not desired
- * @param reverse if TRUE, sort in descending (Z-A) order, otherwise,
- * sort in descending (A-Z) order
  * @param maxnum maximum number of search results to return, or <= 0 for
  * unlimited
+ * @param flags bitwise OR'd MuQueryFlags; with
+ * MU_QUERY_FLAG_DESCENDING, sort in descending (Z-A) order,
+ * otherwise, sort in ascending (A-Z) order. With
+ * MU_QUERY_FLAG_COLLAPSE_THREADS, the message returned for each
+ * thread is the first one in the sort order; if no sortfield is
+ * given, that is the newest one. Use
+ * mu_msg_iter_get_collapse_count to get the number of hidden messages.
+ * With MU_QUERY_FLAG_GROUP_SUBJECTS (and MU_QUERY_FLAG_THREADS), root
+ * messages with the same (normalized) subject are grouped into one
+ * thread, for messages whose References were lost. With
+ * MU_QUERY_FLAG_STORED_THREADS (and MU_QUERY_FLAG_THREADS), the
+ * threads are laid out from the parent links maintained at index
+ * time, which is linear in the number of matches; unlike the full
+ * threading algorithm, this does not add (empty) parents for
+ * messages whose parent is not in the store.
  * @param err receives error information (if there is any); if
  * function returns non-NULL, err will _not_be set. err can be NULL
  * possible error (err->code) is MU_ERROR_QUERY,
@@ -84,9 +119,9 @@ char* mu_query_version (MuQuery *store)
  * @return a MuMsgIter instance you can iterate over, or NULL in
  * case of error
  */
-MuMsgIter* mu_query_run (MuQuery *self, const char* expr, gboolean threads,
-			 MuMsgFieldId sortfieldid, gboolean ascending, int maxnum,
-			 GError **err)
+MuMsgIter* mu_query_run (MuQuery *self, const char* expr,
+			 MuMsgFieldId sortfieldid, int maxnum,
+			 MuQueryFlags flags, GError **err)
     G_GNUC_MALLOC G_GNUC_WARN_UNUSED_RESULT;
 
 
@@ -35,6 +35,7 @@
 #define MU_CACHE_DIRNAME        "cache"
 #define MU_CONTACTS_FILENAME	"contacts"
 #define MU_LOG_DIRNAME		"log"
+#define MU_SOCKET_FILENAME	"mu.sock"
 
 
 struct _MuRuntimeData {
@@ -184,6 +185,10 @@ init_paths (const char* muhome, MuRuntimeData *data)
 		g_strdup_printf ("%s%c%s", muhome,
 				 G_DIR_SEPARATOR, MU_LOG_DIRNAME);
 
+	data->_str [MU_RUNTIME_PATH_SOCKET] =
+		g_strdup_printf ("%s%c%s", muhome,
+				 G_DIR_SEPARATOR, MU_SOCKET_FILENAME);
+
 	if (!create_dirs_maybe (data))
 		return FALSE;
 
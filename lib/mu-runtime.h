@@ -68,6 +68,7 @@ enum _MuRuntimePath {
 	MU_RUNTIME_PATH_CACHE,      /* mu cache path */
 	MU_RUNTIME_PATH_LOG,        /* mu path for log files */
 	MU_RUNTIME_PATH_CONTACTS,   /* mu path to the contacts cache */
+	MU_RUNTIME_PATH_SOCKET,     /* mu daemon's unix socket */
 
 	MU_RUNTIME_PATH_NUM
 };
@@ -62,12 +62,14 @@ public:
 				(path, Xapian::DB_CREATE_OR_OPEN);
 
 		check_set_version ();
+		_date_order = _db->get_metadata (MU_STORE_DATE_ORDER_KEY);
 
 		if (contacts_path) {
 			_contacts = mu_contacts_new (contacts_path);
 			if (!_contacts)
 				throw MuStoreError (MU_ERROR_FILE,
 					    ("failed to init contacts cache"));
+			_contacts_delta = mu_contacts_delta_new ();
 		}
 
 		MU_WRITE_LOG ("%s: opened %s (batch size: %u) for read-write",
@@ -84,6 +86,8 @@ public:
 			throw MuStoreError (MU_ERROR_XAPIAN_NOT_UP_TO_DATE,
 					    ("store needs an upgrade"));
 
+		_date_order = _db->get_metadata (MU_STORE_DATE_ORDER_KEY);
+
 		MU_WRITE_LOG ("%s: opened %s read-only", __FUNCTION__, this->path());
 	}
 
@@ -93,6 +97,7 @@ public:
 		_my_addresses   = NULL;
 		_batch_size	= DEFAULT_BATCH_SIZE;
 		_contacts       = 0;
+		_contacts_delta = 0;
 		_in_transaction = false;
 		_path           = path;
 		_processed	= 0;
@@ -137,9 +142,15 @@ public:
 
 			g_free (_version);
 
-			mu_contacts_destroy (_contacts);
+			/* flushing merges the contacts, so do it while
+			 * we still have them */
 			if (!_read_only)
 				mu_store_flush (this);
+			merge_contacts ();
+			mu_contacts_destroy (_contacts);
+			mu_contacts_delta_destroy (_contacts_delta);
+			_contacts	= NULL;
+			_contacts_delta = NULL;
 
 			mu_str_free_list (_my_addresses);
 
@@ -162,15 +173,31 @@ public:
 			(path(), Xapian::DB_CREATE_OR_OVERWRITE);
 
 		// clear the contacts cache
-		if (_contacts)
+		if (_contacts) {
+			mu_contacts_delta_destroy (_contacts_delta);
+			_contacts_delta = mu_contacts_delta_new ();
 			mu_contacts_clear (_contacts);
+		}
+
+		_date_order.clear ();
 	}
 
-	/* get a unique id for this message; note, this function returns a
-	 * static buffer -- not reentrant */
-	const char *get_uid_term (const char *path);
+	/* get a unique id for this message */
+	std::string get_uid_term (const char *path);
+
+	/* get a 64-bit hash for some string, as 16 hex digits */
+	static std::string get_hash (const char *str);
 
-	MuContacts* contacts() { return _contacts; }
+	/* the contacts, including the ones not merged yet */
+	MuContacts* contacts() { merge_contacts (); return _contacts; }
+
+	/* the contacts seen in the current transaction; we merge them
+	 * with the contacts when committing */
+	MuContactsDelta* contacts_delta() { return _contacts_delta; }
+	void merge_contacts () {
+		if (_contacts && _contacts_delta)
+			mu_contacts_merge (_contacts, _contacts_delta);
+	}
 
 	const char* version ()  {
 		g_free (_version);
@@ -221,6 +248,26 @@ public:
 
 	GSList *my_addresses () { return _my_addresses; }
 
+	/* when the docids are in date order, this is the date of the
+	 * newest message, otherwise it's empty */
+	const std::string& date_order () const { return _date_order; }
+	void set_date_order (const std::string& date) { _date_order = date; }
+
+	/* check whether a message with the given date, which was
+	 * added to the end of the store, keeps the docids in date
+	 * order */
+	void check_date_order (const std::string& date) {
+		if (_date_order.empty())
+			return;
+		if (date >= _date_order)
+			_date_order = date;
+		else {
+			_date_order.clear();
+			db_writable()->set_metadata (MU_STORE_DATE_ORDER_KEY,
+						     "");
+		}
+	}
+
 	/* by default, use transactions of 30000 messages */
 	static const unsigned DEFAULT_BATCH_SIZE = 30000;
 	/* http://article.gmane.org/gmane.comp.search.xapian.general/3656 */
@@ -234,6 +281,7 @@ private:
 
 	/* contacts object to cache all the contact information */
 	MuContacts *_contacts;
+	MuContactsDelta *_contacts_delta;
 
 	std::string _path;
 	gchar *_version;
@@ -243,6 +291,8 @@ private:
 	guint _ref_count;
 
 	GSList *_my_addresses;
+
+	std::string _date_order;
 };
 
 
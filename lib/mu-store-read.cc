@@ -40,35 +40,41 @@
 #include "mu-contacts.h"
 
 
-// note: not re-entrant
-const char*
-_MuStore::get_uid_term (const char* path)
+std::string
+_MuStore::get_hash (const char* str)
 {
 	// combination of DJB, BKDR hash functions to get a 64 bit
 	// value
 
 	unsigned djbhash, bkdrhash, bkdrseed;
 	unsigned u;
-	static char hex[18];
-	static const char uid_prefix =
-		mu_msg_field_xapian_prefix(MU_MSG_FIELD_ID_UID);
+	char hex[17];
 
 	djbhash  = 5381;
 	bkdrhash = 0;
 	bkdrseed = 1313;
 
-	for(u = 0; path[u]; ++u) {
-		djbhash  = ((djbhash << 5) + djbhash) + path[u];
-		bkdrhash = bkdrhash * bkdrseed + path[u];
+	for(u = 0; str[u]; ++u) {
+		djbhash  = ((djbhash << 5) + djbhash) + str[u];
+		bkdrhash = bkdrhash * bkdrseed + str[u];
 	}
 
-	snprintf (hex, sizeof(hex), "%c%08x%08x",
-		  uid_prefix, djbhash, bkdrhash);
+	snprintf (hex, sizeof(hex), "%08x%08x", djbhash, bkdrhash);
 
 	return hex;
 }
 
 
+std::string
+_MuStore::get_uid_term (const char* path)
+{
+	static const char uid_prefix =
+		mu_msg_field_xapian_prefix(MU_MSG_FIELD_ID_UID);
+
+	return std::string (1, uid_prefix) + get_hash (path);
+}
+
+
 MuStore*
 mu_store_new_read_only (const char* xpath, GError **err)
 {
@@ -154,6 +160,14 @@ mu_store_get_read_only_database (MuStore *store)
 }
 
 
+MuContacts*
+mu_store_get_contacts (MuStore *store)
+{
+	g_return_val_if_fail (store, NULL);
+	return store->contacts();
+}
+
+
 
 gboolean
 mu_store_contains_message (MuStore *store, const char* path, GError **err)
@@ -26,6 +26,8 @@
 #include <xapian.h>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
+#include <set>
 
 #include "mu-store.h"
 #include "mu-store-priv.hh" /* _MuStore */
@@ -54,6 +56,7 @@ _MuStore::commit_transaction () {
 	try {
 		in_transaction (false);
 		db_writable()->commit_transaction();
+		merge_contacts ();
 	} MU_XAPIAN_CATCH_BLOCK;
 }
 
@@ -62,6 +65,11 @@ _MuStore::rollback_transaction () {
 	try {
 		in_transaction (false);
 		db_writable()->cancel_transaction();
+		/* forget the contacts of the cancelled messages */
+		if (_contacts_delta) {
+			mu_contacts_delta_destroy (_contacts_delta);
+			_contacts_delta = mu_contacts_delta_new ();
+		}
 	} MU_XAPIAN_CATCH_BLOCK;
 }
 
@@ -150,6 +158,14 @@ mu_store_set_batch_size (MuStore *store, guint batchsize)
 }
 
 
+guint
+mu_store_get_batch_size (MuStore *store)
+{
+	g_return_val_if_fail (store, 0);
+	return (guint)store->batch_size ();
+}
+
+
 gboolean
 mu_store_set_metadata (MuStore *store, const char *key, const char *val,
 		       GError **err)
@@ -192,9 +208,13 @@ mu_store_flush (MuStore *store)
 	g_return_if_fail (store);
 
 	try {
+		if (!store->date_order().empty())
+			store->db_writable()->set_metadata
+				(MU_STORE_DATE_ORDER_KEY, store->date_order());
 		if (store->in_transaction())
 			store->commit_transaction ();
 		store->db_writable()->flush (); /* => commit, post X 1.1.x */
+		store->merge_contacts ();
 
 	} MU_XAPIAN_CATCH_BLOCK;
 }
@@ -282,10 +302,8 @@ prio_val (MuMsgPrio prio)
 
 
 static void
-add_terms_values_number (Xapian::Document& doc, MuMsg *msg, MuMsgFieldId mfid)
+add_terms_values_num (Xapian::Document& doc, MuMsgFieldId mfid, gint64 num)
 {
-	gint64 num = mu_msg_get_field_numeric (msg, mfid);
-
 	const std::string numstr (Xapian::sortable_serialise((double)num));
 	doc.add_value ((Xapian::valueno)mfid, numstr);
 
@@ -303,6 +321,13 @@ add_terms_values_number (Xapian::Document& doc, MuMsg *msg, MuMsgFieldId mfid)
 }
 
 
+static void
+add_terms_values_number (Xapian::Document& doc, MuMsg *msg, MuMsgFieldId mfid)
+{
+	add_terms_values_num (doc, mfid, mu_msg_get_field_numeric (msg, mfid));
+}
+
+
 /* for string and string-list */
 static void
 add_terms_values_str (Xapian::Document& doc, char *val,
@@ -622,12 +647,12 @@ each_contact_info (MuMsgContact *contact, MsgDoc *msgdoc)
 		msgdoc->_doc->add_term
 			(std::string  (pfx + escaped, 0, MuStore::MAX_TERM_LENGTH));
 
-		/* store it also in our contacts cache */
-		if (msgdoc->_store->contacts())
-			mu_contacts_add (msgdoc->_store->contacts(),
-					 contact->address, contact->name,
-					 msgdoc->_personal,
-					 mu_msg_get_date(msgdoc->_msg));
+		/* store it also in our contacts cache, when we commit */
+		if (msgdoc->_store->contacts_delta())
+			mu_contacts_delta_add (msgdoc->_store->contacts_delta(),
+					       contact->address, contact->name,
+					       msgdoc->_personal,
+					       mu_msg_get_date(msgdoc->_msg));
 	}
 }
 
@@ -649,6 +674,269 @@ each_contact_check_if_personal (MuMsgContact *contact, MsgDoc *msgdoc)
 
 
 
+/* the term for a message-id, for the msgid (or refs) field */
+static std::string
+msgid_term (MuMsgFieldId mfid, const char *msgid)
+{
+	char *esc;
+
+	esc = mu_str_xapian_escape (msgid, TRUE /*esc space*/, NULL);
+	const std::string term (prefix(mfid) +
+				std::string(esc, 0, MuStore::MAX_TERM_LENGTH));
+	g_free (esc);
+
+	return term;
+}
+
+
+/* get the thread-id of the message with the given message-id, if it
+ * is already in the store; otherwise, return an empty string. the
+ * message-id terms we have in the database anyway serve as our
+ * msgid->thread map */
+static std::string
+lookup_thread_id (MsgDoc *msgdoc, const char *msgid)
+{
+	Xapian::Database *db;
+	Xapian::PostingIterator pit;
+
+	const std::string term (msgid_term (MU_MSG_FIELD_ID_MSGID, msgid));
+
+	db  = msgdoc->_store->db_read_only();
+	pit = db->postlist_begin (term);
+	if (pit == db->postlist_end (term))
+		return std::string();
+
+	return db->get_document(*pit).get_value
+		((Xapian::valueno)MU_STORE_SLOT_THREAD_ID);
+}
+
+
+/* determine the thread this message belongs to: if the root of its
+ * thread or its direct parent is already in the store, we join their
+ * thread; otherwise, we start a new one, named after the root
+ * message-id, so out-of-order arrivals usually end up in the same
+ * thread; merge_threads takes care of the others */
+static void
+add_thread_id (MsgDoc *msgdoc)
+{
+	static const std::string pfx (1, MU_STORE_THREAD_ID_PREFIX);
+	const GSList *refs;
+	const char *root, *parent;
+	std::string tid;
+
+	refs   = mu_msg_get_references (msgdoc->_msg);
+	root   = refs ? (const char*)refs->data :
+		mu_msg_get_msgid (msgdoc->_msg);
+	parent = refs ? (const char*)g_slist_last((GSList*)refs)->data :
+		NULL;
+
+	if (root)
+		tid = lookup_thread_id (msgdoc, root);
+	if (tid.empty() && parent)
+		tid = lookup_thread_id (msgdoc, parent);
+	if (tid.empty()) /* no msgid at all? then it's a thread of its own */
+		tid = MuStore::get_hash (root ? root :
+					 mu_msg_get_path (msgdoc->_msg));
+
+	msgdoc->_doc->add_value ((Xapian::valueno)MU_STORE_SLOT_THREAD_ID, tid);
+	msgdoc->_doc->add_term (pfx + tid);
+}
+
+
+/* the parent of a message is the nearest of its ancestors (as per
+ * the comma-separated refs, oldest first) that is in the store, or an
+ * empty string if there is none */
+static std::string
+nearest_ancestor (Xapian::Database *db, const std::string& refstr,
+		  const std::string& msgid)
+{
+	gchar **refs;
+	std::string parent;
+	int i;
+
+	refs = g_strsplit (refstr.c_str(), ",", -1);
+	for (i = (int)g_strv_length (refs) - 1; i >= 0; --i) {
+		g_strstrip (refs[i]);
+		if (!refs[i][0] || msgid == refs[i])
+			continue;
+		if (db->term_exists (msgid_term (MU_MSG_FIELD_ID_MSGID,
+						 refs[i]))) {
+			parent = refs[i];
+			break;
+		}
+	}
+	g_strfreev (refs);
+
+	return parent;
+}
+
+
+/* store the message-id of the parent (see nearest_ancestor), and add
+ * a term for each of the references, so we can find the messages
+ * that refer to some message when it arrives (or goes away) later;
+ * see update_children */
+static void
+add_parent (MsgDoc *msgdoc)
+{
+	const GSList *cur;
+	const char *msgid;
+
+	msgid = mu_msg_get_msgid (msgdoc->_msg);
+	const std::string parent
+		(nearest_ancestor (msgdoc->_store->db_read_only(),
+				   msgdoc->_doc->get_value
+				   ((Xapian::valueno)MU_MSG_FIELD_ID_REFS),
+				   msgid ? msgid : ""));
+	if (!parent.empty())
+		msgdoc->_doc->add_value
+			((Xapian::valueno)MU_STORE_SLOT_PARENT, parent);
+
+	for (cur = mu_msg_get_references (msgdoc->_msg); cur;
+	     cur = g_slist_next (cur))
+		msgdoc->_doc->add_term
+			(msgid_term (MU_MSG_FIELD_ID_REFS,
+				     (const char*)cur->data));
+}
+
+
+/* re-determine the parent of each message that refers to msgid,
+ * after a message with that msgid was added to or removed from the
+ * store; usually, there are none: parents tend to arrive before
+ * their children */
+static void
+update_children (MuStore *store, const char *msgid)
+{
+	Xapian::WritableDatabase *db;
+	Xapian::PostingIterator pit;
+	std::vector<Xapian::docid> children;
+	std::vector<Xapian::docid>::const_iterator cur;
+
+	db = store->db_writable();
+	const std::string term (msgid_term (MU_MSG_FIELD_ID_REFS, msgid));
+
+	/* don't change documents while iterating over the postlist */
+	for (pit = db->postlist_begin (term); pit != db->postlist_end (term);
+	     ++pit)
+		children.push_back (*pit);
+
+	for (cur = children.begin(); cur != children.end(); ++cur) {
+		Xapian::Document doc (db->get_document (*cur));
+		const std::string parent
+			(nearest_ancestor
+			 (db, doc.get_value
+			  ((Xapian::valueno)MU_MSG_FIELD_ID_REFS),
+			  doc.get_value
+			  ((Xapian::valueno)MU_MSG_FIELD_ID_MSGID)));
+		if (parent == doc.get_value
+		    ((Xapian::valueno)MU_STORE_SLOT_PARENT))
+			continue;
+		if (parent.empty())
+			doc.remove_value ((Xapian::valueno)MU_STORE_SLOT_PARENT);
+		else
+			doc.add_value ((Xapian::valueno)MU_STORE_SLOT_PARENT,
+				       parent);
+		db->replace_document (*cur, doc);
+	}
+}
+
+
+/* a message with a msgid we didn't have yet may connect threads
+ * that we could not connect before, e.g. when a child arrived before
+ * its parent, and its references did not start with the same root;
+ * so move the threads of the messages that refer to msgid into the
+ * thread of the new message, tid */
+static void
+merge_threads (MuStore *store, const char *msgid, const std::string& tid)
+{
+	static const std::string pfx (1, MU_STORE_THREAD_ID_PREFIX);
+	Xapian::WritableDatabase *db;
+	Xapian::PostingIterator pit;
+	std::set<std::string> tids;
+	std::set<std::string>::const_iterator tcur;
+
+	db = store->db_writable();
+	const std::string term (msgid_term (MU_MSG_FIELD_ID_REFS, msgid));
+
+	for (pit = db->postlist_begin (term); pit != db->postlist_end (term);
+	     ++pit) {
+		const std::string other
+			(db->get_document (*pit).get_value
+			 ((Xapian::valueno)MU_STORE_SLOT_THREAD_ID));
+		if (!other.empty() && other != tid)
+			tids.insert (other);
+	}
+
+	for (tcur = tids.begin(); tcur != tids.end(); ++tcur) {
+		std::vector<Xapian::docid> docids;
+		std::vector<Xapian::docid>::const_iterator cur;
+		const std::string oldterm (pfx + *tcur);
+
+		/* don't change documents while iterating over the
+		 * postlist */
+		for (pit = db->postlist_begin (oldterm);
+		     pit != db->postlist_end (oldterm); ++pit)
+			docids.push_back (*pit);
+
+		for (cur = docids.begin(); cur != docids.end(); ++cur) {
+			Xapian::Document doc (db->get_document (*cur));
+			doc.remove_term (oldterm);
+			doc.add_term (pfx + tid);
+			doc.add_value ((Xapian::valueno)MU_STORE_SLOT_THREAD_ID,
+				       tid);
+			db->replace_document (*cur, doc);
+		}
+	}
+}
+
+
+/* for grouping threads by subject (JWZ step 5), we store a hash of
+ * the normalized, lower-cased subject, followed by '1' if the subject
+ * had a Re:/Fwd: prefix, and '0' otherwise. messages without a
+ * (normalized) subject are never grouped, so they don't get a key */
+static void
+add_subject_key (MsgDoc *msgdoc)
+{
+	const char *subject, *norm;
+	char *down;
+	std::string key;
+
+	subject = mu_msg_get_subject (msgdoc->_msg);
+	if (!subject)
+		return;
+
+	norm = mu_str_subject_normalize (subject);
+	down = g_strstrip (g_utf8_strdown (norm, -1));
+	if (*down)
+		key = MuStore::get_hash (down) +
+			(norm != subject ? '1' : '0');
+	g_free (down);
+
+	if (!key.empty())
+		msgdoc->_doc->add_value
+			((Xapian::valueno)MU_STORE_SLOT_SUBJECT_KEY, key);
+}
+
+
+static void
+add_sort_key (MuMsgFieldId mfid, MsgDoc *msgdoc)
+{
+	const char *str;
+	char *key;
+
+	if (!mu_store_field_has_sort_key (mfid))
+		return;
+
+	str = mu_msg_get_field_string (msgdoc->_msg, mfid);
+	key = str ? mu_str_sort_key (str, mfid == MU_MSG_FIELD_ID_SUBJECT) :
+		NULL;
+	if (key && *key)
+		msgdoc->_doc->add_value
+			((Xapian::valueno)(MU_STORE_SLOT_SORT_KEY + mfid),
+			 key);
+	g_free (key);
+}
+
+
 #define MU_STRING_CHUNK_SIZE 8192
 
 Xapian::Document
@@ -674,6 +962,11 @@ new_doc_from_message (MuStore *store, MuMsg *msg)
 	mu_msg_contact_foreach (msg, (MuMsgContactForeachFunc)each_contact_info,
 				&docinfo);
 
+	add_thread_id (&docinfo);
+	add_parent (&docinfo);
+	add_subject_key (&docinfo);
+	mu_msg_field_foreach ((MuMsgFieldForeachFunc)add_sort_key, &docinfo);
+
 	g_string_chunk_free (docinfo._strchunk);
 
 	return doc;
@@ -687,10 +980,12 @@ mu_store_add_msg (MuStore *store, MuMsg *msg, GError **err)
 	g_return_val_if_fail (msg, MU_STORE_INVALID_DOCID);
 
 	try {
-		Xapian::docid id;
+		Xapian::docid id, lastid;
 		Xapian::Document doc (new_doc_from_message(store, msg));
 		const std::string term (store->get_uid_term
 					(mu_msg_get_path(msg)));
+		const char *msgid;
+		bool known;
 
 		if (!store->in_transaction())
 			store->begin_transaction();
@@ -699,8 +994,25 @@ mu_store_add_msg (MuStore *store, MuMsg *msg, GError **err)
 
 		MU_WRITE_LOG ("adding: %s", term.c_str());
 
+		/* if we did not have this message-id yet, it may be the
+		 * missing ancestor of some messages we already have */
+		msgid = mu_msg_get_msgid (msg);
+		known = msgid ? store->db_read_only()->term_exists
+			(msgid_term (MU_MSG_FIELD_ID_MSGID, msgid)) : true;
+
 		/* note, this will replace any other messages for this path */
-		id = store->db_writable()->replace_document (term, doc);
+		lastid = store->db_writable()->get_lastdocid ();
+		id     = store->db_writable()->replace_document (term, doc);
+		if (id > lastid) /* a new message, at the end */
+			store->check_date_order
+				(doc.get_value ((Xapian::valueno)
+						MU_MSG_FIELD_ID_DATE));
+		if (!known) {
+			update_children (store, msgid);
+			merge_threads (store, msgid, doc.get_value
+				       ((Xapian::valueno)
+					MU_STORE_SLOT_THREAD_ID));
+		}
 
 		if (store->inc_processed() % store->batch_size() == 0)
 			store->commit_transaction();
@@ -750,6 +1062,79 @@ mu_store_update_msg (MuStore *store, unsigned docid, MuMsg *msg, GError **err)
 
 
 
+/* remove all terms with the prefix for mfid from doc */
+static void
+remove_terms (Xapian::Document& doc, MuMsgFieldId mfid)
+{
+	const std::string pfx (prefix(mfid));
+	std::vector<std::string> terms;
+	Xapian::TermIterator cur;
+
+	cur = doc.termlist_begin ();
+	for (cur.skip_to (pfx); cur != doc.termlist_end() &&
+		     (*cur).compare (0, pfx.length(), pfx) == 0; ++cur)
+		terms.push_back (*cur);
+
+	for (std::vector<std::string>::const_iterator it = terms.begin();
+	     it != terms.end(); ++it)
+		doc.remove_term (*it);
+}
+
+
+unsigned
+mu_store_move_msg (MuStore *store, unsigned docid, const char *path,
+		   const char *maildir, MuFlags flags, GError **err)
+{
+	GStringChunk *strchunk;
+
+	g_return_val_if_fail (store, MU_STORE_INVALID_DOCID);
+	g_return_val_if_fail (docid != 0, MU_STORE_INVALID_DOCID);
+	g_return_val_if_fail (path, MU_STORE_INVALID_DOCID);
+	g_return_val_if_fail (maildir, MU_STORE_INVALID_DOCID);
+
+	strchunk = g_string_chunk_new (MU_STRING_CHUNK_SIZE);
+
+	try {
+		Xapian::Document doc
+			(store->db_writable()->get_document (docid));
+
+		if (!store->in_transaction())
+			store->begin_transaction();
+
+		/* only the things that change when moving a message (the
+		 * uid term follows the path); no need to re-read it */
+		remove_terms (doc, MU_MSG_FIELD_ID_UID);
+		remove_terms (doc, MU_MSG_FIELD_ID_MAILDIR);
+		remove_terms (doc, MU_MSG_FIELD_ID_FLAGS);
+
+		doc.add_term (store->get_uid_term (path));
+		add_terms_values_str
+			(doc, g_string_chunk_insert (strchunk, path),
+			 MU_MSG_FIELD_ID_PATH, strchunk);
+		add_terms_values_str
+			(doc, g_string_chunk_insert (strchunk, maildir),
+			 MU_MSG_FIELD_ID_MAILDIR, strchunk);
+		add_terms_values_num (doc, MU_MSG_FIELD_ID_FLAGS, flags);
+
+		store->db_writable()->replace_document (docid, doc);
+
+		if (store->inc_processed() % store->batch_size() == 0)
+			store->commit_transaction();
+
+		g_string_chunk_free (strchunk);
+		return docid;
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR (err, MU_ERROR_XAPIAN_STORE_FAILED);
+
+	/* we don't roll back: we change nothing before replacing the
+	 * document, and the transaction may hold other changes (e.g.,
+	 * of 'move-many', or an index run) that are still good */
+	g_string_chunk_free (strchunk);
+
+	return MU_STORE_INVALID_DOCID;
+}
+
+
 unsigned
 mu_store_add_path (MuStore *store, const char *path, const char *maildir,
 		   GError **err)
@@ -787,12 +1172,28 @@ mu_store_remove_path (MuStore *store, const char *msgpath)
 	g_return_val_if_fail (msgpath, FALSE);
 
 	try {
+		Xapian::WritableDatabase *db;
+		Xapian::PostingIterator pit;
+		std::string msgid;
+
 		const std::string term
 			(store->get_uid_term(msgpath));
 
-		store->db_writable()->delete_document (term);
+		db  = store->db_writable();
+		pit = db->postlist_begin (term);
+		if (pit != db->postlist_end (term))
+			msgid = db->get_document (*pit).get_value
+				((Xapian::valueno)MU_MSG_FIELD_ID_MSGID);
+
+		db->delete_document (term);
 		store->inc_processed();
 
+		/* the children of the message now need another parent,
+		 * unless there's another message with the same msgid */
+		if (!msgid.empty() && !db->term_exists
+		    (msgid_term (MU_MSG_FIELD_ID_MSGID, msgid.c_str())))
+			update_children (store, msgid.c_str());
+
 		return TRUE;
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN (FALSE);
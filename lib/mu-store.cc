@@ -26,6 +26,8 @@
 #include <xapian.h>
 #include <cstring>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
 #include <unistd.h>
 
 #include <errno.h>
@@ -118,6 +120,100 @@ mu_store_database_is_locked (const gchar *xpath)
 }
 
 
+gboolean
+mu_store_docids_in_date_order (MuStore *store)
+{
+	g_return_val_if_fail (store, FALSE);
+
+	return store->date_order().empty() ? FALSE : TRUE;
+}
+
+
+gboolean
+mu_store_field_has_sort_key (MuMsgFieldId mfid)
+{
+	switch (mfid) {
+	case MU_MSG_FIELD_ID_SUBJECT:
+	case MU_MSG_FIELD_ID_FROM:
+	case MU_MSG_FIELD_ID_TO:
+	case MU_MSG_FIELD_ID_CC:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+
+typedef std::pair<std::string, Xapian::docid> DateDocid;
+
+/* get all (date, docid) pairs, sorted by date; messages without a date
+ * are not included; as they sort before all others, they can keep
+ * their docids */
+static std::vector<DateDocid>
+docids_by_date (Xapian::Database *db)
+{
+	std::vector<DateDocid> dds;
+	Xapian::ValueIterator it;
+	const Xapian::valueno slot ((Xapian::valueno)MU_MSG_FIELD_ID_DATE);
+
+	dds.reserve (db->get_doccount());
+	for (it = db->valuestream_begin (slot);
+	     it != db->valuestream_end (slot); ++it)
+		dds.push_back (DateDocid (*it, it.get_docid()));
+
+	std::sort (dds.begin(), dds.end());
+
+	return dds;
+}
+
+
+/* re-add all messages in date order; new docids are always higher
+ * than the existing ones, so afterwards, docid order == date order */
+static void
+reorder_by_date (MuStore *store)
+{
+	Xapian::WritableDatabase *db;
+	std::vector<DateDocid> dds;
+	size_t u;
+
+	db  = store->db_writable();
+	dds = docids_by_date (db);
+
+	if (!store->in_transaction())
+		store->begin_transaction ();
+
+	for (u = 0; u != dds.size(); ++u) {
+		db->add_document (db->get_document (dds[u].second));
+		db->delete_document (dds[u].second);
+		if (store->inc_processed() % store->batch_size() == 0) {
+			store->commit_transaction ();
+			store->begin_transaction ();
+		}
+	}
+
+	store->set_date_order (dds.empty() ? std::string("0") :
+			       dds.back().first);
+	db->set_metadata (MU_STORE_DATE_ORDER_KEY, store->date_order());
+	store->commit_transaction ();
+}
+
+
+gboolean
+mu_store_reorder_by_date (MuStore *store, GError **err)
+{
+	g_return_val_if_fail (store, FALSE);
+
+	try {
+		try {
+			reorder_by_date (store);
+			return TRUE;
+
+		} MU_STORE_CATCH_BLOCK_RETURN(err, FALSE);
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN (err, MU_ERROR_XAPIAN, FALSE);
+}
+
+
 void
 mu_store_set_my_addresses (MuStore *store, const char **my_addresses)
 {
@@ -24,12 +24,33 @@
 #include <inttypes.h>
 #include <mu-msg.h>
 #include <mu-util.h> /* for MuError, MuError */
+#include <mu-contacts.h>
 
 G_BEGIN_DECLS
 
 struct _MuStore;
 typedef struct _MuStore MuStore;
 
+/* value slots for store-internal information that does not have a
+ * MuMsgFieldId of its own; the MuMsgFieldIds use the slots
+ * [0..MU_MSG_FIELD_ID_NUM), so we start well beyond that, to leave
+ * room for new message fields */
+enum _MuStoreValueSlot {
+	MU_STORE_SLOT_THREAD_ID	  = 100, /* the thread this message belongs to */
+	MU_STORE_SLOT_SUBJECT_KEY = 101, /* hash of the normalized subject,
+					  * for grouping threads by
+					  * subject */
+	MU_STORE_SLOT_PARENT	  = 102, /* message-id of the nearest
+					  * ancestor in the store */
+	MU_STORE_SLOT_SORT_KEY	  = 200	 /* 200 + MuMsgFieldId: the sort
+					  * keys for the fields that
+					  * have one */
+};
+typedef enum _MuStoreValueSlot MuStoreValueSlot;
+
+/* the xapian prefix for thread-id terms */
+#define MU_STORE_THREAD_ID_PREFIX 'V'
+
 
 /**
  * create a new writable Xapian store, a place to store documents
@@ -118,6 +139,18 @@ typedef gpointer XapianDatabase;
 XapianDatabase* mu_store_get_read_only_database (MuStore *store);
 
 
+/**
+ * get the contacts cache for this (writable) store; it is kept up to
+ * date as messages are added. Note that this pointer becomes invalid
+ * after mu_store_destroy
+ *
+ * @param store a valid store
+ *
+ * @return the MuContacts object, or NULL if the store has none
+ */
+MuContacts* mu_store_get_contacts (MuStore *store);
+
+
 /**
  * set the Xapian batch size for this store. Normally, there's no need
  * to use this function as the default is good enough; however, if you
@@ -131,6 +164,16 @@ XapianDatabase* mu_store_get_read_only_database (MuStore *store);
 void  mu_store_set_batch_size (MuStore *store, guint batchsize);
 
 
+/**
+ * get the Xapian batch size for this store
+ *
+ * @param store a valid store object
+ *
+ * @return the batch size
+ */
+guint mu_store_get_batch_size (MuStore *store);
+
+
 /**
  * register a char** of email addresses as 'my' addresses, ie. mark
  * message that have these addresses in one of the address fields as
@@ -204,6 +247,27 @@ unsigned mu_store_update_msg (MuStore *store, unsigned docid, MuMsg *msg,
 			      GError **err);
 
 
+/**
+ * update the location and flags of a message in the XapianStore,
+ * after it has been moved (see mu_msg_move_to_maildir). unlike
+ * mu_store_update_msg, this does not re-read the message; it only
+ * changes the path, maildir and flags of the existing document. if it
+ * fails, the other changes in the current transaction are kept.
+ *
+ * @param store a valid store
+ * @param the docid for the message
+ * @param path the new path of the message
+ * @param maildir the new maildir of the message
+ * @param flags the new flags of the message
+ * @param err receives error information, if any, or NULL
+ *
+ * @return the docid of the stored message, or 0
+ * (MU_STORE_INVALID_DOCID) in case of error
+ */
+unsigned mu_store_move_msg (MuStore *store, unsigned docid, const char *path,
+			    const char *maildir, MuFlags flags, GError **err);
+
+
 /**
  * store an email message in the XapianStore; similar to
  * mu_store_store, but instead takes a path as parameter instead of a
@@ -376,6 +440,47 @@ gboolean mu_store_needs_upgrade (MuStore *store);
 gboolean mu_store_clear (MuStore *store, GError **err);
 
 
+/**
+ * renumber the messages in the database, so that the order of their
+ * docids follows the order of their dates; queries sorted by date
+ * can then simply go through the matches in docid order (and, when
+ * sorting oldest-first, stop after the first maxnum) rather than
+ * sorting them by their date values. Messages added later keep this
+ * order, until one is added that is older than the newest one in the
+ * store.
+ *
+ * @param store a writable MuStore object
+ * @param err to receive error info or NULL. err->code is MuError value
+ *
+ * @return TRUE if the renumbering succeeded, FALSE otherwise.
+ */
+gboolean mu_store_reorder_by_date (MuStore *store, GError **err);
+
+
+/**
+ * check whether the docids in this store are in date order; see
+ * mu_store_reorder_by_date
+ *
+ * @param store a MuStore object
+ *
+ * @return TRUE if the docids are in date order, FALSE otherwise
+ */
+gboolean mu_store_docids_in_date_order (MuStore *store);
+
+
+/**
+ * check whether we store a sort key for some field; this is the case
+ * for the subject and the contact fields. The sort key (see
+ * mu_str_sort_key) is stored in value slot MU_STORE_SLOT_SORT_KEY +
+ * mfid, so sorting does not have to normalize the values
+ *
+ * @param mfid a message field id
+ *
+ * @return TRUE if there is a sort key for the field, FALSE otherwise
+ */
+gboolean mu_store_field_has_sort_key (MuMsgFieldId mfid);
+
+
 /**
  * check if the database is locked for writing
  *
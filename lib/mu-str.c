@@ -396,6 +396,27 @@ mu_str_subject_normalize (const gchar* str)
 }
 
 
+gchar*
+mu_str_sort_key (const gchar *str, gboolean subject)
+{
+	gchar *norm, *key;
+
+	g_return_val_if_fail (str, NULL);
+
+	if (subject)
+		str = mu_str_subject_normalize (str);
+
+	norm = g_utf8_normalize (str, -1, G_NORMALIZE_ALL);
+	if (!norm)
+		return NULL; /* not valid utf-8 */
+
+	key = g_utf8_casefold (norm, -1);
+	g_free (norm);
+
+	return key;
+}
+
+
 struct _CheckPrefix {
 	const char *str;
 	gboolean   match;
@@ -539,28 +560,44 @@ mu_str_fullpath_s (const char* path, const char* name)
 }
 
 
-char*
-mu_str_escape_c_literal (const gchar* str, gboolean in_quotes)
+void
+mu_str_append_escaped_c_literal (GString *gstr, const gchar* str,
+				 gboolean in_quotes)
 {
 	const char* cur;
-	GString *tmp;
-
-	g_return_val_if_fail (str, NULL);
 
-	tmp = g_string_sized_new (2 * strlen(str));
+	g_return_if_fail (gstr);
+	g_return_if_fail (str);
 
 	if (in_quotes)
-		g_string_append_c (tmp, '"');
-
-	for (cur = str; *cur; ++cur)
-		switch (*cur) {
-		case '\\': tmp = g_string_append   (tmp, "\\\\"); break;
-		case '"':  tmp = g_string_append   (tmp, "\\\""); break;
-		default:   tmp = g_string_append_c (tmp, *cur);
+		g_string_append_c (gstr, '"');
+
+	/* append the runs without anything to escape in one go */
+	for (cur = str; *cur; ) {
+		size_t len;
+		len = strcspn (cur, "\\\"");
+		g_string_append_len (gstr, cur, len);
+		cur += len;
+		if (*cur) {
+			g_string_append_c (gstr, '\\');
+			g_string_append_c (gstr, *cur++);
 		}
+	}
 
 	if (in_quotes)
-		g_string_append_c (tmp, '"');
+		g_string_append_c (gstr, '"');
+}
+
+
+char*
+mu_str_escape_c_literal (const gchar* str, gboolean in_quotes)
+{
+	GString *tmp;
+
+	g_return_val_if_fail (str, NULL);
+
+	tmp = g_string_sized_new (2 * strlen(str));
+	mu_str_append_escaped_c_literal (tmp, str, in_quotes);
 
 	return g_string_free (tmp, FALSE);
 }
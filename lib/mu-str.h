@@ -215,6 +215,17 @@ const char* mu_str_fullpath_s (const char* path, const char* name);
 char* mu_str_escape_c_literal (const gchar* str, gboolean in_quotes)
         G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * append a string to a GString, escaped like
+ * mu_str_escape_c_literal, without allocating a copy
+ *
+ * @param gstr a GString
+ * @param str a non-NULL str
+ * @param in_quotes whether the result should be enclosed in ""
+ */
+void mu_str_append_escaped_c_literal (GString *gstr, const gchar* str,
+				      gboolean in_quotes);
+
 
 
 /**
@@ -319,6 +330,22 @@ void mu_str_free_list (GSList *lst);
 const gchar* mu_str_subject_normalize (const gchar* str);
 
 
+/**
+ * get a key for sorting a string: the string in unicode normal form,
+ * and case-folded; for subjects, we strip prefixes such as Re: as
+ * well (see mu_str_subject_normalize). The keys can be compared with
+ * strcmp.
+ *
+ * @param str a string
+ * @param subject whether @str is a subject
+ *
+ * @return the sort key (free with g_free), or NULL if @str is not
+ * valid UTF-8
+ */
+gchar* mu_str_sort_key (const gchar *str, gboolean subject)
+	G_GNUC_WARN_UNUSED_RESULT;
+
+
 /**
  * guess some nick name for the given name; if we can determine an
  * first name, last name, the nick will be first name + the first char
@@ -30,10 +30,10 @@
  * the implementation follows the terminology from that doc, so should
  * be understandable from that... I did change things a bit though
  *
- * the end result of the threading operation is a hashtable which maps
- * docids (ie., Xapian documents == messages) to 'thread paths'; a
- * thread path is a string denoting the 2-dimensional place of a
- * message in a list of messages,
+ * the end result of the threading operation is an array (indexed by
+ * the rank of the messages in the matches) of thread info, with the
+ * 'thread paths'; a thread path denotes the 2-dimensional place of a
+ * message in a list of messages; as a string:
  *
  * Msg1                        => 00000
  * Msg2                        => 00001
@@ -46,58 +46,91 @@
  * the number hexadecimal numbers, and the length of the 'segments'
  * (the parts separated by the ':') is equal to ceil(log_16(matchnum))
  *
+ * we only store the segments as integers, and render the strings on
+ * demand; for the ordering we use the depth-first position instead
+ *
  */
 
-
-/* step 1 */ static GHashTable* create_containers (MuMsgIter *iter);
-/* step 2 */ static MuContainer *find_root_set (GHashTable *ids);
+/*
+ * the per-message data for all of the matches, read from the value
+ * slots of the documents; the containers point into this.
+ *
+ * message-ids (and paths) are interned in strs, so the id-table can
+ * simply compare pointers
+ */
+struct _ThreadData {
+	MuContainerMsg	 *msgs;	  /* one for each match */
+	size_t		  num, size;
+	GStringChunk	 *strs;	  /* owns the strings in msgs */
+	MuMsgFieldId	  sortfield;
+	gboolean	  group_subjects;
+	gboolean	  stored_links;
+	MuContainerArena *arena;  /* owns the containers */
+	GHashTable	 *ids;	  /* interned msgid => container */
+};
+typedef struct _ThreadData ThreadData;
+
+static ThreadData* thread_data_new (size_t matchnum, MuMsgFieldId sortfield,
+				    gboolean group_subjects,
+				    gboolean stored_links);
+static void        thread_data_destroy (ThreadData *tdata);
+
+/* step 1 */ static void create_containers (MuMsgIter *iter, ThreadData *tdata);
+/* step 2 */ static MuContainer *find_root_set (MuContainerArena *arena);
 static MuContainer* prune_empty_containers (MuContainer *root);
-/* static void group_root_set_by_subject (GSList *root_set); */
-GHashTable* create_doc_id_thread_path_hash (MuContainer *root, size_t match_num);
+static MuContainer* group_root_set_by_subject (ThreadData *tdata,
+					       MuContainer *root_set);
 
 /* msg threading algorithm, based on JWZ's algorithm,
  * http://www.jwz.org/doc/threading.html */
-GHashTable*
+MuMsgIterThreadInfo*
 mu_threader_calculate (MuMsgIter *iter, size_t matchnum,
-		       MuMsgFieldId sortfield, gboolean revert)
+		       MuMsgFieldId sortfield, gboolean revert,
+		       gboolean group_subjects, gboolean stored_links)
 {
-	GHashTable *id_table, *thread_ids;
+	MuMsgIterThreadInfo *thread_info;
 	MuContainer *root_set;
+	ThreadData *tdata;
 
-	g_return_val_if_fail (iter, FALSE);
+	g_return_val_if_fail (iter, NULL);
 	g_return_val_if_fail (mu_msg_field_id_is_valid (sortfield) ||
 			      sortfield == MU_MSG_FIELD_ID_NONE,
-			      FALSE);
+			      NULL);
 
 	/* step 1 */
-	id_table = create_containers (iter);
+	tdata = thread_data_new (matchnum, sortfield, group_subjects,
+				 stored_links);
+	create_containers (iter, tdata);
 
 	/* step 2 -- the root_set is the list of children without parent */
-	root_set = find_root_set (id_table);
+	root_set = find_root_set (tdata->arena);
 
 	/* step 3: skip until the end; we still need to containers */
 
-	/* step 4: prune empty containers */
-	root_set = prune_empty_containers (root_set);
+	/* step 4: prune empty containers; with stored links, there
+	 * are none */
+	if (!stored_links)
+		root_set = prune_empty_containers (root_set);
+
+	/* step 5: group root set by subject */
+	if (group_subjects)
+		root_set = group_root_set_by_subject (tdata, root_set);
 
 	/* sort root set */
-	if (sortfield != MU_MSG_FIELD_ID_NONE)
+	if (sortfield != MU_MSG_FIELD_ID_NONE && root_set)
 		root_set = mu_container_sort (root_set, sortfield, revert,
 					      NULL);
 
-	/* step 5: group root set by subject */
-	/* group_root_set_by_subject (root_set); */
-
 	/* sort */
 	mu_msg_iter_reset (iter); /* go all the way back */
 
-	/* finally, deliver the docid => thread-path hash */
-	thread_ids = mu_container_thread_info_hash_new (root_set,
-							matchnum);
+	/* finally, deliver the thread info for each match */
+	thread_info = root_set ?
+		mu_container_thread_info_new (root_set, matchnum) : NULL;
 
-	g_hash_table_destroy (id_table); /* step 3*/
+	thread_data_destroy (tdata); /* step 3*/
 
-	return thread_ids;
+	return thread_info;
 }
 
 G_GNUC_UNUSED static void
@@ -127,21 +160,84 @@ assert_no_duplicates (GHashTable *ids)
 
 
 
+/* during step 1, links are only ever added, never removed, so we
+ * can keep track of which containers are in the same tree with a
+ * union-find structure over the arena indices; this replaces
+ * searching the trees for each link */
+static MuContainer*
+find_tree (MuContainerArena *arena, MuContainer *c)
+{
+	while (c->set != c->idx) {
+		MuContainer *up;
+		up = mu_container_arena_get (arena, c->set);
+		c->set = up->set; /* path halving */
+		c = mu_container_arena_get (arena, up->set);
+	}
+
+	return c;
+}
+
+
+static void
+join_trees (MuContainerArena *arena, MuContainer *c1, MuContainer *c2)
+{
+	c1 = find_tree (arena, c1);
+	c2 = find_tree (arena, c2);
+
+	if (c1 == c2)
+		return;
+
+	if (c1->rank < c2->rank)
+		c1->set = c2->idx;
+	else if (c1->rank > c2->rank)
+		c2->set = c1->idx;
+	else {
+		c2->set = c1->idx;
+		++c1->rank;
+	}
+}
+
+
+/* JWZ: don't add a link if it would introduce a loop; since the child
+ * must not have a parent yet, it is the root of its tree, and linking
+ * creates a loop iff the parent is in that same tree */
+static gboolean
+child_elligible (MuContainerArena *arena, MuContainer *parent,
+		 MuContainer *child)
+{
+	if (!parent || !child || parent == child)
+		return FALSE;
+	if (child->parent)
+		return FALSE;
+	if (find_tree (arena, parent) == find_tree (arena, child))
+		return FALSE;
+
+	return TRUE;
+}
+
+
+static void
+link_child (MuContainerArena *arena, MuContainer *parent, MuContainer *child)
+{
+	mu_container_append_children (parent, child);
+	join_trees (arena, parent, child);
+}
+
+
+
 /* a referred message is a message that is refered by some other message */
 static MuContainer*
-find_or_create_referred (GHashTable *id_table, const char *msgid,
-			 gboolean *created)
+find_or_create_referred (ThreadData *tdata, const char *msgid)
 {
 	MuContainer *c;
 
 	g_return_val_if_fail (msgid, NULL);
 
-	c = g_hash_table_lookup (id_table, msgid);
-	*created = !c;
+	c = g_hash_table_lookup (tdata->ids, msgid);
 	if (!c) {
-		c = mu_container_new (NULL, 0, msgid);
-		g_hash_table_insert (id_table, (gpointer)msgid, c);
-		/* assert_no_duplicates (id_table); */
+		c = mu_container_new (tdata->arena, NULL, 0, msgid);
+		g_hash_table_insert (tdata->ids, (gpointer)msgid, c);
+		/* assert_no_duplicates (tdata->ids); */
 	}
 
 
@@ -151,7 +247,7 @@ find_or_create_referred (GHashTable *id_table, const char *msgid,
 /* find a container for the given msgid; if it does not exist yet,
  * create a new one, and register it */
 static MuContainer*
-find_or_create (GHashTable *id_table, MuMsg *msg, guint docid)
+find_or_create (ThreadData *tdata, MuContainerMsg *msg, guint docid)
 {
 	MuContainer *c;
 	const char* msgid;
@@ -159,17 +255,14 @@ find_or_create (GHashTable *id_table, MuMsg *msg, guint docid)
 	g_return_val_if_fail (msg, NULL);
 	g_return_val_if_fail (docid != 0, NULL);
 
-	msgid = mu_msg_get_msgid (msg);
-	if (!msgid)
-		msgid = mu_msg_get_path (msg); /* fake it */
-
-	c = g_hash_table_lookup (id_table, msgid);
+	msgid = msg->msgid;
+	c = g_hash_table_lookup (tdata->ids, msgid);
 
 	/* If id_table contains an empty MuContainer for this ID: * *
 	 * Store this message in the MuContainer's message slot. */
 	if (c) {
 		if (!c->msg) {
-			c->msg	  = mu_msg_ref (msg);
+			c->msg	  = msg;
 			c->docid  = docid;
 			return c;
 		} else {
@@ -183,54 +276,36 @@ find_or_create (GHashTable *id_table, MuMsg *msg, guint docid)
 			MuContainer *c2;
 			const char* fake_msgid;
 
-			fake_msgid = mu_msg_get_path (msg);
+			fake_msgid = msg->path;
 
-			c2	  = mu_container_new (msg, docid, fake_msgid);
+			c2	  = mu_container_new (tdata->arena, msg, docid,
+						      fake_msgid);
 			c2->flags = MU_CONTAINER_FLAG_DUP;
-			c	  = mu_container_append_children (c, c2);
+			link_child (tdata->arena, c, c2);
 
-			g_hash_table_insert (id_table, (gpointer)fake_msgid, c2);
+			g_hash_table_insert (tdata->ids, (gpointer)fake_msgid,
+					     c2);
 
 			return NULL; /* don't process this message further */
 		}
 	} else { /* Else: Create a new MuContainer object holding
 		    this message; Index the MuContainer by
 		    Message-ID in id_table. */
-		c = mu_container_new (msg, docid, msgid);
-		g_hash_table_insert (id_table, (gpointer)msgid, c);
-		/* assert_no_duplicates (id_table); */
+		c = mu_container_new (tdata->arena, msg, docid, msgid);
+		g_hash_table_insert (tdata->ids, (gpointer)msgid, c);
+		/* assert_no_duplicates (tdata->ids); */
 
 		return c;
 	}
 }
 
-static gboolean
-child_elligible (MuContainer *parent, MuContainer *child, gboolean created)
-{
-	if (!parent || !child)
-		return FALSE;
-	if (child->parent)
-		return FALSE;
-	/* if (created) */
-	/* 	return TRUE; */
-	if (mu_container_reachable (parent, child))
-		return FALSE;
-	if (mu_container_reachable (child, parent))
-		return FALSE;
-
-	return TRUE;
-}
-
-
-
 static void /* 1B */
-handle_references (GHashTable *id_table, MuContainer *c)
+handle_references (ThreadData *tdata, MuContainer *c)
 {
 	const GSList *refs, *cur;
 	MuContainer *parent;
-	gboolean created;
 
-	refs = mu_msg_get_references (c->msg);
+	refs = c->msg->refs;
 	if (!refs)
 		return; /* nothing to do */
 
@@ -241,12 +316,10 @@ handle_references (GHashTable *id_table, MuContainer *c)
 	   index) one with a null Message. */
 
 	/* go over over our list of refs, until 1 before the last... */
-	created = FALSE;
 	for (parent = NULL, cur = refs; cur; cur = g_slist_next (cur)) {
 
 		MuContainer *child;
-		child = find_or_create_referred (id_table, (gchar*)cur->data,
-						 &created);
+		child = find_or_create_referred (tdata, (gchar*)cur->data);
 
 		/*Link the References field's MuContainers together in
 		 * the order implied by the References header.
@@ -259,8 +332,8 @@ handle_references (GHashTable *id_table, MuContainer *c)
 		 see if B is reachable. If either is already reachable
 		 as a child of the other, don't add the link. */
 
-		if (child_elligible (parent, child, created))
-			parent = mu_container_append_children (parent, child);
+		if (child_elligible (tdata->arena, parent, child))
+			link_child (tdata->arena, parent, child);
 
 		parent = child;
 	}
@@ -284,75 +357,294 @@ handle_references (GHashTable *id_table, MuContainer *c)
 	   Note that at all times, the various ``parent'' and ``child'' fields
 	   must be kept inter-consistent. */
 
-           /* optimization: if the the message was newly added, it's by
-	    * definition not reachable yet */
-	if (child_elligible (parent, c, created))
-		parent = mu_container_append_children (parent, c);
+	if (child_elligible (tdata->arena, parent, c))
+		link_child (tdata->arena, parent, c);
 }
 
 
 
-/* step 1: create the containers, connect them, and fill the id_table */
-static GHashTable*
-create_containers (MuMsgIter *iter)
+static ThreadData*
+thread_data_new (size_t matchnum, MuMsgFieldId sortfield,
+		 gboolean group_subjects, gboolean stored_links)
 {
-	GHashTable *id_table;
-	id_table = g_hash_table_new_full (g_str_hash,
-					  g_str_equal,
-					  NULL,
-					  (GDestroyNotify)mu_container_destroy);
+	ThreadData *tdata;
+
+	tdata		 = g_slice_new0 (ThreadData);
+	tdata->msgs	 = g_new0 (MuContainerMsg, matchnum);
+	tdata->size	 = matchnum;
+	tdata->strs	 = g_string_chunk_new (4096);
+	tdata->sortfield = sortfield;
+	tdata->group_subjects = group_subjects;
+	tdata->stored_links   = stored_links;
+	tdata->arena	 = mu_container_arena_new ();
+	tdata->ids	 = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	return tdata;
+}
 
-	for (mu_msg_iter_reset (iter); !mu_msg_iter_is_done (iter);
-	     mu_msg_iter_next (iter)) {
 
-		MuContainer *c;
-		MuMsg *msg;
-		unsigned docid;
+static void
+thread_data_destroy (ThreadData *tdata)
+{
+	size_t u;
 
-		/* 1.A */
-		msg   = mu_msg_iter_get_msg_floating (iter); /* don't unref */
-		docid = mu_msg_iter_get_docid (iter);
+	if (!tdata)
+		return;
 
-		c = find_or_create (id_table, msg, docid);
+	g_hash_table_destroy (tdata->ids);
+	mu_container_arena_destroy (tdata->arena);
 
-		/* 1.B and C */
-		if (c)
-			handle_references (id_table, c);
+	for (u = 0; u != tdata->num; ++u)
+		g_slist_free (tdata->msgs[u].refs);
+
+	g_free (tdata->msgs);
+	g_string_chunk_free (tdata->strs);
+	g_slice_free (ThreadData, tdata);
+}
+
+
+/* get the list of references from the comma-separated refs value;
+ * the message-ids are interned in the string chunk */
+static GSList*
+get_refs (GStringChunk *strs, const char *refstr)
+{
+	GSList *refs;
+	GString *ref;
+	const char *cur, *end;
+
+	if (!refstr)
+		return NULL;
+
+	ref = g_string_sized_new (128);
+	for (refs = NULL, cur = refstr; *cur; cur = end) {
+		end = strchr (cur, ',');
+		if (!end)
+			end = cur + strlen (cur);
+		g_string_truncate (ref, 0);
+		g_string_append_len (ref, cur, end - cur);
+		g_strstrip (ref->str);
+		if (ref->str[0])
+			refs = g_slist_prepend
+				(refs, g_string_chunk_insert_const (strs,
+								    ref->str));
+		if (*end == ',')
+			++end;
 	}
+	g_string_free (ref, TRUE);
 
-	return id_table;
+	return g_slist_reverse (refs);
 }
 
 
+/* the sort key for string fields; preferably, the one precomputed at
+ * index time, so sorting only needs strcmp */
+static const char*
+get_sortkey (GStringChunk *strs, MuMsgIterRow *row, MuMsgFieldId sortfield)
+{
+	char *key;
+	const char *rv;
+
+	if (row->sort_key[sortfield])
+		return g_string_chunk_insert (strs, row->sort_key[sortfield]);
+
+	if (!row->str[sortfield])
+		return NULL;
+
+	key = mu_str_sort_key (row->str[sortfield],
+			       sortfield == MU_MSG_FIELD_ID_SUBJECT);
+	rv  = key ? g_string_chunk_insert (strs, key) : NULL;
+	g_free (key);
+
+	return rv;
+}
+
 
+/* the subject key is the hash of the normalized subject, and a '1'
+ * if it was a reply, or '0' otherwise; see mu-store-write.cc */
 static void
-filter_root_set (const gchar *msgid, MuContainer *c, MuContainer **root_set)
+set_subject (GStringChunk *strs, MuContainerMsg *msg, const char *key)
 {
-	/* ignore children */
-	if (c->parent)
-		return;
+	char hash[32];
+	size_t len;
 
-	/* ignore duplicates */
-	if (c->flags & MU_CONTAINER_FLAG_DUP)
+	len = strlen (key);
+	if (len < 2 || len > sizeof(hash))
 		return;
 
-	if (*root_set == NULL) {
-		*root_set = c;
+	memcpy (hash, key, len - 1);
+	hash[len - 1] = '\0';
+
+	msg->subject  = g_string_chunk_insert_const (strs, hash);
+	msg->is_reply = key[len - 1] == '1';
+}
+
+
+static void
+fill_container_msg (ThreadData *tdata, MuContainerMsg *msg,
+		    MuMsgIterRow *row)
+{
+	const char *msgid, *path;
+	MuMsgFieldId sortfield;
+
+	msgid = row->str[MU_MSG_FIELD_ID_MSGID];
+	path  = row->str[MU_MSG_FIELD_ID_PATH];
+
+	msg->path  = g_string_chunk_insert_const (tdata->strs,
+						  path ? path : "");
+	msg->msgid = msgid ? g_string_chunk_insert_const (tdata->strs, msgid) :
+		msg->path; /* fake it */
+	msg->refs  = get_refs (tdata->strs, row->str[MU_MSG_FIELD_ID_REFS]);
+
+	if (row->parent)
+		msg->parent = g_string_chunk_insert_const (tdata->strs,
+							   row->parent);
+	if (row->subject_key)
+		set_subject (tdata->strs, msg, row->subject_key);
+
+	sortfield = tdata->sortfield;
+	if (sortfield == MU_MSG_FIELD_ID_NONE)
 		return;
-	} else
-		*root_set = mu_container_append_siblings (*root_set, c);
+
+	if (mu_msg_field_is_numeric (sortfield))
+		msg->sortnum = row->num[sortfield];
+	else if (mu_msg_field_type (sortfield) == MU_MSG_FIELD_TYPE_STRING)
+		msg->sortkey = get_sortkey (tdata->strs, row, sortfield);
+}
+
+
+/* the value slots we need for threading */
+static guint32
+get_fields (ThreadData *tdata)
+{
+	guint32 fields;
+
+	fields = MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_MSGID) |
+		MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_PATH) |
+		MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_REFS);
+
+	if (tdata->sortfield != MU_MSG_FIELD_ID_NONE)
+		fields |= MU_MSG_ITER_FIELD_MASK(tdata->sortfield) |
+			MU_MSG_ITER_FIELD_SORT_KEYS;
+	if (tdata->group_subjects)
+		fields |= MU_MSG_ITER_FIELD_SUBJECT_KEY;
+	if (tdata->stored_links)
+		fields |= MU_MSG_ITER_FIELD_PARENT;
+
+	return fields;
+}
+
+
+/* the parent of c among the matches: normally, the parent stored at
+ * index time; if that one did not match, the nearest of the
+ * references that did */
+static MuContainer*
+stored_parent (ThreadData *tdata, MuContainer *c)
+{
+	MuContainer *parent;
+	const GSList *cur;
+
+	if (!c->msg->parent)
+		return NULL; /* no ancestors in the store */
+
+	parent = g_hash_table_lookup (tdata->ids, c->msg->parent);
+	if (parent)
+		return parent;
+
+	for (cur = c->msg->refs; cur; cur = g_slist_next (cur)) {
+		MuContainer *ref;
+		ref = g_hash_table_lookup (tdata->ids, cur->data);
+		if (ref && ref != c)
+			parent = ref;
+	}
+
+	return parent;
+}
+
+
+/* instead of 1.B and C: link each message to its parent, as stored
+ * at index time (see mu-store-write.cc); all containers have a
+ * message, and we only look at the matches themselves, so this is
+ * linear */
+static void
+link_stored_parents (ThreadData *tdata)
+{
+	guint u, num;
+
+	num = mu_container_arena_size (tdata->arena);
+	for (u = 0; u != num; ++u) {
+		MuContainer *c, *parent;
+		c = mu_container_arena_get (tdata->arena, u);
+		if (c->flags & MU_CONTAINER_FLAG_DUP)
+			continue;
+		parent = stored_parent (tdata, c);
+		if (child_elligible (tdata->arena, parent, c))
+			link_child (tdata->arena, parent, c);
+	}
 }
 
 
-/* 2.  Walk over the elements of id_table, and gather a list of the
+/* step 1: create the containers, connect them, and fill the id_table */
+static void
+create_containers (MuMsgIter *iter, ThreadData *tdata)
+{
+	guint32 fields;
+	guint rank;
+
+	fields = get_fields (tdata);
+
+	for (mu_msg_iter_reset (iter), rank = 0;
+	     !mu_msg_iter_is_done (iter) && rank < tdata->size;
+	     mu_msg_iter_next (iter), ++rank) {
+
+		MuContainer *c;
+		MuContainerMsg *msg;
+		MuMsgIterRow row;
+
+		/* 1.A */
+		if (!mu_msg_iter_get_row (iter, fields, &row))
+			continue;
+
+		msg	   = &tdata->msgs[rank];
+		msg->rank  = rank;
+		tdata->num = rank + 1;
+		fill_container_msg (tdata, msg, &row);
+
+		c = find_or_create (tdata, msg, row.docid);
+
+		/* 1.B and C */
+		if (c && !tdata->stored_links)
+			handle_references (tdata, c);
+	}
+
+	if (tdata->stored_links)
+		link_stored_parents (tdata);
+}
+
+
+
+/* 2.  Walk over the containers, and gather a list of the
    MuContainer objects that have no parents, but do have children */
 static MuContainer*
-find_root_set (GHashTable *ids)
+find_root_set (MuContainerArena *arena)
 {
-	MuContainer *root_set;
+	MuContainer *root_set, *last;
+	guint u, num;
+
+	root_set = last = NULL;
+	num	 = mu_container_arena_size (arena);
 
-	root_set = NULL;
-	g_hash_table_foreach (ids, (GHFunc)filter_root_set, &root_set);
+	for (u = 0; u != num; ++u) {
+		MuContainer *c;
+		c = mu_container_arena_get (arena, u);
+		/* ignore children and duplicates */
+		if (c->parent || (c->flags & MU_CONTAINER_FLAG_DUP))
+			continue;
+		if (last)
+			last->next = c;
+		else
+			root_set = c;
+		last = c;
+	}
 
 	return root_set;
 }
@@ -424,3 +716,202 @@ prune_empty_containers (MuContainer *root_set)
 
 	return root_set;
 }
+
+
+/* the message whose subject we use for a root container; for an
+ * empty container, that is its first child with a message */
+static MuContainerMsg*
+root_msg (MuContainer *c)
+{
+	while (c && !c->msg)
+		c = c->child;
+
+	return c ? c->msg : NULL;
+}
+
+
+/* the root we group the other roots with the same subject under */
+struct _SubjectGroup {
+	MuContainer *head;
+	MuContainer *last;   /* the last child of head, or NULL */
+};
+typedef struct _SubjectGroup SubjectGroup;
+
+static void
+subject_group_destroy (SubjectGroup *group)
+{
+	g_slice_free (SubjectGroup, group);
+}
+
+
+/* JWZ 5.B: empty containers are more interesting than ones with a
+ * message, and messages without Re: more than ones with it */
+static gboolean
+more_interesting (MuContainer *c, MuContainer *other)
+{
+	if (!other)
+		return TRUE;
+	if (!other->msg)
+		return FALSE;
+	if (!c->msg)
+		return TRUE;
+
+	return other->msg->is_reply && !c->msg->is_reply;
+}
+
+
+/* 5.A-B: map each (interned) subject to the root to group under */
+static GHashTable*
+get_subject_table (MuContainer *root_set)
+{
+	GHashTable *subjects;
+	MuContainer *cur;
+
+	subjects = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+					  (GDestroyNotify)subject_group_destroy);
+
+	for (cur = root_set; cur; cur = cur->next) {
+
+		MuContainerMsg *msg;
+		SubjectGroup *group;
+
+		msg = root_msg (cur);
+		if (!msg || !msg->subject)
+			continue;
+
+		group = g_hash_table_lookup (subjects, msg->subject);
+		if (!group) {
+			group = g_slice_new0 (SubjectGroup);
+			g_hash_table_insert (subjects, (gpointer)msg->subject,
+					     group);
+		}
+
+		if (more_interesting (cur, group->head))
+			group->head = cur;
+	}
+
+	return subjects;
+}
+
+
+/* append c to the children of the group's head; we remember the last
+ * child, so this is O(1) */
+static void
+add_to_group (SubjectGroup *group, MuContainer *c)
+{
+	if (!group->last)
+		for (group->last = group->head->child;
+		     group->last && group->last->next;
+		     group->last = group->last->next);
+
+	c->parent = group->head;
+	c->next	  = NULL;
+
+	if (group->last)
+		group->last->next = c;
+	else
+		group->head->child = c;
+
+	group->last = c;
+}
+
+
+/* move the children of (empty) container c to the group's head */
+static void
+splice_into_group (SubjectGroup *group, MuContainer *c)
+{
+	MuContainer *cur, *next;
+
+	for (cur = c->child, c->child = NULL; cur; cur = next) {
+		next = cur->next;
+		add_to_group (group, cur);
+	}
+}
+
+
+/* turn the group's head into an empty container, with its message
+ * moved to a new first child; the head keeps its place in the root
+ * set */
+static void
+make_empty_head (MuContainerArena *arena, SubjectGroup *group)
+{
+	MuContainer *head, *c, *cur;
+
+	head = group->head;
+	c    = mu_container_new (arena, head->msg, head->docid, head->msgid);
+
+	c->flags = head->flags;
+	c->child = head->child;
+	for (cur = c->child; cur; cur = cur->next)
+		cur->parent = c;
+
+	head->msg   = NULL;
+	head->docid = 0;
+	head->flags = MU_CONTAINER_FLAG_NONE;
+	head->child = NULL;
+
+	group->last = NULL;
+	add_to_group (group, c);
+}
+
+
+/* 5.C: merge root c with the other roots with the same subject;
+ * return TRUE if c is no longer a root, FALSE otherwise */
+static gboolean
+merge_by_subject (ThreadData *tdata, GHashTable *subjects, MuContainer *c)
+{
+	MuContainerMsg *msg;
+	SubjectGroup *group;
+	MuContainer *head;
+
+	msg = root_msg (c);
+	if (!msg || !msg->subject)
+		return FALSE;
+
+	group = g_hash_table_lookup (subjects, msg->subject);
+	if (!group || group->head == c)
+		return FALSE;
+
+	head = group->head;
+	if (!c->msg)
+		splice_into_group (group, c);
+	else if (!head->msg || (c->msg->is_reply && !head->msg->is_reply))
+		add_to_group (group, c);
+	else { /* both are replies, or neither is */
+		make_empty_head (tdata->arena, group);
+		add_to_group (group, c);
+	}
+
+	return TRUE;
+}
+
+
+/* step 5: group the roots with the same (normalized) subject; this
+ * is linear in the size of the root set */
+static MuContainer*
+group_root_set_by_subject (ThreadData *tdata, MuContainer *root_set)
+{
+	GHashTable *subjects;
+	MuContainer *cur, *next, *last;
+
+	subjects = get_subject_table (root_set);
+
+	for (cur = root_set, root_set = last = NULL; cur; cur = next) {
+
+		next	  = cur->next;
+		cur->next = NULL;
+
+		if (merge_by_subject (tdata, subjects, cur))
+			continue;
+
+		if (last)
+			last->next = cur;
+		else
+			root_set = cur;
+		last = cur;
+	}
+
+	g_hash_table_destroy (subjects);
+
+	return root_set;
+}
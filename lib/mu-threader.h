@@ -36,19 +36,28 @@ G_BEGIN_DECLS
  * message-threading algorithm, as descrbed in:
  *     http://www.jwz.org/doc/threading.html
  *
- * the returned hashtable maps the Xapian docid of iter (msg) to a ptr
- * to a MuMsgIterThreadInfo structure (see mu-msg-iter.h)
+ * the returned array has the MuMsgIterThreadInfo structure (see
+ * mu-msg-iter.h) for each match, indexed by the rank of the match
  *
  * @param iter an iter; note this function will mu_msgi_iter_reset this iterator
  * @param matches the number of matches in the set *
  * @param sortfield the field to sort results by, or
  * MU_MSG_FIELD_ID_NONE if no sorting should be performed
  * @param revert if TRUE, if revert the sorting order
+ * @param group_subjects if TRUE, group root messages with the same
+ * (normalized) subject into one thread (JWZ's step 5)
+ * @param stored_links if TRUE, don't run JWZ's algorithm, but link
+ * each message to its parent as stored at index time (see
+ * MU_STORE_SLOT_PARENT); this is linear in the number of matches
  *
- * @return a hashtable; free with g_hash_table_destroy when done with it
+ * @return an array of @matches elements, or NULL in case of error;
+ * free with g_free when done with it
  */
-GHashTable *mu_threader_calculate (MuMsgIter *iter, size_t matches,
-				   MuMsgFieldId sortfield, gboolean revert);
+MuMsgIterThreadInfo *mu_threader_calculate (MuMsgIter *iter, size_t matches,
+					    MuMsgFieldId sortfield,
+					    gboolean revert,
+					    gboolean group_subjects,
+					    gboolean stored_links);
 
 
 G_END_DECLS
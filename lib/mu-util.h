@@ -355,6 +355,7 @@ typedef gpointer XapianEnquire;
 
 /* metadata key for the xapian 'schema' version */
 #define MU_STORE_VERSION_KEY "db_version"
+#define MU_STORE_DATE_ORDER_KEY "date_order"
 
 
 /**
@@ -179,6 +179,98 @@ test_mu_store_store_msg_remove_and_count (void)
 }
 
 
+static void
+test_mu_store_move_msg (void)
+{
+	MuMsg *msg;
+	MuStore *store;
+	gchar* tmpdir;
+	unsigned docid;
+
+	tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert (tmpdir);
+
+	store = mu_store_new_writable (tmpdir, NULL, FALSE, NULL);
+	g_assert (store);
+
+	msg = mu_msg_new_from_file (
+		MU_TESTMAILDIR "/cur/1283599333.1840_11.cthulhu!2,",
+		NULL, NULL);
+	g_assert (msg);
+	docid = mu_store_add_msg (store, msg, NULL);
+	g_assert_cmpuint (docid, !=, MU_STORE_INVALID_DOCID);
+	mu_msg_unref (msg);
+
+	/* only the path, maildir and flags change */
+	g_assert_cmpuint (mu_store_move_msg
+			  (store, docid, "/tmp/archive/cur/1283599333:2,RS",
+			   "/archive", MU_FLAG_REPLIED|MU_FLAG_SEEN, NULL),
+			  ==, docid);
+	g_assert_cmpuint (1,==,mu_store_count (store, NULL));
+	g_assert_cmpuint (FALSE,==,mu_store_contains_message
+			  (store,
+			   MU_TESTMAILDIR "/cur/1283599333.1840_11.cthulhu!2,", NULL));
+	g_assert_cmpuint (TRUE,==,mu_store_contains_message
+			  (store, "/tmp/archive/cur/1283599333:2,RS", NULL));
+
+	msg = mu_store_get_msg (store, docid, NULL);
+	g_assert (msg);
+	g_assert_cmpstr (mu_msg_get_path (msg),==,
+			 "/tmp/archive/cur/1283599333:2,RS");
+	g_assert_cmpstr (mu_msg_get_maildir (msg),==, "/archive");
+	g_assert_cmpuint (mu_msg_get_flags (msg),==,
+			  MU_FLAG_REPLIED|MU_FLAG_SEEN);
+	g_assert_cmpstr (mu_msg_get_subject (msg),==,
+			 "Greetings from Lothlórien");
+	mu_msg_unref (msg);
+
+	g_free (tmpdir);
+	mu_store_unref (store);
+}
+
+
+/* a failed move should not undo the others in the same transaction */
+static void
+test_mu_store_move_msg_failed (void)
+{
+	MuMsg *msg;
+	MuStore *store;
+	gchar* tmpdir;
+	unsigned docid;
+
+	tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert (tmpdir);
+
+	store = mu_store_new_writable (tmpdir, NULL, FALSE, NULL);
+	g_assert (store);
+	mu_store_set_batch_size (store, G_MAXUINT);
+
+	msg = mu_msg_new_from_file (
+		MU_TESTMAILDIR "/cur/1283599333.1840_11.cthulhu!2,",
+		NULL, NULL);
+	g_assert (msg);
+	docid = mu_store_add_msg (store, msg, NULL);
+	g_assert_cmpuint (docid, !=, MU_STORE_INVALID_DOCID);
+	mu_msg_unref (msg);
+
+	g_assert_cmpuint (mu_store_move_msg
+			  (store, docid, "/tmp/archive/cur/1283599333:2,S",
+			   "/archive", MU_FLAG_SEEN, NULL), ==, docid);
+	g_assert_cmpuint (mu_store_move_msg
+			  (store, docid + 1000, "/tmp/archive/cur/foo:2,S",
+			   "/archive", MU_FLAG_SEEN, NULL),
+			  ==, MU_STORE_INVALID_DOCID);
+	mu_store_flush (store);
+
+	g_assert_cmpuint (1,==,mu_store_count (store, NULL));
+	g_assert_cmpuint (TRUE,==,mu_store_contains_message
+			  (store, "/tmp/archive/cur/1283599333:2,S", NULL));
+
+	g_free (tmpdir);
+	mu_store_unref (store);
+}
+
+
 int
 main (int argc, char *argv[])
 {
@@ -193,6 +285,10 @@ main (int argc, char *argv[])
 			 test_mu_store_store_msg_and_count);
 	g_test_add_func ("/mu-store/mu-store-store-remove-and-count",
 			 test_mu_store_store_msg_remove_and_count);
+	g_test_add_func ("/mu-store/mu-store-move-msg",
+			 test_mu_store_move_msg);
+	g_test_add_func ("/mu-store/mu-store-move-msg-failed",
+			 test_mu_store_move_msg_failed);
 
 	if (!g_test_verbose())
 		g_log_set_handler (NULL,
@@ -179,6 +179,37 @@ test_mu_str_esc_to_list (void)
 	}
 }
 
+static void
+test_mu_str_escape_c_literal (void)
+{
+	int i;
+	GString *gstr;
+	struct {
+		const char*  str;
+		const char*  esc;
+	} strings [] = {
+		{ "foo",		"\"foo\"" },
+		{ "say \"hi\"",	"\"say \\\"hi\\\"\"" },
+		{ "c:\\dos\\",	"\"c:\\\\dos\\\\\"" },
+		{ "",			"\"\"" }
+	};
+
+	gstr = g_string_new ("x");
+	for (i = 0; i != G_N_ELEMENTS(strings); ++i) {
+		char *esc;
+		esc = mu_str_escape_c_literal (strings[i].str, TRUE);
+		g_assert_cmpstr (esc, ==, strings[i].esc);
+		g_free (esc);
+
+		/* appending does not touch what is there already */
+		g_string_assign (gstr, "x");
+		mu_str_append_escaped_c_literal (gstr, strings[i].str, TRUE);
+		g_assert_cmpstr (gstr->str + 1, ==, strings[i].esc);
+	}
+	g_string_free (gstr, TRUE);
+}
+
+
 static void
 test_mu_str_xapian_escape (void)
 {
@@ -458,6 +489,32 @@ test_mu_str_subject_normalize (void)
 }
 
 
+static void
+test_mu_str_sort_key (void)
+{
+	int i;
+
+	struct {
+		char *src;
+		gboolean subject;
+		char *exp;
+	} tests[] = {
+		{ "Test123", FALSE, "test123" },
+		{ "Re: Test123", FALSE, "re: test123" },
+		{ "Re: Test123", TRUE, "test123" },
+		{ "RE: Fwd: TEST123", TRUE, "test123" },
+		{ "Ångström", FALSE, "a\xcc\x8angstro\xcc\x88m" }
+	};
+
+	for (i = 0; i != G_N_ELEMENTS(tests); ++i) {
+		char *key;
+		key = mu_str_sort_key (tests[i].src, tests[i].subject);
+		g_assert_cmpstr (key, ==, tests[i].exp);
+		g_free (key);
+	}
+}
+
+
 
 
 
@@ -485,6 +542,8 @@ main (int argc, char *argv[])
 	g_test_add_func ("/mu-str/mu-str-normalize-02",
 			 test_mu_str_normalize_02);
 
+	g_test_add_func ("/mu-str/mu-str-escape-c-literal",
+			 test_mu_str_escape_c_literal);
 	g_test_add_func ("/mu-str/mu-str-xapian-escape",
 			 test_mu_str_xapian_escape);
 	g_test_add_func ("/mu-str/mu-str-xapian-escape-non-ascii",
@@ -512,6 +571,8 @@ main (int argc, char *argv[])
 
 	g_test_add_func ("/mu-str/mu_str_subject_normalize",
 			 test_mu_str_subject_normalize);
+	g_test_add_func ("/mu-str/mu-str-sort-key",
+			 test_mu_str_sort_key);
 
 
 	/* FIXME: add tests for mu_str_flags; but note the
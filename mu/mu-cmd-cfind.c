@@ -173,7 +173,7 @@ each_contact (const char *email, const char *name, gboolean personal,
 
 
 static MuError
-run_cmd_cfind (const char* pattern,
+run_cmd_cfind (const char* pattern, const char *complete, int limit,
 	       gboolean personal, time_t after,
 	       MuConfigFormat format,
 	       gboolean color, GError **err)
@@ -196,9 +196,15 @@ run_cmd_cfind (const char* pattern,
 	}
 
 	print_header (format);
-	rv = mu_contacts_foreach (contacts,
-				  (MuContactsForeachFunc)each_contact,
-				  &ecdata, pattern, &num);
+	if (complete) /* personal is handled by mu_contacts_complete */
+		rv = mu_contacts_complete (contacts, complete, personal,
+					   limit > 0 ? (size_t)limit : 0,
+					   (MuContactsForeachFunc)each_contact,
+					   &ecdata, &num);
+	else
+		rv = mu_contacts_foreach (contacts,
+					  (MuContactsForeachFunc)each_contact,
+					  &ecdata, pattern, &num);
 	mu_contacts_destroy (contacts);
 
 	if (num == 0) {
@@ -233,6 +239,12 @@ cfind_params_valid (MuConfig *opts)
 		return FALSE;
 	}
 
+	/* and not with --complete */
+	if (opts->complete && opts->params[1]) {
+		g_warning ("usage: mu cfind [options] --complete=<prefix>");
+		return FALSE;
+	}
+
 	return TRUE;
 }
 
@@ -251,6 +263,8 @@ mu_cmd_cfind (MuConfig *opts, GError **err)
 	}
 
 	return run_cmd_cfind (opts->params[1],
+			      opts->complete,
+			      opts->limit,
 			      opts->personal,
 			      opts->after,
 			      opts->format,
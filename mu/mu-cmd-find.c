@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <sys/stat.h>
 
 #include "mu-msg.h"
 #include "mu-str.h"
@@ -44,7 +45,10 @@
 #include "mu-cmd.h"
 #include "mu-threader.h"
 
-typedef gboolean (OutputFunc) (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err);
+/* buf is a scratch buffer the output functions can use, so we don't
+ * allocate a new one for each message */
+typedef gboolean (OutputFunc) (MuMsgIter *iter, MuMsgIterRow *row,
+			       GString *buf, MuConfig *opts, GError **err);
 
 static gboolean
 print_xapian_query (MuQuery *xapian, const gchar *query, GError **err)
@@ -81,37 +85,87 @@ sort_field_from_string (const char* fieldstr, GError **err)
 }
 
 
-static MuMsg*
-get_message (MuMsgIter *iter, time_t after)
+/* the fields we need from each message in the results; we always
+ * need the path, so we can check if the message is readable */
+static guint32
+get_fields_mask (const char *fields)
 {
-	MuMsg *msg;
+	guint32 mask;
 
-	if (mu_msg_iter_is_done (iter))
-		return NULL;
+	mask = MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_PATH);
+	for (; fields && *fields; ++fields) {
+		MuMsgFieldId mfid;
+		mfid = mu_msg_field_id_from_shortcut (*fields, FALSE);
+		if (mfid != MU_MSG_FIELD_ID_NONE)
+			mask |= MU_MSG_ITER_FIELD_MASK(mfid);
+	}
 
-	msg = mu_msg_iter_get_msg_floating (iter);
-	if (!msg)
-		return NULL; /* error */
+	return mask;
+}
 
-	if (!mu_msg_is_readable (msg)) {
-		mu_msg_iter_next (iter);
-		return get_message (iter, after);
-	}
 
+/* should we skip the message in row? this is the case for
+ * unreadable messages, and for messages older than 'after' */
+static gboolean
+skip_message (MuMsgIterRow *row, time_t after)
+{
+	const char *path;
+	struct stat statbuf;
+
+	path = row->str[MU_MSG_FIELD_ID_PATH];
+	if (!path || access (path, R_OK) != 0)
+		return TRUE;
+
+	if (after != 0 &&
+	    (stat (path, &statbuf) != 0 || after > statbuf.st_mtime))
+		return TRUE;
+
+	return FALSE;
+}
+
+static gboolean
+get_query_flags (MuConfig *opts, MuQueryFlags *qflags, GError **err)
+{
+	*qflags = MU_QUERY_FLAG_NONE;
+
+	if (opts->threads)
+		*qflags |= MU_QUERY_FLAG_THREADS;
+	if (opts->reverse)
+		*qflags |= MU_QUERY_FLAG_DESCENDING;
+	if (opts->include_related)
+		*qflags |= MU_QUERY_FLAG_INCLUDE_RELATED;
+	if (opts->group_subjects)
+		*qflags |= MU_QUERY_FLAG_GROUP_SUBJECTS;
+	if (opts->stored_threads)
+		*qflags |= MU_QUERY_FLAG_STORED_THREADS;
+
+	if (!opts->collapse)
+		return TRUE;
 
-	if (after != 0 && after > mu_msg_get_timestamp (msg)) {
-		mu_msg_iter_next (iter);
-		return get_message (iter, after);
+	if (g_strcmp0 (opts->collapse, "thread") != 0) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "invalid collapse mode '%s'",
+				     opts->collapse);
+		return FALSE;
+	}
+
+	if (opts->threads) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "--collapse cannot be combined with --threads");
+		return FALSE;
 	}
 
-	return msg;
+	*qflags |= MU_QUERY_FLAG_COLLAPSE_THREADS;
+	return TRUE;
 }
 
+
 static MuMsgIter*
 run_query (MuQuery *xapian, const gchar *query, MuConfig *opts,  GError **err)
 {
 	MuMsgIter *iter;
 	MuMsgFieldId sortid;
+	MuQueryFlags qflags;
 
 	sortid = MU_MSG_FIELD_ID_NONE;
 	if (opts->sortfield) {
@@ -120,20 +174,23 @@ run_query (MuQuery *xapian, const gchar *query, MuConfig *opts,  GError **err)
 			return FALSE;
 	}
 
-	iter = mu_query_run (xapian, query, opts->threads, sortid,
-			     opts->reverse, -1, err);
+	if (!get_query_flags (opts, &qflags, err))
+		return NULL;
+
+	iter = mu_query_run (xapian, query, sortid, -1, qflags, err);
 	return iter;
 }
 
 
 static gboolean
-exec_cmd (MuMsg *msg, MuMsgIter *iter, MuConfig *opts,  GError **err)
+exec_cmd (MuMsgIter *iter, MuMsgIterRow *row, GString *buf, MuConfig *opts,
+	  GError **err)
 {
 	gint status;
 	char *cmdline, *escpath;
 	gboolean rv;
 
-	escpath = g_strescape (mu_msg_get_path (msg), NULL);
+	escpath = g_strescape (row->str[MU_MSG_FIELD_ID_PATH], NULL);
 	cmdline = g_strdup_printf ("%s %s", opts->exec, escpath);
 
 	rv = g_spawn_command_line_sync (cmdline, NULL, NULL, &status, err);
@@ -291,9 +348,10 @@ prepare_links (MuConfig *opts, GError **err)
 
 
 static gboolean
-output_link (MuMsg *msg, MuMsgIter *iter, MuConfig *opts,  GError **err)
+output_link (MuMsgIter *iter, MuMsgIterRow *row, GString *buf,
+	     MuConfig *opts, GError **err)
 {
-	return mu_maildir_link (mu_msg_get_path (msg),
+	return mu_maildir_link (row->str[MU_MSG_FIELD_ID_PATH],
 				opts->linksdir, err);
 }
 
@@ -345,33 +403,28 @@ ansi_reset_maybe (MuMsgFieldId mfid, gboolean color)
 
 
 static const char*
-display_field (MuMsg *msg, MuMsgFieldId mfid)
+display_field (MuMsgIterRow *row, MuMsgFieldId mfid)
 {
 	gint64 val;
 
+	val = row->num[mfid];
+
 	switch (mu_msg_field_type(mfid)) {
-	case MU_MSG_FIELD_TYPE_STRING: {
-		const gchar *str;
-		str = mu_msg_get_field_string (msg, mfid);
-		return str ? str : "";
-	}
-	case MU_MSG_FIELD_TYPE_INT:
+	case MU_MSG_FIELD_TYPE_STRING:
+		return row->str[mfid] ? row->str[mfid] : "";
 
-		if (mfid == MU_MSG_FIELD_ID_PRIO) {
-			val = mu_msg_get_field_numeric (msg, mfid);
+	case MU_MSG_FIELD_TYPE_INT:
+		if (mfid == MU_MSG_FIELD_ID_PRIO)
 			return mu_msg_prio_name ((MuMsgPrio)val);
- 		} else if (mfid == MU_MSG_FIELD_ID_FLAGS) {
-			val = mu_msg_get_field_numeric (msg, mfid);
+ 		else if (mfid == MU_MSG_FIELD_ID_FLAGS)
 			return mu_str_flags_s ((MuFlags)val);
-		} else  /* as string */
-			return mu_msg_get_field_string (msg, mfid);
+		else  /* as string */
+			return row->str[mfid] ? row->str[mfid] : "";
 
 	case MU_MSG_FIELD_TYPE_TIME_T:
-		val = mu_msg_get_field_numeric (msg, mfid);
 		return mu_date_str_s ("%c", (time_t)val);
 
 	case MU_MSG_FIELD_TYPE_BYTESIZE:
-		val = mu_msg_get_field_numeric (msg, mfid);
 		return mu_str_size_s ((unsigned)val);
 	default:
 		g_return_val_if_reached (NULL);
@@ -401,8 +454,7 @@ static void
 thread_indent (MuMsgIter *iter)
 {
 	const MuMsgIterThreadInfo *ti;
-	const char* threadpath;
-	int i;
+	guint i;
 	gboolean is_root, first_child, empty_parent, is_dup;
 
 	ti = mu_msg_iter_get_thread_info (iter);
@@ -412,21 +464,13 @@ thread_indent (MuMsgIter *iter)
 		return;
 	}
 
-	threadpath = ti->threadpath;
-	/* fputs (threadpath, stdout); */
-	/* fputs ("  ", stdout); */
-
 	is_root      = ti->prop & MU_MSG_ITER_THREAD_PROP_ROOT;
 	first_child  = ti->prop & MU_MSG_ITER_THREAD_PROP_FIRST_CHILD;
 	empty_parent = ti->prop & MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT;
 	is_dup       = ti->prop & MU_MSG_ITER_THREAD_PROP_DUP;
 
-	/* FIXME: count the colons... */
-	for (i = 0; *threadpath; ++threadpath)
-		i += (*threadpath == ':') ? 1 : 0;
-
 	/* indent */
-	while (i --> 0)
+	for (i = 0; i != ti->level; ++i)
 		fputs ("  ", stdout);
 
 	if (!is_root) {
@@ -436,9 +480,20 @@ thread_indent (MuMsgIter *iter)
 }
 
 
+/* show how many other messages in this thread are hidden */
+static void
+collapse_count (MuMsgIter *iter)
+{
+	unsigned count;
+
+	count = mu_msg_iter_get_collapse_count (iter);
+	if (count > 0)
+		printf ("(+%u) ", count);
+}
+
 
 static void
-output_plain_fields (MuMsg *msg, const char *fields,
+output_plain_fields (MuMsgIterRow *row, const char *fields,
 		     gboolean color, gboolean threads)
 {
 	const char* myfields;
@@ -457,7 +512,7 @@ output_plain_fields (MuMsg *msg, const char *fields,
 		else {
 			ansi_color_maybe (mfid, color);
 			nonempty += mu_util_fputs_encoded
-			  (display_field (msg, mfid), stdout);
+			  (display_field (row, mfid), stdout);
 			ansi_reset_maybe (mfid, color);
 		}
 	}
@@ -467,18 +522,31 @@ output_plain_fields (MuMsg *msg, const char *fields,
 }
 
 static gboolean
-output_plain (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err)
+output_plain (MuMsgIter *iter, MuMsgIterRow *row, GString *buf,
+	      MuConfig *opts, GError **err)
 {
 	/* we reuse the color (whatever that may be)
 	 * for message-priority for threads, too */
 	ansi_color_maybe (MU_MSG_FIELD_ID_PRIO, !opts->nocolor);
 	if (opts->threads)
 		thread_indent (iter);
+	else if (opts->collapse)
+		collapse_count (iter);
 
-	output_plain_fields (msg, opts->fields, !opts->nocolor, opts->threads);
+	output_plain_fields (row, opts->fields, !opts->nocolor, opts->threads);
 
-	if (opts->summary_len > 0)
+	/* only for the summary, we need the full message */
+	if (opts->summary_len > 0) {
+		MuMsg *msg;
+		msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
+		if (!msg) {
+			mu_util_g_set_error (err, MU_ERROR_INTERNAL,
+					     "failed to get message %u",
+					     row->docid);
+			return FALSE;
+		}
 		print_summary (msg, opts->summary_len);
+	}
 
 	return TRUE;
 }
@@ -486,16 +554,30 @@ output_plain (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err)
 
 
 static gboolean
-output_sexp (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err)
+output_sexp (MuMsgIter *iter, MuMsgIterRow *row, GString *buf,
+	     MuConfig *opts, GError **err)
 {
-	char *sexp;
+	MuMsg *msg;
 	const MuMsgIterThreadInfo *ti;
 
-	ti   = opts->threads ? mu_msg_iter_get_thread_info (iter) : NULL;
-	sexp = mu_msg_to_sexp (msg, mu_msg_iter_get_docid (iter),
-			       ti, TRUE, FALSE);
-	fputs (sexp, stdout);
-	g_free (sexp);
+	msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
+	if (!msg) {
+		mu_util_g_set_error (err, MU_ERROR_INTERNAL,
+				     "failed to get message %u", row->docid);
+		return FALSE;
+	}
+
+	ti = opts->threads ? mu_msg_iter_get_thread_info (iter) : NULL;
+	if (opts->collapse)
+		g_string_printf (buf, "(:collapse-count %u\n",
+				 mu_msg_iter_get_collapse_count (iter));
+	else
+		g_string_assign (buf, "(\n");
+
+	mu_msg_append_sexp_props (msg, buf, row->docid, ti,
+				  MU_MSG_SEXP_PROFILE_HEADERS);
+	g_string_append (buf, ")\n");
+	fwrite (buf->str, 1, buf->len, stdout);
 
 	return TRUE;
 }
@@ -515,59 +597,94 @@ print_attr_xml (const char* elm, const char *str)
 
 
 static gboolean
-output_xml (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err)
+output_xml (MuMsgIter *iter, MuMsgIterRow *row, GString *buf,
+	    MuConfig *opts, GError **err)
 {
 	g_print ("\t<message>\n");
-	print_attr_xml ("from", mu_msg_get_from (msg));
-	print_attr_xml ("to", mu_msg_get_to (msg));
-	print_attr_xml ("cc", mu_msg_get_cc (msg));
-	print_attr_xml ("subject", mu_msg_get_subject (msg));
+	print_attr_xml ("from", row->str[MU_MSG_FIELD_ID_FROM]);
+	print_attr_xml ("to", row->str[MU_MSG_FIELD_ID_TO]);
+	print_attr_xml ("cc", row->str[MU_MSG_FIELD_ID_CC]);
+	print_attr_xml ("subject", row->str[MU_MSG_FIELD_ID_SUBJECT]);
 	g_print ("\t\t<date>%u</date>\n",
-		 (unsigned)mu_msg_get_date (msg));
-	g_print ("\t\t<size>%u</size>\n", (unsigned)mu_msg_get_size (msg));
-	print_attr_xml ("msgid", mu_msg_get_msgid (msg));
-	print_attr_xml ("path", mu_msg_get_path (msg));
-	print_attr_xml ("maildir", mu_msg_get_maildir (msg));
+		 (unsigned)row->num[MU_MSG_FIELD_ID_DATE]);
+	g_print ("\t\t<size>%u</size>\n",
+		 (unsigned)row->num[MU_MSG_FIELD_ID_SIZE]);
+	print_attr_xml ("msgid", row->str[MU_MSG_FIELD_ID_MSGID]);
+	print_attr_xml ("path", row->str[MU_MSG_FIELD_ID_PATH]);
+	print_attr_xml ("maildir", row->str[MU_MSG_FIELD_ID_MAILDIR]);
+	if (opts->collapse)
+		g_print ("\t\t<collapsed>%u</collapsed>\n",
+			 mu_msg_iter_get_collapse_count (iter));
 	g_print ("\t</message>\n");
 
 	return TRUE;
 }
 
 
+/* the fields (as shortcuts) the output format renders from the
+ * result rows; other formats get the full message */
+static const char*
+get_output_fields (MuConfig *opts)
+{
+	switch (opts->format) {
+	case MU_CONFIG_FORMAT_PLAIN: return opts->fields;
+	case MU_CONFIG_FORMAT_XML:   return "ftcsdzilm";
+	default:                     return NULL;
+	}
+}
+
+
+static OutputFunc*
+get_output_func (MuConfig *opts, GError **err)
+{
+	switch (opts->format) {
+	case MU_CONFIG_FORMAT_EXEC:  return exec_cmd;
+	case MU_CONFIG_FORMAT_LINKS:
+		return prepare_links (opts, err) ? output_link : NULL;
+	case MU_CONFIG_FORMAT_PLAIN: return output_plain;
+	case MU_CONFIG_FORMAT_XML:   return output_xml;
+	case MU_CONFIG_FORMAT_SEXP: return output_sexp;
+	default: g_return_val_if_reached (NULL);
+	}
+}
+
+
 static gboolean
 output_query_results (MuMsgIter *iter, MuConfig *opts, GError **err)
 {
 	unsigned count;
 	gboolean rv;
 	OutputFunc *output_func;
+	MuMsgIterRow row;
+	GString *buf;
+	guint32 fields;
 
-	switch (opts->format) {
-	case MU_CONFIG_FORMAT_EXEC:  output_func = exec_cmd; break;
-	case MU_CONFIG_FORMAT_LINKS:
-		if (!prepare_links (opts, err))
-			return FALSE;
-		output_func = output_link;
-		break;
-	case MU_CONFIG_FORMAT_PLAIN: output_func = output_plain; break;
-	case MU_CONFIG_FORMAT_XML:   output_func = output_xml;
+	output_func = get_output_func (opts, err);
+	if (!output_func)
+		return FALSE;
+
+	fields = get_fields_mask (get_output_fields (opts));
+	buf    = g_string_sized_new (1024);
+
+	if (opts->format == MU_CONFIG_FORMAT_XML) {
 		g_print ("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n");
 		g_print ("<messages>\n");
-		break;
-	case MU_CONFIG_FORMAT_SEXP: output_func = output_sexp; break;
-			break;
-	default: g_assert_not_reached ();
 	}
 
 	for (count = 0, rv = TRUE; !mu_msg_iter_is_done(iter);
 	     mu_msg_iter_next (iter)) {
 
-		MuMsg *msg;
-
-		msg = get_message (iter, opts->after);
-		if (!msg)
+		if (!mu_msg_iter_get_row (iter, fields, &row)) {
+			mu_util_g_set_error (err, MU_ERROR_XAPIAN,
+					     "failed to get the next result");
+			rv = FALSE;
 			break;
+		}
 
-		rv = output_func (msg, iter, opts, err);
+		if (skip_message (&row, opts->after))
+			continue;
+
+		rv = output_func (iter, &row, buf, opts, err);
 		if (!rv)
 			break;
 		else
@@ -577,6 +694,8 @@ output_query_results (MuMsgIter *iter, MuConfig *opts, GError **err)
 	if (opts->format == MU_CONFIG_FORMAT_XML)
 		g_print ("</messages>\n");
 
+	g_string_free (buf, TRUE);
+
 	if (rv && count == 0) {
 		mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
 				     "no matches for search expression");
@@ -121,9 +121,20 @@ check_maildir (const char *maildir, GError **err)
 }
 
 
+struct _IndexData {
+	gboolean	 color;
+	MuCmdBroker	*broker; /* for the other mu processes, or NULL */
+};
+typedef struct _IndexData IndexData;
+
+
 static MuError
-index_msg_silent_cb (MuIndexStats* stats, void *user_data)
+index_msg_silent_cb (MuIndexStats* stats, IndexData *idata)
 {
+	/* let the other processes write in between */
+	if (idata->broker)
+		mu_cmd_broker_yield_store (idata->broker);
+
 	return MU_CAUGHT_SIGNAL ? MU_STOP: MU_OK;
 }
 
@@ -167,15 +178,12 @@ print_stats (MuIndexStats* stats, gboolean clear, gboolean color)
 }
 
 
-struct _IndexData {
-	gboolean color;
-};
-typedef struct _IndexData IndexData;
-
-
 static MuError
 index_msg_cb  (MuIndexStats* stats, IndexData *idata)
 {
+	if (idata->broker)
+		mu_cmd_broker_yield_store (idata->broker);
+
 	if (stats->_processed % 25)
 	 	return MU_OK;
 
@@ -246,7 +254,7 @@ show_time (unsigned t, unsigned processed, gboolean color)
 
 static MuError
 cleanup_missing (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
-		 gboolean show_progress, GError **err)
+		 gboolean show_progress, MuCmdBroker *broker, GError **err)
 {
 	MuError rv;
 	time_t t;
@@ -259,7 +267,8 @@ cleanup_missing (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
 	mu_index_stats_clear (stats);
 
 	t = time (NULL);
-	idata.color = !opts->nocolor;
+	idata.color  = !opts->nocolor;
+	idata.broker = broker;
 	rv = mu_index_cleanup
 		(midx, stats,
 		 show_progress ?
@@ -278,6 +287,27 @@ cleanup_missing (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
 }
 
 
+static MuError
+reorder_by_date (MuStore *store, MuConfig *opts, GError **err)
+{
+	time_t t;
+
+	if (!opts->quiet)
+		g_print ("renumbering messages by date [%s]\n",
+			 mu_runtime_path (MU_RUNTIME_PATH_XAPIANDB));
+
+	t = time (NULL);
+	if (!mu_store_reorder_by_date (store, err))
+		return MU_G_ERROR_CODE(err);
+
+	if (!opts->quiet)
+		show_time ((unsigned)(time(NULL)-t), mu_store_count (store, NULL),
+			   !opts->nocolor);
+
+	return MU_OK;
+}
+
+
 static void
 index_title (const char* maildir, const char* xapiandir, gboolean color)
 {
@@ -295,7 +325,7 @@ index_title (const char* maildir, const char* xapiandir, gboolean color)
 
 static MuError
 cmd_index (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
-	   gboolean show_progress, GError **err)
+	   gboolean show_progress, MuCmdBroker *broker, GError **err)
 {
 	IndexData idata;
 	MuError rv;
@@ -307,7 +337,8 @@ cmd_index (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
 		index_title (opts->maildir, mu_runtime_path(MU_RUNTIME_PATH_XAPIANDB),
 			     !opts->nocolor);
 
-	idata.color = !opts->nocolor;
+	idata.color  = !opts->nocolor;
+	idata.broker = broker;
 	rv = mu_index_run (midx, opts->maildir, opts->reindex, stats,
 			   show_progress ?
 			   (MuIndexMsgCallback)index_msg_cb :
@@ -325,7 +356,8 @@ cmd_index (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
 		MU_WRITE_LOG ("index: processed: %u; updated/new: %u",
 			      stats->_processed, stats->_updated);
 		if (rv == MU_OK && !opts->nocleanup)
-			rv = cleanup_missing (midx, opts, stats, show_progress, err);
+			rv = cleanup_missing (midx, opts, stats, show_progress,
+					      broker, err);
 		if (rv == MU_STOP)
 			rv = MU_OK;
 	} else
@@ -366,6 +398,7 @@ mu_cmd_index (MuStore *store, MuConfig *opts, GError **err)
 {
 	MuIndex *midx;
 	MuIndexStats stats;
+	MuCmdBroker *broker;
 	gboolean rv, show_progress;
 
 	g_return_val_if_fail (opts, FALSE);
@@ -382,8 +415,161 @@ mu_cmd_index (MuStore *store, MuConfig *opts, GError **err)
 	mu_index_stats_clear (&stats);
 	install_sig_handler ();
 
-	rv = cmd_index (midx, opts, &stats, show_progress, err);
+	/* meanwhile, other mu processes can write through us, rather
+	 * than wait for the write lock */
+	if ((broker = mu_cmd_broker_new (store, FALSE, NULL)))
+		mu_cmd_broker_lock_store (broker);
+
+	rv = cmd_index (midx, opts, &stats, show_progress, broker, err);
 	mu_index_destroy (midx);
 
+	if (rv == MU_OK && opts->date_order && !MU_CAUGHT_SIGNAL)
+		rv = reorder_by_date (store, opts, err);
+
+	if (broker) {
+		mu_cmd_broker_unlock_store (broker);
+		mu_cmd_broker_destroy (broker);
+	}
+
+	return rv;
+}
+
+
+static gboolean
+get_num_prop (const char *expr, const char *prop, unsigned *num)
+{
+	const char *str;
+
+	str = strstr (expr, prop);
+	return str && sscanf (str + strlen (prop), " %u", num) == 1;
+}
+
+
+/* read the daemon's responses, and show the progress */
+static MuError
+follow_index (int fd, MuConfig *opts, MuIndexStats *stats,
+	      gboolean show_progress, GError **err)
+{
+	GString *buf;
+	char *expr;
+	gboolean cancelling;
+	MuError rv;
+
+	buf	   = g_string_sized_new (1024);
+	cancelling = FALSE;
+	rv	   = MU_ERROR;
+
+	while ((expr = mu_cmd_daemon_read_expr (fd, buf, err))) {
+
+		unsigned num;
+
+		if (get_num_prop (expr, ":processed", &num))
+			stats->_processed = num;
+		if (get_num_prop (expr, ":updated", &num))
+			stats->_updated = num;
+		if (get_num_prop (expr, ":cleaned-up", &num))
+			stats->_cleaned_up = num;
+
+		if (show_progress)
+			print_stats (stats, TRUE, !opts->nocolor);
+
+		if (strstr (expr, ":status complete")) {
+			rv = MU_OK;
+			g_free (expr);
+			break;
+		}
+
+		/* that's only fine when we asked for it */
+		if (strstr (expr, ":status cancelled")) {
+			if (cancelling)
+				rv = MU_OK;
+			else
+				mu_util_g_set_error
+					(err, MU_ERROR,
+					 "mu cancelled the indexing");
+			g_free (expr);
+			break;
+		}
+		g_free (expr);
+
+		/* the daemon stops, and tells us how far it got */
+		if (MU_CAUGHT_SIGNAL && !cancelling)
+			cancelling = mu_cmd_daemon_send (fd, "cancel id:1");
+	}
+
+	if (rv != MU_OK)
+		rv = MU_G_ERROR_CODE (err);
+
+	g_string_free (buf, TRUE);
+
+	return rv;
+}
+
+
+MuError
+mu_cmd_index_remote (int fd, MuConfig *opts, GError **err)
+{
+	MuIndexStats stats;
+	GString *cmdline;
+	gboolean show_progress;
+	MuError rv;
+	time_t t;
+
+	g_return_val_if_fail (opts, MU_ERROR_INTERNAL);
+	g_return_val_if_fail (opts->cmd == MU_CONFIG_CMD_INDEX,
+			      MU_ERROR_INTERNAL);
+
+	if (!check_params (opts, err) ||
+	    !check_maildir (opts->maildir, err)) {
+		close (fd);
+		return MU_G_ERROR_CODE(err);
+	}
+
+	/* the daemon only does 'normal' indexing */
+	if (opts->rebuild || opts->reindex || opts->date_order) {
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR_IN_PARAMETERS,
+			     "mu daemon is running; stop it to --rebuild, "
+			     "--reindex or --date-order");
+		close (fd);
+		return MU_ERROR_IN_PARAMETERS;
+	}
+
+	show_progress = !opts->quiet && isatty(fileno(stdout));
+	if (!opts->quiet)
+		index_title (opts->maildir,
+			     mu_runtime_path (MU_RUNTIME_PATH_SOCKET),
+			     !opts->nocolor);
+
+	/* with an id, we can cancel it */
+	cmdline = g_string_new ("index id:1");
+	mu_cmd_daemon_append_param (cmdline, "path", opts->maildir);
+	if (opts->my_addresses) {
+		char *addrs;
+		addrs = g_strjoinv (",", opts->my_addresses);
+		mu_cmd_daemon_append_param (cmdline, "my-addresses", addrs);
+		g_free (addrs);
+	}
+
+	mu_index_stats_clear (&stats);
+	install_sig_handler ();
+	t = time (NULL);
+
+	if (!mu_cmd_daemon_send (fd, cmdline->str)) {
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR,
+			     "cannot talk to mu daemon: %s", strerror (errno));
+		rv = MU_ERROR;
+	} else
+		rv = follow_index (fd, opts, &stats, show_progress, err);
+
+	if (rv == MU_OK && !opts->quiet) {
+		print_stats (&stats, TRUE, !opts->nocolor);
+		g_print ("\n");
+		show_time ((unsigned)(time(NULL)-t),
+			   stats._processed, !opts->nocolor);
+	}
+
+	g_string_free (cmdline, TRUE);
+	close (fd);
+
 	return rv;
 }
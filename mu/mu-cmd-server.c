@@ -28,6 +28,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
 
 #include <glib/gprintf.h>
 
@@ -83,6 +89,41 @@ install_sig_handler (void)
 /************************************************************************/
 
 
+/* requests ************************************************************/
+/*
+ * a command with an id:<n> param is a request; its responses get an
+ * :id <n> property, and it can be cancelled with 'cancel id:<n>'
+ * (see the jobs below). We keep the request a thread is working on
+ * in CURRENT_REQUEST.
+ */
+struct _ServerRequest {
+	unsigned id;
+	gint	 cancelled;	/* atomic */
+};
+typedef struct _ServerRequest ServerRequest;
+static GStaticPrivate CURRENT_REQUEST = G_STATIC_PRIVATE_INIT;
+
+static ServerRequest*
+current_request (void)
+{
+	return (ServerRequest*)g_static_private_get (&CURRENT_REQUEST);
+}
+
+/* long-running commands check this, and stop when it returns TRUE */
+static gboolean
+is_cancelled (void)
+{
+	ServerRequest *req;
+
+	if (MU_TERMINATE)
+		return TRUE;
+
+	req = current_request ();
+	return req && g_atomic_int_get (&req->cancelled);
+}
+/************************************************************************/
+
+
 /*
  * Markers for/after the lenght cookie that precedes the expression we
  * write to output. We use octal 376, 377 (ie, 0xfe, 0xff) as they
@@ -92,49 +133,217 @@ install_sig_handler (void)
 #define COOKIE_PRE  '\376'
 #define COOKIE_POST '\377'
 
-static void G_GNUC_PRINTF(1, 2)
-print_expr (const char* frm, ...)
+/*
+ * we don't write each expression right away, but collect them in a
+ * buffer, which we write with a single writev when it gets big, when
+ * we add one while the first has been waiting for a while, or when
+ * we're done with a command (flush_output); there's no timer, so a
+ * lone expression waits for the end of its command. The expressions
+ * in the buffer are 0-terminated, and the 0 becomes the \n we write
+ * after each of them.
+ */
+#define OUTPUT_MAX_SIZE	  (64 * 1024)	/* flush above this size */
+#define OUTPUT_MAX_DELAY  0.05		/* or when adding after this (s) */
+#define OUTPUT_MAX_FRAMES 64		/* or with this many (<= IOV_MAX/3) */
+
+struct _ServerOutput {
+	GStaticMutex lock;		  /* jobs write output as well */
+	int	 fd;
+	GString *buf;			  /* the expressions */
+	gsize	 offsets[OUTPUT_MAX_FRAMES]; /* where each starts in buf */
+	char	 cookies[OUTPUT_MAX_FRAMES][16];
+	unsigned frames;
+	GTimer	*timer;			  /* since the first frame */
+	gboolean broken;		  /* writing failed */
+};
+typedef struct _ServerOutput ServerOutput;
+
+/* stdout, for 'mu server'; each 'mu daemon' client has an output of
+ * its own, and the threads working for it have it in
+ * CURRENT_OUTPUT */
+static ServerOutput OUTPUT;
+static GStaticPrivate CURRENT_OUTPUT = G_STATIC_PRIVATE_INIT;
+
+
+static ServerOutput*
+current_output (void)
 {
-	char *expr;
-	va_list ap;
-	ssize_t rv;
-	size_t exprlen, lenlen;
-	char cookie[16];
-	static int outfd = 0;
+	ServerOutput *out;
 
-	if (outfd == 0)
-		outfd = fileno (stdout);
+	out = (ServerOutput*)g_static_private_get (&CURRENT_OUTPUT);
+	return out ? out : &OUTPUT;
+}
 
-	expr    = NULL;
 
-	va_start (ap, frm);
-	exprlen = g_vasprintf (&expr, frm, ap);
-	va_end (ap);
+static void
+server_output_init (ServerOutput *out, int fd)
+{
+	g_static_mutex_init (&out->lock);
 
-	/* this cookie tells the frontend where to expect the next
-	 * expression */
+	out->fd	    = fd;
+	out->buf    = g_string_sized_new (OUTPUT_MAX_SIZE);
+	out->frames = 0;
+	out->timer  = g_timer_new ();
+	out->broken = FALSE;
+}
 
-	cookie[0] = COOKIE_PRE;
-	lenlen = sprintf(cookie + 1, "%x",
-			 (unsigned)exprlen + 1); /* + 1 for \n */
-	cookie[lenlen + 1] = COOKIE_POST;
-
-	/* write the cookie, ie.
-	 *   COOKIE_PRE <len-of-following-sexp-in-hex> COOKIE_POST
-	 */
-	rv = write (outfd, cookie, lenlen + 2);
-	if (rv != -1) {
-		rv = write (outfd, expr, exprlen);
-		g_free (expr);
+
+static void
+server_output_uninit (ServerOutput *out)
+{
+	g_string_free (out->buf, TRUE);
+	g_timer_destroy (out->timer);
+	g_static_mutex_free (&out->lock);
+}
+
+
+/* write all of iov, even if writev writes only part of it */
+static gboolean
+writev_all (int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t rv;
+		rv = writev (fd, iov, iovcnt);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv == -1)
+			return FALSE;
+		for (; iovcnt > 0 && (size_t)rv >= iov->iov_len; ++iov, --iovcnt)
+			rv -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/* write the buffered expressions, as
+ *   COOKIE_PRE <len-of-following-sexp-in-hex> COOKIE_POST <sexp> \n
+ * with out->lock held
+ */
+static void
+flush_output_unlocked (ServerOutput *out)
+{
+	struct iovec iov[OUTPUT_MAX_FRAMES * 3];
+	unsigned u, n;
+
+	if (out->frames == 0)
+		return;
+
+	for (u = n = 0; u != out->frames; ++u) {
+		const char *expr;
+		size_t exprlen;
+		expr	= out->buf->str + out->offsets[u];
+		exprlen = strlen (expr);
+		/* the cookie tells the frontend where to expect the
+		 * next expression */
+		iov[n].iov_base	  = out->cookies[u];
+		iov[n++].iov_len  = strlen (out->cookies[u]);
+		iov[n].iov_base	  = (char*)expr;
+		iov[n++].iov_len  = exprlen;
+		iov[n].iov_base	  = "\n";
+		iov[n++].iov_len  = 1;
+	}
+
+	/* nobody is listening anymore when it's broken */
+	if (!out->broken && !writev_all (out->fd, iov, n)) {
+		out->broken = TRUE;
+		if (out == &OUTPUT) {
+			g_critical ("%s: writev() failed: %s",
+				    __FUNCTION__, strerror(errno));
+			/* terminate ourselves */
+			raise (SIGTERM);
+		} /* else, the client went away */
 	}
-	if (rv != -1)
-		rv = write (outfd, "\n", 1);
-	if (rv == -1) {
-		g_critical ("%s: write() failed: %s",
-			   __FUNCTION__, strerror(errno));
-		/* terminate ourselves */
-		raise (SIGTERM);
+
+	/* the iovecs point into buf, so only now we can reuse it */
+	out->frames = 0;
+	g_string_truncate (out->buf, 0);
+}
+
+
+static void
+flush_output (void)
+{
+	ServerOutput *out;
+
+	out = current_output ();
+
+	g_static_mutex_lock (&out->lock);
+	flush_output_unlocked (out);
+	g_static_mutex_unlock (&out->lock);
+}
+
+
+/* start a new expression; append it to the GString we return, and
+ * call output_end when done. Nothing else can write output in
+ * between. */
+static GString*
+output_begin (void)
+{
+	ServerOutput *out;
+
+	out = current_output ();
+	g_static_mutex_lock (&out->lock);
+
+	if (out->frames == 0)
+		g_timer_start (out->timer);
+
+	out->offsets[out->frames] = out->buf->len;
+
+	return out->buf;
+}
+
+
+static void
+output_end (void)
+{
+	ServerOutput *out;
+	gsize start;
+	char *cookie;
+	ServerRequest *req;
+
+	out   = current_output ();
+	start = out->offsets[out->frames];
+
+	/* tag the responses to requests */
+	req = current_request ();
+	if (req && out->buf->str[start] == '(') {
+		char tag[32];
+		g_snprintf (tag, sizeof(tag), ":id %u ", req->id);
+		g_string_insert (out->buf, start + 1, tag);
 	}
+
+	g_string_append_c (out->buf, '\0');
+
+	cookie	  = out->cookies[out->frames++];
+	cookie[0] = COOKIE_PRE;
+	sprintf (cookie + 1, "%x%c",
+		 (unsigned)(out->buf->len - start), /* + 1 for \n */
+		 COOKIE_POST);
+
+	if (out->frames == OUTPUT_MAX_FRAMES ||
+	    out->buf->len >= OUTPUT_MAX_SIZE ||
+	    g_timer_elapsed (out->timer, NULL) >= OUTPUT_MAX_DELAY)
+		flush_output_unlocked (out);
+
+	g_static_mutex_unlock (&out->lock);
+}
+
+
+static void G_GNUC_PRINTF(1, 2)
+print_expr (const char* frm, ...)
+{
+	va_list ap;
+
+	va_start (ap, frm);
+	g_string_append_vprintf (output_begin (), frm, ap);
+	va_end (ap);
+
+	output_end ();
 }
 
 
@@ -166,67 +375,190 @@ print_and_clear_g_error (GError **err)
 }
 
 
-static GSList*
-read_line_as_list (GError **err)
+/* input *************************************************************/
+/*
+ * we read the commands in chunks, and split each line in place into
+ * the command and its param:value arguments; these point into the
+ * line buffer, so there are no per-byte or per-token allocations, and
+ * looking up a parameter is a hash table lookup.
+ */
+
+#define INPUT_CHUNK_SIZE 4096
+
+struct _ServerInput {
+	int	 fd;
+	GString *buf;	/* the input we have not handled yet */
+	gsize	 pos;	/* the start of the next line in buf */
+	gboolean eof;
+	gboolean prompt; /* whether to show a prompt */
+};
+typedef struct _ServerInput ServerInput;
+
+struct _ServerArgs {
+	const char *cmd;
+	GHashTable *params;	/* param => value, both in the line */
+};
+typedef struct _ServerArgs ServerArgs;
+
+
+static void
+server_input_init (ServerInput *input, int fd, gboolean prompt)
 {
-	char *line;
-	GSList *lst;
-	GString *gstr;
+	input->fd     = fd;
+	input->buf    = g_string_sized_new (INPUT_CHUNK_SIZE);
+	input->pos    = 0;
+	input->eof    = FALSE;
+	input->prompt = prompt;
+}
 
-	line = NULL;
-	gstr = g_string_sized_new (512);
 
-	fputs (";; mu> ", stdout);
+static void
+server_input_uninit (ServerInput *input)
+{
+	g_string_free (input->buf, TRUE);
+}
 
-	do {
-		int kar;
 
-		kar = fgetc (stdin);
-		if (kar == '\n' || kar == EOF)
-			break;
-		else
-			gstr = g_string_append_c (gstr, (char)kar);
+/* read the next chunk of input into buf; FALSE on EOF or error */
+static gboolean
+read_chunk (ServerInput *input)
+{
+	ssize_t len;
+	gsize oldlen;
 
-	} while (1);
+	/* drop the lines we handled already */
+	g_string_erase (input->buf, 0, input->pos);
+	input->pos = 0;
 
-	line = g_string_free (gstr, FALSE);
-	lst = mu_str_esc_to_list (line, err);
+	oldlen = input->buf->len;
+	g_string_set_size (input->buf, oldlen + INPUT_CHUNK_SIZE);
 
-	g_free (line);
+	do
+		len = read (input->fd, input->buf->str + oldlen,
+			    INPUT_CHUNK_SIZE);
+	while (len == -1 && errno == EINTR && !MU_TERMINATE);
 
-	return lst;
+	if (len == -1 && !MU_TERMINATE)
+		g_warning ("%s: read() failed: %s", __FUNCTION__,
+			   strerror (errno));
+	g_string_set_size (input->buf, oldlen + (len > 0 ? len : 0));
+
+	return len > 0;
 }
 
 
-static const char*
-get_string_from_args (GSList *args, const char *param, gboolean optional,
-		      GError **err)
+/* get the next line, 0-terminated and without the \n; this points
+ * into the buffer, and stays valid until the next call. If the input
+ * ends without a \n, return what we have, and NULL after that */
+static char*
+read_line (ServerInput *input)
+{
+	char *line, *eol;
+
+	if (input->prompt)
+		fputs (";; mu> ", stdout);
+
+	while (!(eol = memchr (input->buf->str + input->pos, '\n',
+			       input->buf->len - input->pos))) {
+		if (input->eof || !read_chunk (input)) {
+			if (input->eof || input->pos == input->buf->len)
+				return NULL;
+			input->eof = TRUE; /* the last, unterminated line */
+			g_string_append_c (input->buf, '\n');
+		}
+	}
+
+	line	   = input->buf->str + input->pos;
+	*eol	   = '\0';
+	input->pos = eol - input->buf->str + 1;
+
+	return line;
+}
+
+
+/* unescape the token at *cur in place, and move *cur past it; the
+ * rules are the ones of mu_str_esc_to_list: "..." quotes spaces, and
+ * \ escapes a space, " or \ */
+static char*
+eat_token (char **cur, GError **err)
 {
-	size_t param_len;
+	char *token, *r, *w;
+	gboolean quoted;
+
+	token = w = *cur;
+	for (r = *cur, quoted = FALSE; *r; ++r) {
+		if (*r == '"')
+			quoted = !quoted;
+		else if (*r == '\\') {
+			if (r[1] != ' ' && r[1] != '"' && r[1] != '\\') {
+				mu_util_g_set_error
+					(err, MU_ERROR_IN_PARAMETERS,
+					 "error parsing string '%s'", token);
+				return NULL;
+			}
+			*w++ = *++r;
+		} else if (*r == ' ' && !quoted) {
+			++r;
+			break;
+		} else
+			*w++ = *r;
+	}
+
+	*cur = r;
+	*w   = '\0';
+
+	return token;
+}
 
-	param_len = strlen (param);
 
-	while (args) {
+/* split line, in a single pass, into the command and a table of its
+ * param:value arguments; if a param occurs more than once, the first
+ * one wins */
+static gboolean
+parse_line (char *line, ServerArgs *args, GError **err)
+{
+	char *cur;
 
-		const char *arg;
-		arg = (const char*)args->data;
+	g_hash_table_remove_all (args->params);
 
-		/* do we have this param */
-		if (arg && g_str_has_prefix (arg, param) &&
-		    arg[param_len] == ':')
-			return (const char*) arg + param_len + 1;
+	for (cur = line; *cur == ' ' || *cur == '\t'; ++cur);
+	if (!(args->cmd = eat_token (&cur, err)))
+		return FALSE;
 
-		args = g_slist_next (args);
+	while (*cur) {
+		char *arg, *colon;
+		while (g_ascii_isspace (*cur))
+			++cur;
+		if (!*cur)
+			break;
+		if (!(arg = eat_token (&cur, err)))
+			return FALSE;
+		if (!(colon = strchr (arg, ':')))
+			continue; /* not a param:value */
+		*colon = '\0';
+		if (!g_hash_table_lookup (args->params, arg))
+			g_hash_table_insert (args->params, arg, colon + 1);
 	}
 
-	if (!optional)
+	return TRUE;
+}
+
+
+static const char*
+get_string_from_args (ServerArgs *args, const char *param, gboolean optional,
+		      GError **err)
+{
+	const char *val;
+
+	val = (const char*)g_hash_table_lookup (args->params, param);
+	if (!val && !optional)
 		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
 				     "parameter '%s' not found", param);
-	return NULL;
+	return val;
 }
 
 static gboolean
-get_bool_from_args (GSList *args, const char *param, gboolean optional, GError **err)
+get_bool_from_args (ServerArgs *args, const char *param, gboolean optional, GError **err)
 {
 	const char *val;
 
@@ -266,8 +598,8 @@ get_docid_from_msgid (MuQuery *query, const char *str, GError **err)
 	MuMsgIter *iter;
 
 	querystr = g_strdup_printf ("msgid:%s", str);
-	iter = mu_query_run (query, querystr, FALSE,
-			     MU_MSG_FIELD_ID_NONE, FALSE, 1, err);
+	iter = mu_query_run (query, querystr, MU_MSG_FIELD_ID_NONE, 1,
+			     MU_QUERY_FLAG_NONE, err);
 	g_free (querystr);
 
 	docid = MU_STORE_INVALID_DOCID;
@@ -300,9 +632,8 @@ get_docids_from_msgids (MuQuery *query, const char *str, GError **err)
 	GSList *lst;
 
 	querystr = g_strdup_printf ("msgid:%s", str);
-	iter = mu_query_run (query, querystr, FALSE,
-			     MU_MSG_FIELD_ID_NONE, FALSE,-1 /*unlimited*/,
-			     err);
+	iter = mu_query_run (query, querystr, MU_MSG_FIELD_ID_NONE,
+			     -1 /*unlimited*/, MU_QUERY_FLAG_NONE, err);
 	g_free (querystr);
 
 	if (!iter || mu_msg_iter_is_done (iter)) {
@@ -329,7 +660,7 @@ get_docids_from_msgids (MuQuery *query, const char *str, GError **err)
  * locale the message with message-id in the database, and return its
  * docid */
 static unsigned
-determine_docid (MuQuery *query, GSList *args, GError **err)
+determine_docid (MuQuery *query, ServerArgs *args, GError **err)
 {
 	const char* docidstr, *msgidstr;
 
@@ -361,12 +692,85 @@ determine_docid (MuQuery *query, GSList *args, GError **err)
 #define EQSTR(S1,S2) (g_strcmp0((S1),(S2))==0)
 
 
+/* the writable store can be used by one thread at a time; a
+ * long-running command lets others go first now and then (see
+ * yield_store). all fields are protected by mutex */
+struct _StoreLock {
+	GMutex	 *mutex;
+	GCond	 *cond;	    /* signalled when the store is released */
+	gboolean  busy;	    /* some thread has the store */
+	guint	  waiters;  /* threads waiting for the store */
+	guint	  served;   /* number of times a waiter got the store */
+};
+typedef struct _StoreLock StoreLock;
+
+struct _ResultCache;
+typedef struct _ResultCache ResultCache;
+
 struct _ServerContext {
-	MuStore *store;
-	MuQuery *query;
+	MuStore		*store;
+	MuQuery		*query;
+	StoreLock	*store_lock;  /* for store, query; or NULL */
+	GHashTable	*jobs;	      /* id => ServerJob */
+	ResultCache	*results;     /* see cmd_fetch */
+	gboolean	 daemon;      /* are we mu daemon? */
 };
 typedef struct _ServerContext ServerContext;
 
+
+static void
+lock_store (StoreLock *lock)
+{
+	g_mutex_lock (lock->mutex);
+
+	++lock->waiters;
+	while (lock->busy)
+		g_cond_wait (lock->cond, lock->mutex);
+	--lock->waiters;
+	++lock->served;
+	lock->busy = TRUE;
+
+	g_mutex_unlock (lock->mutex);
+}
+
+
+static void
+unlock_store (StoreLock *lock)
+{
+	g_mutex_lock (lock->mutex);
+	lock->busy = FALSE;
+	g_cond_broadcast (lock->cond);
+	g_mutex_unlock (lock->mutex);
+}
+
+
+/* if some other threads are waiting for the store, let them have it
+ * first; we take it back after as many threads as were waiting have
+ * had it, so we don't wait for all the ones that come after */
+static void
+yield_store (StoreLock *lock)
+{
+	guint until;
+
+	if (!lock)
+		return;
+
+	g_mutex_lock (lock->mutex);
+
+	if (lock->waiters > 0) {
+		until	   = lock->served + lock->waiters;
+		lock->busy = FALSE;
+		g_cond_broadcast (lock->cond);
+
+		/* note: compare the difference, 'served' may wrap */
+		while (lock->busy || (gint)(until - lock->served) > 0)
+			g_cond_wait (lock->cond, lock->mutex);
+		lock->busy = TRUE;
+	}
+
+	g_mutex_unlock (lock->mutex);
+}
+
 /*************************************************************************/
 /* implementation for the commands -- for each command <x>, there is a
  * dedicated function cmd_<x>. These function all are of the type CmdFunc
@@ -378,23 +782,24 @@ typedef struct _ServerContext ServerContext;
  * if function return non-MU_OK, the repl will print the error instead
  */
 
-typedef MuError (*CmdFunc) (ServerContext*,GSList*,GError**);
+typedef MuError (*CmdFunc) (ServerContext*,ServerArgs*,GError**);
 
 
 /* 'add' adds a message to the database, and takes two parameters:
  * 'path', which is the full path to the message, and 'maildir', which
- * is the maildir this message lives in (e.g. "/inbox"). response with
- * an (:info ...) message with information about the newly added
- * message (details: see code below)
+ * is the maildir this message lives in (e.g. "/inbox"); without it,
+ * the maildir is derived from the path. response with an (:info ...)
+ * message with information about the newly added message (details:
+ * see code below)
  */
 static MuError
-cmd_add (ServerContext *ctx, GSList *args, GError **err)
+cmd_add (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	unsigned docid;
 	const char *maildir, *path;
 
 	GET_STRING_OR_ERROR_RETURN (args, "path", &path, err);
-	GET_STRING_OR_ERROR_RETURN (args, "maildir", &maildir, err);
+	maildir = get_string_from_args (args, "maildir", TRUE, NULL);
 
 	docid = mu_store_add_path (ctx->store, path, maildir, err);
 	if (docid == MU_STORE_INVALID_DOCID)
@@ -482,6 +887,18 @@ compose_type (const char *typestr)
 		return INVALID_TYPE;
 }
 
+/* 'commit' commits the changes to the database so far; for other
+ * processes writing through us */
+static MuError
+cmd_commit (ServerContext *ctx, ServerArgs *args, GError **err)
+{
+	mu_store_flush (ctx->store);
+	print_expr ("(:info commit)");
+
+	return MU_OK;
+}
+
+
 /* 'compose' produces the un-changed *original* message sexp (ie., the
  * message to reply to, forward or edit) for a new message to
  * compose). It takes two parameters: 'type' with the compose type
@@ -495,7 +912,7 @@ compose_type (const char *typestr)
  * Note ':include' t or nil determines whether to include attachments
  */
 static MuError
-cmd_compose (ServerContext *ctx, GSList *args, GError **err)
+cmd_compose (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	const gchar *typestr;
 	char *sexp, *atts;
@@ -577,15 +994,19 @@ each_contact_sexp (const char *email, const char *name, gboolean personal,
 
 
 /**
- * get all contacts as an s-expression
+ * get the contacts changed since some generation as an s-expression,
+ * with the current generation, for the next update
  *
  * @param self contacts object
  * @param personal_only whether to restrict the list to 'personal' email addresses
+ * @param after only include contacts seen after this time
+ * @param generation only include contacts changed after this generation
  *
  * @return the sexp
  */
 static char*
-contacts_to_sexp (MuContacts *contacts, gboolean personal, time_t after)
+contacts_to_sexp (MuContacts *contacts, gboolean personal, time_t after,
+		  guint32 generation)
 {
 	SexpData sdata;
 
@@ -595,69 +1016,135 @@ contacts_to_sexp (MuContacts *contacts, gboolean personal, time_t after)
 	sdata.after    = after;
 
 	/* make a guess for the initial size */
-	sdata.gstr = g_string_sized_new (mu_contacts_count(contacts) * 128);
+	sdata.gstr = g_string_sized_new
+		(generation ? 4096 : mu_contacts_count(contacts) * 128);
 	sdata.gstr = g_string_append (sdata.gstr, "(:contacts (");
-	mu_contacts_foreach (contacts,
-			     (MuContactsForeachFunc)each_contact_sexp,
-			     &sdata, NULL, NULL);
-	sdata.gstr = g_string_append (sdata.gstr, "))");
+	mu_contacts_foreach_since (contacts, generation,
+				   (MuContactsForeachFunc)each_contact_sexp,
+				   &sdata, NULL);
+	g_string_append_printf (sdata.gstr, ") :generation %u)",
+				mu_contacts_generation (contacts));
 
 	return g_string_free (sdata.gstr, FALSE);
 }
 
 
 static MuError
-cmd_contacts (ServerContext *ctx, GSList *args, GError **err)
+cmd_contacts (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	MuContacts *contacts;
 	char *sexp;
 	gboolean personal;
 	time_t after;
+	guint32 generation;
 	const char *str;
 
 	personal = get_bool_from_args (args, "personal", TRUE, NULL);
 	str = get_string_from_args (args, "after", TRUE, NULL);
 	after = str ? (time_t)atoi(str) : 0;
+	str = get_string_from_args (args, "since-generation", TRUE, NULL);
+	generation = str ? (guint32)strtoul (str, NULL, 10) : 0;
 
-	contacts = mu_contacts_new
-		(mu_runtime_path (MU_RUNTIME_PATH_CONTACTS));
+	/* the store's contacts are kept up to date while indexing, so
+	 * we don't need to re-read the cache */
+	contacts = mu_store_get_contacts (ctx->store);
 	if (!contacts) {
 		print_error (MU_ERROR_INTERNAL,
 			     "failed to open contacts cache");
 		return MU_OK;
 	}
 
-	/* dump the contacts cache as a giant sexp */
-	sexp = contacts_to_sexp (contacts, personal, after);
+	sexp = contacts_to_sexp (contacts, personal, after, generation);
 	print_expr ("%s\n", sexp);
 	g_free (sexp);
 
-	mu_contacts_destroy (contacts);
 	return MU_OK;
 }
 
 
+/* complete a prefix of a contact's name or e-mail address, with the
+ * best matches first */
+static MuError
+cmd_complete (ServerContext *ctx, ServerArgs *args, GError **err)
+{
+	MuContacts *contacts;
+	SexpData sdata;
+	const char *prefix, *str;
+	size_t limit;
+
+	GET_STRING_OR_ERROR_RETURN (args, "prefix", &prefix, err);
+	str   = get_string_from_args (args, "limit", TRUE, NULL);
+	limit = str && atoi(str) > 0 ? (size_t)atoi(str) : 0;
+
+	/* the store's contacts are shared by all clients */
+	contacts = mu_store_get_contacts (ctx->store);
+	if (!contacts) {
+		print_error (MU_ERROR_INTERNAL,
+			     "failed to open contacts cache");
+		return MU_OK;
+	}
+
+	sdata.personal = FALSE; /* handled by mu_contacts_complete */
+	sdata.after    = 0;
+	sdata.gstr     = g_string_new ("(:complete (");
+	mu_contacts_complete (contacts, prefix,
+			      get_bool_from_args (args, "personal", TRUE, NULL),
+			      limit, (MuContactsForeachFunc)each_contact_sexp,
+			      &sdata, NULL);
+	g_string_append (sdata.gstr, "))");
+
+	print_expr ("%s\n", sdata.gstr->str);
+	g_string_free (sdata.gstr, TRUE);
+
+	return MU_OK;
+}
+
+
+
+/* write the headers sexp straight into the output buffer */
+static void
+append_sexp (GString *gstr, MuMsg *msg, unsigned docid,
+	     const MuMsgIterThreadInfo *ti, unsigned collapse_count,
+	     MuQueryFlags qflags)
+{
+	if (qflags & MU_QUERY_FLAG_COLLAPSE_THREADS)
+		g_string_append_printf (gstr, "(:collapse-count %u\n",
+					collapse_count);
+	else
+		g_string_append (gstr, "(\n");
+
+	mu_msg_append_sexp_props (msg, gstr, docid, ti,
+				  MU_MSG_SEXP_PROFILE_HEADERS);
+	g_string_append (gstr, ")\n");
+}
+
+
+static void
+print_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
+	    unsigned collapse_count, MuQueryFlags qflags)
+{
+	append_sexp (output_begin (), msg, docid, ti, collapse_count, qflags);
+	output_end ();
+}
+
 
 static unsigned
-print_sexps (MuMsgIter *iter, gboolean threads, unsigned maxnum)
+print_sexps (MuMsgIter *iter, MuQueryFlags qflags, unsigned maxnum)
 {
 	unsigned u;
 	u = 0;
 
-	while (!mu_msg_iter_is_done (iter) && u < maxnum && !MU_TERMINATE) {
+	while (!mu_msg_iter_is_done (iter) && u < maxnum && !is_cancelled ()) {
 
 		MuMsg *msg;
 		msg = mu_msg_iter_get_msg_floating (iter);
 
 		if (mu_msg_is_readable (msg)) {
-			char *sexp;
-			const MuMsgIterThreadInfo* ti;
-
-			ti = threads ? mu_msg_iter_get_thread_info (iter) : NULL;
-			sexp = mu_msg_to_sexp (msg, mu_msg_iter_get_docid (iter),
-					       ti, TRUE, FALSE);
-			print_expr ("%s", sexp);
-			g_free (sexp);
+			print_sexp (msg, mu_msg_iter_get_docid (iter),
+				    qflags & MU_QUERY_FLAG_THREADS ?
+				    mu_msg_iter_get_thread_info (iter) : NULL,
+				    mu_msg_iter_get_collapse_count (iter),
+				    qflags);
 			++u;
 		}
 		mu_msg_iter_next (iter);
@@ -667,7 +1154,7 @@ print_sexps (MuMsgIter *iter, gboolean threads, unsigned maxnum)
 
 
 static MuError
-save_part (MuMsg *msg, unsigned index, GSList *args, GError **err)
+save_part (MuMsg *msg, unsigned index, ServerArgs *args, GError **err)
 {
 	gboolean rv;
 	const gchar *path;
@@ -723,7 +1210,7 @@ leave:
 
 
 static MuError
-temp_part (MuMsg *msg, unsigned index, GSList *args, GError **err)
+temp_part (MuMsg *msg, unsigned index, ServerArgs *args, GError **err)
 {
 	const char *what, *param;
 	char *path;
@@ -767,7 +1254,7 @@ action_type (const char *actionstr)
 
 /* 'extract' extracts some mime part from a message */
 static MuError
-cmd_extract (ServerContext *ctx, GSList *args, GError **err)
+cmd_extract (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	MuMsg *msg;
 	int docid, index, action;
@@ -808,10 +1295,37 @@ cmd_extract (ServerContext *ctx, GSList *args, GError **err)
 	return MU_OK;
 }
 
+static MuError
+get_collapse_param (ServerArgs *args, MuQueryFlags *qflags, GError **err)
+{
+	const char *collapsestr;
+
+	collapsestr = get_string_from_args (args, "collapse", TRUE, NULL);
+	if (!collapsestr)
+		return MU_OK;
+
+	if (g_strcmp0 (collapsestr, "thread") != 0) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "not a valid collapse mode: '%s'",
+				     collapsestr);
+		return MU_G_ERROR_CODE(err);
+	}
+
+	if (*qflags & MU_QUERY_FLAG_THREADS) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "cannot collapse threaded results");
+		return MU_G_ERROR_CODE(err);
+	}
+
+	*qflags |= MU_QUERY_FLAG_COLLAPSE_THREADS;
+	return MU_OK;
+}
+
+
 /* parse the find parameters, and return the values as out params */
 static MuError
-get_find_params (GSList *args, gboolean *threads, MuMsgFieldId *sortfield,
-		 gboolean *reverse, int *maxnum, GError **err)
+get_find_params (ServerArgs *args, MuMsgFieldId *sortfield, int *maxnum,
+		 MuQueryFlags *qflags, GError **err)
 {
 	const char *maxnumstr, *sortfieldstr;
 
@@ -819,9 +1333,23 @@ get_find_params (GSList *args, gboolean *threads, MuMsgFieldId *sortfield,
 	maxnumstr = get_string_from_args (args, "maxnum", TRUE, NULL);
 	*maxnum = maxnumstr ? atoi (maxnumstr) : 0;
 
-	/* whether to show threads or not */
-	*threads = get_bool_from_args (args, "threads", TRUE, NULL);
-	*reverse = get_bool_from_args (args, "reverse", TRUE, NULL);
+	/* whether to show threads or not, and whether to include
+	 * the whole threads of the matches */
+	*qflags = MU_QUERY_FLAG_NONE;
+	if (get_bool_from_args (args, "threads", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_THREADS;
+	if (get_bool_from_args (args, "reverse", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_DESCENDING;
+	if (get_bool_from_args (args, "include-related", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_INCLUDE_RELATED;
+	if (get_bool_from_args (args, "group-subjects", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_GROUP_SUBJECTS;
+	if (get_bool_from_args (args, "stored-threads", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_STORED_THREADS;
+
+	/* whether to return only one message per thread */
+	if (get_collapse_param (args, qflags, err) != MU_OK)
+		return MU_G_ERROR_CODE(err);
 
 	/* field to sort by */
 	sortfieldstr = get_string_from_args (args, "sortfield", TRUE, NULL);
@@ -840,28 +1368,474 @@ get_find_params (GSList *args, gboolean *threads, MuMsgFieldId *sortfield,
 }
 
 
+/* results ************************************************************/
 /*
- * 'find' finds a list of messages matching some query, and takes a
- * parameter 'query' with the search query, and (optionally) a
- * parameter 'maxnum' with the maximum number of messages to return.
+ * with handle:true, 'find' keeps its results -- the docids in their
+ * order, with their thread info -- instead of sending them, and
+ * 'fetch' sends the rows the frontend wants to show, so scrolling
+ * through a big result costs only what's visible. Each client keeps
+ * its results in a ResultCache, which drops the least recently used
+ * ones when there are more than RESULTS_MAX_SETS, or when they take
+ * more than RESULTS_MAX_SIZE together.
  *
- * returns:
- * => list of s-expressions, each describing a message =>
- * (:found <number of found messages>)
+ * note that we keep the docids, not the messages: 'fetch' shows them
+ * as they are now, not as they were when we searched (that would
+ * mean keeping a database snapshot open for each result); a message
+ * that has gone since is sent as (:remove <docid>) in its place.
  */
-static MuError
-cmd_find (ServerContext *ctx, GSList *args, GError **err)
+
+#define RESULTS_MAX_SETS 16
+#define RESULTS_MAX_SIZE (32 * 1024 * 1024)
+#define RESULT_NO_PATH	 G_MAXUINT32
+
+struct _ResultRow {
+	unsigned		docid;
+	unsigned		collapse_count;
+	guint32			path;  /* offset in paths, or RESULT_NO_PATH */
+	guint			level, order;
+	guint8			width;
+	MuMsgIterThreadProp	prop;
+	MuFlags			flags;	  /* to see what changed */
+	guint			pathhash; /* when refreshing */
+};
+typedef struct _ResultRow ResultRow;
+
+struct _ResultSet {
+	unsigned	 handle;
+	MuQueryFlags	 qflags;
+	GArray		*rows;	/* ResultRow */
+	GArray		*paths;	/* guint32 thread-path segments */
+	GList		*link;	/* in the cache's lru list */
+};
+typedef struct _ResultSet ResultSet;
+
+struct _ResultCache {
+	GMutex		*lock;	/* for jobs adding results */
+	GHashTable	*sets;	/* handle => ResultSet */
+	GQueue		*lru;	/* the most recently used first */
+	gsize		 size;
+	unsigned	 last_handle;
+};
+
+
+static ResultSet*
+result_set_new (MuMsgIter *iter, MuQueryFlags qflags, unsigned maxnum)
 {
-	MuMsgIter *iter;
-	unsigned foundnum;
-	int maxnum;
-	gboolean threads, reverse;
-	MuMsgFieldId sortfield;
-	const char *querystr;
+	ResultSet *set;
+	guint32 fields;
+
+	fields = MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_PATH) |
+		MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_FLAGS);
+
+	set	    = g_new0 (ResultSet, 1);
+	set->qflags = qflags;
+	set->rows   = g_array_new (FALSE, FALSE, sizeof(ResultRow));
+	set->paths  = g_array_new (FALSE, FALSE, sizeof(guint32));
+
+	/* only the docids, the thread info and what we need to see
+	 * whether a message changed (these are all values in the
+	 * database); we get the rest when fetching */
+	for (; !mu_msg_iter_is_done (iter) && set->rows->len < maxnum;
+	     mu_msg_iter_next (iter)) {
+
+		ResultRow row;
+		MuMsgIterRow irow;
+		const MuMsgIterThreadInfo *ti;
+
+		memset (&row, 0, sizeof(row));
+		row.docid	   = mu_msg_iter_get_docid (iter);
+		row.collapse_count = mu_msg_iter_get_collapse_count (iter);
+		row.path	   = RESULT_NO_PATH;
+
+		/* if this fails, the row looks changed when refreshing,
+		 * which is harmless */
+		if (mu_msg_iter_get_row (iter, fields, &irow)) {
+			const char *path;
+			path	     = irow.str[MU_MSG_FIELD_ID_PATH];
+			row.flags    = (MuFlags)irow.num[MU_MSG_FIELD_ID_FLAGS];
+			row.pathhash = path ? g_str_hash (path) : 0;
+		}
+
+		ti = qflags & MU_QUERY_FLAG_THREADS ?
+			mu_msg_iter_get_thread_info (iter) : NULL;
+		if (ti && ti->path) {
+			row.path  = set->paths->len;
+			row.level = ti->level;
+			row.order = ti->order;
+			row.width = ti->width;
+			row.prop  = ti->prop;
+			g_array_append_vals (set->paths, ti->path,
+					     ti->level + 1);
+		}
+
+		g_array_append_val (set->rows, row);
+	}
+
+	return set;
+}
+
+
+static void
+result_set_destroy (ResultSet *set)
+{
+	g_array_free (set->rows, TRUE);
+	g_array_free (set->paths, TRUE);
+	g_free (set);
+}
+
+
+static gsize
+result_set_size (ResultSet *set)
+{
+	return sizeof(ResultSet) +
+		set->rows->len * sizeof(ResultRow) +
+		set->paths->len * sizeof(guint32);
+}
+
+
+static ResultCache*
+result_cache_new (void)
+{
+	ResultCache *cache;
+
+	cache	    = g_new0 (ResultCache, 1);
+	cache->lock = g_mutex_new ();
+	cache->sets = g_hash_table_new_full
+		(g_direct_hash, g_direct_equal, NULL,
+		 (GDestroyNotify)result_set_destroy);
+	cache->lru  = g_queue_new ();
+
+	return cache;
+}
+
+
+static void
+result_cache_destroy (ResultCache *cache)
+{
+	if (!cache)
+		return;
+
+	g_queue_free (cache->lru);
+	g_hash_table_destroy (cache->sets);
+	g_mutex_free (cache->lock);
+
+	g_free (cache);
+}
+
+
+/* with cache->lock held */
+static void
+result_cache_remove_unlocked (ResultCache *cache, ResultSet *set)
+{
+	cache->size -= result_set_size (set);
+	g_queue_delete_link (cache->lru, set->link);
+	g_hash_table_remove (cache->sets, GUINT_TO_POINTER(set->handle));
+}
+
+
+/* add set to the cache, dropping the least recently used sets if
+ * needed (but never set itself); returns the set's handle */
+static unsigned
+result_cache_add (ResultCache *cache, ResultSet *set)
+{
+	unsigned handle;
+
+	g_mutex_lock (cache->lock);
+
+	handle	    = set->handle = ++cache->last_handle;
+	g_queue_push_head (cache->lru, set);
+	set->link   = g_queue_peek_head_link (cache->lru);
+	cache->size += result_set_size (set);
+	g_hash_table_insert (cache->sets, GUINT_TO_POINTER(handle), set);
+
+	while ((cache->size > RESULTS_MAX_SIZE ||
+		g_queue_get_length (cache->lru) > RESULTS_MAX_SETS) &&
+	       g_queue_peek_tail (cache->lru) != set)
+		result_cache_remove_unlocked
+			(cache, (ResultSet*)g_queue_peek_tail (cache->lru));
+
+	g_mutex_unlock (cache->lock);
+
+	return handle;
+}
+
+
+/* get the set for handle, and make it the most recently used one;
+ * with cache->lock held */
+static ResultSet*
+result_cache_get_unlocked (ResultCache *cache, unsigned handle)
+{
+	ResultSet *set;
+
+	set = (ResultSet*)g_hash_table_lookup (cache->sets,
+					       GUINT_TO_POINTER(handle));
+	if (set) {
+		g_queue_unlink (cache->lru, set->link);
+		g_queue_push_head_link (cache->lru, set->link);
+	}
+
+	return set;
+}
+/************************************************************************/
+
+
+/* print row u of set as a message sexp or, with change ("insert" or
+ * "update"), as (:<change> <sexp> :position <u>) */
+static void
+print_row (ServerContext *ctx, ResultSet *set, unsigned u, const char *change)
+{
+	MuMsg *msg;
+	MuMsgIterThreadInfo ti;
+	const ResultRow *row;
+	GString *gstr;
+
+	row = &g_array_index (set->rows, ResultRow, u);
+
+	/* the message may be gone since the find; tell the frontend,
+	 * so it knows which row that was */
+	if (!(msg = mu_store_get_msg (ctx->store, row->docid, NULL))) {
+		print_expr ("(:remove %u)", row->docid);
+		return;
+	}
+
+	if (row->path != RESULT_NO_PATH) {
+		ti.path	 = &g_array_index (set->paths, guint32, row->path);
+		ti.level = row->level;
+		ti.order = row->order;
+		ti.width = row->width;
+		ti.prop	 = row->prop;
+	}
+
+	gstr = output_begin ();
+	if (change)
+		g_string_append_printf (gstr, "(:%s ", change);
+	append_sexp (gstr, msg, row->docid,
+		     row->path != RESULT_NO_PATH ? &ti : NULL,
+		     row->collapse_count, set->qflags);
+	if (change)
+		g_string_append_printf (gstr, " :position %u)\n", u);
+	output_end ();
+
+	mu_msg_unref (msg);
+}
+
+
+static gboolean
+result_row_equal (ResultSet *set1, const ResultRow *row1,
+		  ResultSet *set2, const ResultRow *row2)
+{
+	if (row1->docid		 != row2->docid	   ||
+	    row1->collapse_count != row2->collapse_count ||
+	    row1->flags		 != row2->flags	   ||
+	    row1->pathhash	 != row2->pathhash)
+		return FALSE;
+
+	if (row1->path == RESULT_NO_PATH || row2->path == RESULT_NO_PATH)
+		return row1->path == row2->path;
+
+	return	row1->level == row2->level &&
+		row1->order == row2->order &&
+		row1->width == row2->width &&
+		row1->prop  == row2->prop  &&
+		memcmp (&g_array_index (set1->paths, guint32, row1->path),
+			&g_array_index (set2->paths, guint32, row2->path),
+			(row1->level + 1) * sizeof(guint32)) == 0;
+}
+
+
+/* for each row in newset, its position in oldset, or -1 */
+static gint*
+get_old_positions (ResultSet *oldset, ResultSet *newset)
+{
+	GHashTable *hash;
+	gint *pos;
+	unsigned u;
+
+	hash = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (u = 0; u != oldset->rows->len; ++u)
+		g_hash_table_insert
+			(hash, GUINT_TO_POINTER(g_array_index
+				(oldset->rows, ResultRow, u).docid),
+			 GUINT_TO_POINTER(u + 1));
+
+	pos = g_new (gint, newset->rows->len + 1);
+	for (u = 0; u != newset->rows->len; ++u)
+		pos[u] = (gint)GPOINTER_TO_UINT
+			(g_hash_table_lookup
+			 (hash, GUINT_TO_POINTER(g_array_index
+				(newset->rows, ResultRow, u).docid))) - 1;
+
+	g_hash_table_destroy (hash);
+
+	return pos;
+}
+
+
+/* of the rows that were already there, keep the longest run that
+ * stayed in the same order (the longest increasing subsequence of
+ * their old positions), and set the positions of the others to -1, so
+ * they get removed and inserted again */
+static void
+keep_longest_run (gint *pos, unsigned len)
+{
+	unsigned *tails, *prev, n, u;
+	gboolean *keep;
+
+	tails = g_new (unsigned, len + 1); /* last row of the best run
+					    * of each length */
+	prev  = g_new (unsigned, len + 1); /* the row before it */
+
+	for (n = u = 0; u != len; ++u) {
+
+		unsigned lo, hi, mid;
+
+		if (pos[u] < 0)
+			continue;
+
+		for (lo = 0, hi = n; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (pos[tails[mid]] < pos[u])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		prev[u]	  = lo > 0 ? tails[lo - 1] : G_MAXUINT;
+		tails[lo] = u;
+		if (lo == n)
+			++n;
+	}
+
+	keep = g_new0 (gboolean, len + 1);
+	for (u = n > 0 ? tails[n - 1] : G_MAXUINT; u != G_MAXUINT;
+	     u = prev[u])
+		keep[u] = TRUE;
+
+	for (u = 0; u != len; ++u)
+		if (!keep[u])
+			pos[u] = -1;
+
+	g_free (keep);
+	g_free (prev);
+	g_free (tails);
+}
+
+
+/* print what it takes to turn the rows of oldset into those of
+ * newset: (:remove <docid>) for each row that is gone (or moved),
+ * and (:insert ...) and (:update ...) for each new or changed one, in
+ * order */
+static void
+print_result_diff (ServerContext *ctx, ResultSet *oldset, ResultSet *newset,
+		   unsigned *inserted, unsigned *updated, unsigned *removed)
+{
+	gint *pos;
+	gboolean *kept;
+	unsigned u;
+
+	pos = get_old_positions (oldset, newset);
+	keep_longest_run (pos, newset->rows->len);
+
+	kept = g_new0 (gboolean, oldset->rows->len + 1);
+	for (u = 0; u != newset->rows->len; ++u)
+		if (pos[u] >= 0)
+			kept[pos[u]] = TRUE;
+
+	*inserted = *updated = *removed = 0;
+
+	for (u = 0; u != oldset->rows->len; ++u)
+		if (!kept[u]) {
+			print_expr ("(:remove %u)", g_array_index
+				    (oldset->rows, ResultRow, u).docid);
+			++*removed;
+		}
+
+	for (u = 0; u != newset->rows->len; ++u) {
+		if (pos[u] < 0) {
+			print_row (ctx, newset, u, "insert");
+			++*inserted;
+		} else if (!result_row_equal
+			   (oldset, &g_array_index (oldset->rows, ResultRow,
+						    pos[u]),
+			    newset, &g_array_index (newset->rows, ResultRow,
+						    u))) {
+			print_row (ctx, newset, u, "update");
+			++*updated;
+		}
+	}
+
+	g_free (kept);
+	g_free (pos);
+}
+
+
+/* send the changes from the results for oldhandle to set, and keep
+ * set in their place */
+static MuError
+refresh_results (ServerContext *ctx, ResultSet *set, const char *oldhandle,
+		 GError **err)
+{
+	ResultSet *oldset;
+	unsigned inserted, updated, removed, num;
+
+	g_mutex_lock (ctx->results->lock);
+
+	oldset = result_cache_get_unlocked
+		(ctx->results, strtoul (oldhandle, NULL, 10));
+	if (!oldset) {
+		g_mutex_unlock (ctx->results->lock);
+		result_set_destroy (set);
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "no results for handle %s", oldhandle);
+		return MU_G_ERROR_CODE (err);
+	}
+
+	print_result_diff (ctx, oldset, set, &inserted, &updated, &removed);
+	result_cache_remove_unlocked (ctx->results, oldset);
+
+	g_mutex_unlock (ctx->results->lock);
+
+	num = set->rows->len;
+	print_expr ("(:found %u :handle %u :refresh-of %s "
+		    ":inserted %u :updated %u :removed %u)",
+		    num, result_cache_add (ctx->results, set), oldhandle,
+		    inserted, updated, removed);
+
+	return MU_OK;
+}
+
+
+/*
+ * 'find' finds a list of messages matching some query, and takes a
+ * parameter 'query' with the search query, and (optionally) a
+ * parameter 'maxnum' with the maximum number of messages to return.
+ *
+ * returns:
+ * => list of s-expressions, each describing a message =>
+ * (:found <number of found messages>)
+ *
+ * or, with handle:true, only
+ * (:found <number of found messages> :handle <handle>)
+ * for use with 'fetch'
+ *
+ * or, with refresh-of:<handle>, the differences with the results for
+ * that handle (see print_result_diff), and
+ * (:found <number of found messages> :handle <handle> :refresh-of ...)
+ */
+static MuError
+cmd_find (ServerContext *ctx, ServerArgs *args, GError **err)
+{
+	MuMsgIter *iter;
+	unsigned foundnum;
+	int maxnum;
+	gboolean threads;
+	MuMsgFieldId sortfield;
+	MuQueryFlags qflags;
+	const char *querystr, *refresh;
 
 	GET_STRING_OR_ERROR_RETURN (args, "query", &querystr, err);
-	if (get_find_params (args, &threads, &sortfield,
-			     &reverse, &maxnum, err) != MU_OK) {
+	if (get_find_params (args, &sortfield, &maxnum, &qflags, err)
+	    != MU_OK) {
 		print_and_clear_g_error (err);
 		return MU_OK;
 	}
@@ -869,20 +1843,36 @@ cmd_find (ServerContext *ctx, GSList *args, GError **err)
 	/* note: when we're threading, we get *all* messages, and then
 	 * only return maxnum; this is so that we maximimize the
 	 * change of all messages in a thread showing up */
-	iter = mu_query_run (ctx->query, querystr, threads,
-			     sortfield, reverse,
-			     threads ? -1 : maxnum, err);
+	threads = qflags & MU_QUERY_FLAG_THREADS ? TRUE : FALSE;
+	iter = mu_query_run (ctx->query, querystr, sortfield,
+			     threads ? -1 : maxnum, qflags, err);
 	if (!iter) {
 		print_and_clear_g_error (err);
 		return MU_OK;
 	}
 
+	/* keep the results, for 'fetch' */
+	refresh = get_string_from_args (args, "refresh-of", TRUE, NULL);
+	if (refresh || get_bool_from_args (args, "handle", TRUE, NULL)) {
+		ResultSet *set;
+		unsigned num;
+		set = result_set_new (iter, qflags,
+				      maxnum > 0 ? maxnum : G_MAXINT32);
+		mu_msg_iter_destroy (iter);
+		if (refresh)
+			return refresh_results (ctx, set, refresh, err);
+		num = set->rows->len;
+		print_expr ("(:found %u :handle %u)", num,
+			    result_cache_add (ctx->results, set));
+		return MU_OK;
+	}
+
 	/* before sending new results, send an 'erase' message, so the
 	 * frontend knows it should erase the headers buffer. this
 	 * will ensure that the output of two finds will not be
 	 * mixed. */
 	print_expr ("(:erase t)");
-	foundnum = print_sexps (iter, threads, maxnum > 0 ? maxnum : G_MAXINT32);
+	foundnum = print_sexps (iter, qflags, maxnum > 0 ? maxnum : G_MAXINT32);
 	print_expr ("(:found %u)", foundnum);
 	mu_msg_iter_destroy (iter);
 
@@ -890,6 +1880,76 @@ cmd_find (ServerContext *ctx, GSList *args, GError **err)
 }
 
 
+/*
+ * 'fetch' sends the rows from:<from> up to (not including) to:<to>
+ * of the results of a 'find' with handle:<handle>, as 'find' would
+ * have sent them; messages that have gone since are sent as
+ * (:remove <docid>).
+ *
+ * returns:
+ * => list of s-expressions, each describing a message =>
+ * (:fetched <handle> :from <from> :to <to> :found <number of results>)
+ */
+static MuError
+cmd_fetch (ServerContext *ctx, ServerArgs *args, GError **err)
+{
+	const char *handlestr, *str;
+	unsigned handle, from, to, u;
+	ResultSet *set;
+
+	GET_STRING_OR_ERROR_RETURN (args, "handle", &handlestr, err);
+	handle = strtoul (handlestr, NULL, 10);
+	str    = get_string_from_args (args, "from", TRUE, NULL);
+	from   = str ? strtoul (str, NULL, 10) : 0;
+	str    = get_string_from_args (args, "to", TRUE, NULL);
+	to     = str ? strtoul (str, NULL, 10) : G_MAXUINT32;
+
+	g_mutex_lock (ctx->results->lock);
+
+	set = result_cache_get_unlocked (ctx->results, handle);
+	if (!set) {
+		g_mutex_unlock (ctx->results->lock);
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "no results for handle %s", handlestr);
+		return MU_G_ERROR_CODE (err);
+	}
+
+	to = MAX (from, MIN (to, set->rows->len));
+	for (u = from; u < to && !is_cancelled (); ++u)
+		print_row (ctx, set, u, NULL);
+
+	print_expr ("(:fetched %u :from %u :to %u :found %u)",
+		    handle, from, to, set->rows->len);
+
+	g_mutex_unlock (ctx->results->lock);
+
+	return MU_OK;
+}
+
+
+/* 'release' drops the results for handle:<handle>, when the
+ * frontend doesn't need them anymore */
+static MuError
+cmd_release (ServerContext *ctx, ServerArgs *args, GError **err)
+{
+	const char *handlestr;
+	ResultSet *set;
+
+	GET_STRING_OR_ERROR_RETURN (args, "handle", &handlestr, err);
+
+	g_mutex_lock (ctx->results->lock);
+	set = result_cache_get_unlocked
+		(ctx->results, strtoul (handlestr, NULL, 10));
+	if (set)
+		result_cache_remove_unlocked (ctx->results, set);
+	g_mutex_unlock (ctx->results->lock);
+
+	print_expr ("(:info release :handle %s)", handlestr);
+
+	return MU_OK;
+}
+
+
 /* static gpointer */
 /* start_guile (GuileData *data) */
 /* { */
@@ -902,7 +1962,7 @@ cmd_find (ServerContext *ctx, GSList *args, GError **err)
 
 #ifdef BUILD_GUILE
 static MuError
-cmd_guile (ServerContext *ctx, GSList *args, GError **err)
+cmd_guile (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	const char *script, *file;
 
@@ -919,7 +1979,7 @@ cmd_guile (ServerContext *ctx, GSList *args, GError **err)
 }
 #else /*!BUILD_GUILE*/
 static MuError
-cmd_guile (ServerContext *ctx, GSList *args, GError **err)
+cmd_guile (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	print_error (MU_ERROR_INTERNAL,
 		     "this mu does not have guile support");
@@ -931,17 +1991,32 @@ cmd_guile (ServerContext *ctx, GSList *args, GError **err)
 
 
 static MuError
-index_msg_cb (MuIndexStats *stats, void *user_data)
+index_msg_cb (MuIndexStats *stats, ServerContext *ctx)
 {
-	if (MU_TERMINATE)
+	if (is_cancelled ())
 		return MU_STOP;
 
+	yield_store (ctx->store_lock);
+
 	if (stats->_processed % 1000)
 		return MU_OK;
 
 	print_expr ("(:info index :status running "
 		    ":processed %u :updated %u)",
 		   stats->_processed, stats->_updated);
+	flush_output (); /* don't keep the frontend waiting */
+
+	return MU_OK;
+}
+
+
+static MuError
+index_cleanup_cb (MuIndexStats *stats, ServerContext *ctx)
+{
+	if (is_cancelled ())
+		return MU_STOP;
+
+	yield_store (ctx->store_lock);
 
 	return MU_OK;
 }
@@ -966,7 +2041,7 @@ set_my_addresses (MuStore *store, const char *addrstr)
  * index ... ) messages while doing so (see the code)
  */
 static MuError
-cmd_index (ServerContext *ctx, GSList *args, GError **err)
+cmd_index (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	MuIndex *index;
 	const char *path;
@@ -986,22 +2061,28 @@ cmd_index (ServerContext *ctx, GSList *args, GError **err)
 	}
 
 	mu_index_stats_clear (&stats);
-	rv = mu_index_run (index, path, FALSE, &stats, index_msg_cb, NULL, NULL);
+	mu_index_stats_clear (&stats2);
+	rv = mu_index_run (index, path, FALSE, &stats,
+			   (MuIndexMsgCallback)index_msg_cb, NULL, ctx);
 	if (rv != MU_OK && rv != MU_STOP) {
 		print_error (MU_ERROR_INTERNAL, "indexing failed");
 		goto leave;
 	}
 
-	mu_index_stats_clear (&stats2);
-	rv = mu_index_cleanup (index, &stats2, NULL, NULL, err);
+	if (!is_cancelled ())
+		rv = mu_index_cleanup
+			(index, &stats2,
+			 (MuIndexCleanupDeleteCallback)index_cleanup_cb,
+			 ctx, err);
 	if (rv != MU_OK && rv != MU_STOP) {
 		print_error (MU_ERROR_INTERNAL, "cleanup failed");
 		goto leave;
 	}
 
 	mu_store_flush (ctx->store);
-	print_expr ("(:info index :status complete "
+	print_expr ("(:info index :status %s "
 		   ":processed %u :updated %u :cleaned-up %u)",
+		    is_cancelled () ? "cancelled" : "complete",
 		    stats._processed, stats._updated, stats2._cleaned_up);
 
 leave:
@@ -1014,7 +2095,7 @@ leave:
 /* 'mkdir' attempts to create a maildir directory at 'path:'; sends an
  * (:info mkdir ...) message when it succeeds */
 static MuError
-cmd_mkdir (ServerContext *ctx, GSList *args, GError **err)
+cmd_mkdir (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	const char *path;
 
@@ -1073,8 +2154,10 @@ do_move (MuStore *store, unsigned docid, MuMsg *msg, const char *maildir,
 
 	/* note, after mu_msg_move_to_maildir, path will be the *new*
 	 * path, and flags and maildir fields will be updated as
-	 * wel */
-	rv = mu_store_update_msg (store, docid, msg, err);
+	 * wel; nothing else changed, so we only update those */
+	rv = mu_store_move_msg (store, docid, mu_msg_get_path (msg),
+				mu_msg_get_maildir (msg),
+				mu_msg_get_flags (msg), err);
 	if (rv == MU_STORE_INVALID_DOCID) {
 		mu_util_g_set_error (err, MU_ERROR_XAPIAN,
 				"failed to store updated message");
@@ -1098,7 +2181,7 @@ do_move (MuStore *store, unsigned docid, MuMsg *msg, const char *maildir,
  * would a message in inbox and sentbox with the same id. we set the
  * flag on both */
 static gboolean
-move_msgid_maybe (ServerContext *ctx, GSList *args, GError **err)
+move_msgid_maybe (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	GSList *docids, *cur;
 	const char *maildir = get_string_from_args (args, "maildir", TRUE, err);
@@ -1155,7 +2238,7 @@ move_msgid_maybe (ServerContext *ctx, GSList *args, GError **err)
  *
  */
 static MuError
-cmd_move (ServerContext *ctx, GSList *args, GError **err)
+cmd_move (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	unsigned docid;
 	MuMsg *msg;
@@ -1203,61 +2286,216 @@ leave:
 }
 
 
-
-/* 'ping' takes no parameters, and provides information about this mu
- * server using a (:pong ...) message (details: see code below)
- */
-static MuError
-cmd_ping (ServerContext *ctx, GSList *args, GError **err)
+/* get the docids for the comma-separated docids:<docids> or
+ * msgids:<msgids>; the latter with a single query */
+static GSList*
+get_move_many_docids (ServerContext *ctx, ServerArgs *args, GError **err)
 {
-	unsigned doccount;
-	doccount = mu_store_count (ctx->store, err);
-
-	if (doccount == (unsigned)-1)
-		return print_and_clear_g_error (err);
+	const char *str;
+	gchar **ids, **cur;
+	GSList *docids;
+
+	docids = NULL;
+
+	if ((str = get_string_from_args (args, "docids", TRUE, NULL))) {
+		ids = g_strsplit (str, ",", -1);
+		for (cur = ids; *cur; ++cur) {
+			unsigned docid;
+			if ((docid = strtoul (*cur, NULL, 10)) !=
+			    MU_STORE_INVALID_DOCID)
+				docids = g_slist_prepend
+					(docids, GSIZE_TO_POINTER(docid));
+		}
+		g_strfreev (ids);
+		return g_slist_reverse (docids);
+	}
 
-	print_expr ("(:pong \"" PACKAGE_NAME "\" "
-		    ":version \"" VERSION "\" "
-		    ":doccount %u)", doccount);
+	if ((str = get_string_from_args (args, "msgids", TRUE, NULL))) {
+		gchar *querystr;
+		ids	 = g_strsplit (str, ",", -1);
+		querystr = g_strjoinv (" OR msgid:", ids);
+		g_strfreev (ids);
+		docids = get_docids_from_msgids (ctx->query, querystr, err);
+		g_free (querystr);
+		return g_slist_reverse (docids);
+	}
 
-	return MU_OK;
+	mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+			     "neither docids nor msgids specified");
+	return NULL;
 }
 
 
-/* 'quit' takes no parameters, terminates this mu server */
-static MuError
-cmd_quit (ServerContext *ctx, GSList *args , GError **err)
+/* move one message for 'move-many'; like do_move, but without the
+ * (:update ...) */
+static gboolean
+move_one (MuStore *store, unsigned docid, const char *maildir,
+	  const char *flagstr, GError **err)
 {
-	print_expr (";; quiting");
+	MuMsg *msg;
+	MuFlags flags;
+	gboolean rv;
 
-	return MU_STOP;
+	if (!(msg = mu_store_get_msg (store, docid, err)))
+		return FALSE;
+
+	rv    = FALSE;
+	flags = flagstr ? get_flags (mu_msg_get_path (msg), flagstr) :
+		mu_msg_get_flags (msg);
+
+	if (flags == MU_FLAG_INVALID)
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "invalid flags");
+	else if (mu_msg_move_to_maildir
+		 (msg, maildir ? maildir : mu_msg_get_maildir (msg), flags,
+		  TRUE, err))
+		rv = mu_store_move_msg (store, docid, mu_msg_get_path (msg),
+					mu_msg_get_maildir (msg),
+					mu_msg_get_flags (msg), err) !=
+			MU_STORE_INVALID_DOCID;
+
+	mu_msg_unref (msg);
+
+	return rv;
 }
 
 
 /*
- * creating a message object just to get a path seems a bit excessive
- * maybe mu_store_get_path could be added if this turns out to be a problem
+ * 'move-many' is 'move' for many messages at once; it takes either
+ * 'docids:' or 'msgids:' with a comma-separated list of them, and
+ * 'maildir:' and/or 'flags:', as for 'move'. the database changes
+ * are committed together at the end.
  *
- * NOTE: not re-entrant.
+ * returns an
+ * (:info move-many :found <number of messages> :moved <number moved>
+ *  :failed (<docid> ...))
+ * (and no (:update ...) for each message)
  */
-static const char*
-get_path_from_docid (MuStore *store, unsigned docid, GError **err)
+static MuError
+cmd_move_many (ServerContext *ctx, ServerArgs *args, GError **err)
 {
-	MuMsg *msg;
-	const char* msgpath;
-	static char path[PATH_MAX + 1];
+	GSList *docids, *cur;
+	GString *failed;
+	const char *maildir, *flagstr;
+	unsigned found, moved;
+	guint batchsize;
 
-	msg = mu_store_get_msg (store, docid, err);
-	if (!msg)
-		return NULL;
+	maildir	= get_string_from_args (args, "maildir", TRUE, NULL);
+	flagstr = get_string_from_args (args, "flags", TRUE, NULL);
 
-	msgpath = mu_msg_get_path (msg);
-	if (!msgpath) {
-		mu_msg_unref (msg);
-		return NULL;
+	if (!maildir && !flagstr) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "neither maildir nor flags specified");
+		return MU_G_ERROR_CODE (err);
 	}
 
-	strncpy (path, msgpath, sizeof(path));
+	/*  as with 'move', you cannot use 'maildir' for (all the
+	 *  messages with) some message-ids */
+	if (maildir && get_string_from_args (args, "msgids", TRUE, NULL)) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "cannot use maildir with msgids");
+		return MU_G_ERROR_CODE (err);
+	}
+
+	docids = get_move_many_docids (ctx, args, err);
+	if (!docids && err && *err)
+		return MU_G_ERROR_CODE (err);
+
+	/* one transaction for the lot, rather than one for each
+	 * batch */
+	batchsize = mu_store_get_batch_size (ctx->store);
+	mu_store_set_batch_size (ctx->store, G_MAXUINT);
+
+	failed = g_string_sized_new (64);
+	for (found = moved = 0, cur = docids; cur; cur = g_slist_next (cur)) {
+
+		unsigned docid;
+		GError *myerr;
+
+		docid = GPOINTER_TO_SIZE (cur->data);
+		myerr = NULL;
+		++found;
+
+		if (move_one (ctx->store, docid, maildir, flagstr, &myerr))
+			++moved;
+		else {
+			g_warning ("failed to move %u: %s", docid,
+				   myerr ? myerr->message : "error");
+			g_string_append_printf (failed, "%s%u",
+						failed->len ? " " : "", docid);
+			g_clear_error (&myerr);
+		}
+	}
+
+	mu_store_flush (ctx->store);
+	mu_store_set_batch_size (ctx->store, batchsize);
+
+	print_expr ("(:info move-many :found %u :moved %u :failed (%s))",
+		    found, moved, failed->str);
+
+	g_string_free (failed, TRUE);
+	g_slist_free (docids);
+
+	return MU_OK;
+}
+
+
+
+/* 'ping' takes no parameters, and provides information about this mu
+ * server using a (:pong ...) message (details: see code below)
+ */
+static MuError
+cmd_ping (ServerContext *ctx, ServerArgs *args, GError **err)
+{
+	unsigned doccount;
+	doccount = mu_store_count (ctx->store, err);
+
+	if (doccount == (unsigned)-1)
+		return print_and_clear_g_error (err);
+
+	print_expr ("(:pong \"" PACKAGE_NAME "\" "
+		    ":version \"" VERSION "\" "
+		    ":doccount %u%s)", doccount,
+		    ctx->daemon ? " :daemon t" : "");
+
+	return MU_OK;
+}
+
+
+/* 'quit' takes no parameters, terminates this mu server */
+static MuError
+cmd_quit (ServerContext *ctx, ServerArgs *args , GError **err)
+{
+	print_expr (";; quiting");
+
+	return MU_STOP;
+}
+
+
+/*
+ * creating a message object just to get a path seems a bit excessive
+ * maybe mu_store_get_path could be added if this turns out to be a problem
+ *
+ * NOTE: not re-entrant.
+ */
+static const char*
+get_path_from_docid (MuStore *store, unsigned docid, GError **err)
+{
+	MuMsg *msg;
+	const char* msgpath;
+	static char path[PATH_MAX + 1];
+
+	msg = mu_store_get_msg (store, docid, err);
+	if (!msg)
+		return NULL;
+
+	msgpath = mu_msg_get_path (msg);
+	if (!msgpath) {
+		mu_msg_unref (msg);
+		return NULL;
+	}
+
+	strncpy (path, msgpath, sizeof(path));
 
 	mu_msg_unref (msg);
 	return path;
@@ -1265,15 +2503,41 @@ get_path_from_docid (MuStore *store, unsigned docid, GError **err)
 
 
 
+/* remove the message at path from the database (only); for mu
+ * remove, in another process */
+static MuError
+remove_path (ServerContext *ctx, const char *path)
+{
+	gchar *escpath;
+
+	if (!mu_store_remove_path (ctx->store, path)) {
+		print_error (MU_ERROR_XAPIAN_REMOVE_FAILED,
+			     "failed to remove from database");
+		return MU_OK;
+	}
+
+	escpath = mu_str_escape_c_literal (path, TRUE);
+	print_expr ("(:info remove :path %s)", escpath);
+	g_free (escpath);
+
+	return MU_OK;
+}
+
+
 /* 'remove' removes the message with either docid: or msgid:, sends a
- * (:remove ...) message when it succeeds
+ * (:remove ...) message when it succeeds; with path: instead, it
+ * only removes the message from the database, and sends an (:info
+ * remove ...) message
  */
 static MuError
-cmd_remove (ServerContext *ctx, GSList *args, GError **err)
+cmd_remove (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	unsigned docid;
 	const char *path;
 
+	if ((path = get_string_from_args (args, "path", TRUE, NULL)))
+		return remove_path (ctx, path);
+
 	docid = determine_docid (ctx->query, args, err);
 	if (docid == MU_STORE_INVALID_DOCID) {
 		print_and_clear_g_error (err);
@@ -1310,7 +2574,7 @@ cmd_remove (ServerContext *ctx, GSList *args, GError **err)
  * message (details: see code below)
  */
 static MuError
-cmd_sent (ServerContext *ctx, GSList *args, GError **err)
+cmd_sent (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	unsigned docid;
 	const char *maildir, *path;
@@ -1338,7 +2602,7 @@ cmd_sent (ServerContext *ctx, GSList *args, GError **err)
  * identified by either docid: or msgid:; return a (:view <sexp>)
  */
 static MuError
-cmd_view (ServerContext *ctx, GSList *args, GError **err)
+cmd_view (ServerContext *ctx, ServerArgs *args, GError **err)
 {
 	MuMsg *msg;
 	unsigned docid;
@@ -1376,42 +2640,290 @@ cmd_view (ServerContext *ctx, GSList *args, GError **err)
 
 
 
+/* jobs ****************************************************************/
+/*
+ * 'find' and 'index' requests run in a thread of their own, so we
+ * can handle other commands in the meantime. A find gets a read-only
+ * snapshot of the database; an index shares the writable store with
+ * the other commands, taking turns using it.
+ */
+
+struct _ServerJob {
+	ServerRequest	 req;
+	ServerContext	 ctx;	/* the job's own */
+	CmdFunc		 func;
+	ServerArgs	 args;	/* copies of the command's */
+	ServerOutput	*output; /* the one of the client */
+	GThread		*thread;
+	gint		 done;	/* atomic */
+};
+typedef struct _ServerJob ServerJob;
+
+
+static void
+job_destroy (ServerJob *job)
+{
+	if (job->thread)
+		g_thread_join (job->thread);
+
+	if (!job->ctx.store_lock) { /* a snapshot */
+		mu_query_destroy (job->ctx.query);
+		mu_store_unref (job->ctx.store);
+	}
+
+	if (job->args.params)
+		g_hash_table_destroy (job->args.params);
+	g_free ((char*)job->args.cmd);
+
+	g_free (job);
+}
+
+
+static gpointer
+job_run (ServerJob *job)
+{
+	GError *err;
+
+	g_static_private_set (&CURRENT_REQUEST, &job->req, NULL);
+	g_static_private_set (&CURRENT_OUTPUT, job->output, NULL);
+
+	err = NULL;
+	if (job->ctx.store_lock)
+		lock_store (job->ctx.store_lock);
+	if (job->func (&job->ctx, &job->args, &err) != MU_OK)
+		print_and_clear_g_error (&err);
+	if (job->ctx.store_lock)
+		unlock_store (job->ctx.store_lock);
+
+	flush_output ();
+	g_atomic_int_set (&job->done, TRUE);
+
+	return NULL;
+}
+
+
+static gboolean
+job_init_context (ServerJob *job, ServerContext *ctx, gboolean snapshot,
+		  GError **err)
+{
+	if (!snapshot) {
+		job->ctx      = *ctx;
+		job->ctx.jobs = NULL;
+		return TRUE;
+	}
+
+	/* the snapshot has what was committed so far; we don't
+	 * flush, as that would commit (say) a running index job's
+	 * batch before it's complete */
+	job->ctx.store = mu_store_new_read_only
+		(mu_runtime_path (MU_RUNTIME_PATH_XAPIANDB), err);
+	if (!job->ctx.store)
+		return FALSE;
+
+	job->ctx.query = mu_query_new (job->ctx.store, err);
+	if (!job->ctx.query) {
+		mu_store_unref (job->ctx.store);
+		return FALSE;
+	}
+
+	job->ctx.store_lock = NULL;
+	job->ctx.jobs	    = NULL;
+	job->ctx.results    = ctx->results;
+
+	return TRUE;
+}
+
+
+static MuError
+start_job (ServerContext *ctx, CmdFunc func, gboolean snapshot,
+	   ServerArgs *args, unsigned id, GError **err)
+{
+	ServerJob *job;
+	GHashTableIter iter;
+	gpointer key, val;
+
+	if (g_hash_table_lookup (ctx->jobs, GUINT_TO_POINTER(id))) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "request %u is still running", id);
+		return MU_G_ERROR_CODE (err);
+	}
+
+	job	    = g_new0 (ServerJob, 1);
+	job->req.id = id;
+	job->func   = func;
+	job->output = current_output ();
+	if (!job_init_context (job, ctx, snapshot, err)) {
+		g_free (job);
+		return MU_G_ERROR_CODE (err);
+	}
+
+	/* the args point into the input buffer, which we'll reuse */
+	job->args.cmd	 = g_strdup (args->cmd);
+	job->args.params = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, g_free);
+	g_hash_table_iter_init (&iter, args->params);
+	while (g_hash_table_iter_next (&iter, &key, &val))
+		g_hash_table_insert (job->args.params, g_strdup (key),
+				     g_strdup (val));
+
+	job->thread = g_thread_create ((GThreadFunc)job_run, job, TRUE, err);
+	if (!job->thread) {
+		job_destroy (job);
+		return MU_G_ERROR_CODE (err);
+	}
+
+	g_hash_table_insert (ctx->jobs, GUINT_TO_POINTER(id), job);
+	return MU_OK;
+}
+
+
+static gboolean
+reap_job (gpointer id, ServerJob *job, gboolean *all)
+{
+	if (!*all && !g_atomic_int_get (&job->done))
+		return FALSE;
+
+	job_destroy (job);
+	return TRUE;
+}
+
+
+/* clean up the jobs that are done; or, if all is TRUE, wait for the
+ * others to finish as well */
+static void
+reap_jobs (ServerContext *ctx, gboolean all)
+{
+	g_hash_table_foreach_remove (ctx->jobs, (GHRFunc)reap_job, &all);
+}
+
+
+static void
+cancel_job (gpointer id, ServerJob *job, gpointer user_data)
+{
+	g_atomic_int_set (&job->req.cancelled, TRUE);
+}
+
+
+static void
+cancel_jobs (ServerContext *ctx)
+{
+	g_hash_table_foreach (ctx->jobs, (GHFunc)cancel_job, NULL);
+}
+
+
+/* a command with an id, in this thread */
+static MuError
+run_request (ServerContext *ctx, CmdFunc func, ServerArgs *args,
+	     unsigned id, GError **err)
+{
+	ServerRequest req;
+	MuError rv;
+
+	req.id	      = id;
+	req.cancelled = FALSE;
+
+	g_static_private_set (&CURRENT_REQUEST, &req, NULL);
+
+	rv = func (ctx, args, err);
+	if (rv != MU_OK && rv != MU_STOP) {
+		print_and_clear_g_error (err); /* so it gets the id */
+		rv = MU_OK;
+	}
+
+	g_static_private_set (&CURRENT_REQUEST, NULL, NULL);
+
+	return rv;
+}
+
+
+/* 'cancel' cancels the running request with id:<id>; it finishes
+ * with the responses it has sent so far */
+static MuError
+cmd_cancel (ServerContext *ctx, ServerArgs *args, GError **err)
+{
+	const char *idstr;
+	ServerJob *job;
+
+	GET_STRING_OR_ERROR_RETURN (args, "id", &idstr, err);
+
+	job = (ServerJob*)g_hash_table_lookup
+		(ctx->jobs, GUINT_TO_POINTER(strtoul (idstr, NULL, 10)));
+	if (!job || g_atomic_int_get (&job->done)) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "no running request %s", idstr);
+		return MU_G_ERROR_CODE (err);
+	}
+
+	g_atomic_int_set (&job->req.cancelled, TRUE);
+	print_expr ("(:info cancel :request %u)", job->req.id);
+
+	return MU_OK;
+}
+
+
 /*************************************************************************/
 
+enum _CmdMode {
+	CMD_MODE_SYNC,		/* in the main thread */
+	CMD_MODE_JOB,		/* as a job, if it has an id */
+	CMD_MODE_JOB_SNAPSHOT	/* likewise, with a database snapshot */
+};
+typedef enum _CmdMode CmdMode;
+
 static MuError
-handle_args (ServerContext *ctx, GSList *args, GError **err)
+handle_args (ServerContext *ctx, ServerArgs *args, GError **err)
 {
-	unsigned u;
-	const char *cmd;
+	unsigned u, id;
+	const char *cmd, *idstr;
 	struct {
 		const char *cmd;
 		CmdFunc func;
+		CmdMode mode;
 	} cmd_map[] = {
-		{ "add",	cmd_add },
-		{ "compose",	cmd_compose },
-		{ "contacts",   cmd_contacts },
-		{ "extract",    cmd_extract },
-		{ "find",	cmd_find },
-		{ "guile",      cmd_guile },
-		{ "index",	cmd_index },
-		{ "mkdir",	cmd_mkdir },
-		{ "move",	cmd_move },
-		{ "ping",	cmd_ping },
-		{ "quit",	cmd_quit },
-		{ "remove",	cmd_remove },
-		{ "sent",	cmd_sent },
-		{ "view",	cmd_view }
+		{ "add",	cmd_add,	CMD_MODE_SYNC },
+		{ "cancel",	cmd_cancel,	CMD_MODE_SYNC },
+		{ "commit",	cmd_commit,	CMD_MODE_SYNC },
+		{ "complete",	cmd_complete,	CMD_MODE_SYNC },
+		{ "compose",	cmd_compose,	CMD_MODE_SYNC },
+		{ "contacts",   cmd_contacts,	CMD_MODE_SYNC },
+		{ "extract",    cmd_extract,	CMD_MODE_SYNC },
+		{ "fetch",	cmd_fetch,	CMD_MODE_SYNC },
+		{ "find",	cmd_find,	CMD_MODE_JOB_SNAPSHOT },
+		{ "guile",      cmd_guile,	CMD_MODE_SYNC },
+		{ "index",	cmd_index,	CMD_MODE_JOB },
+		{ "mkdir",	cmd_mkdir,	CMD_MODE_SYNC },
+		{ "move",	cmd_move,	CMD_MODE_SYNC },
+		{ "move-many",	cmd_move_many,	CMD_MODE_SYNC },
+		{ "ping",	cmd_ping,	CMD_MODE_SYNC },
+		{ "quit",	cmd_quit,	CMD_MODE_SYNC },
+		{ "release",	cmd_release,	CMD_MODE_SYNC },
+		{ "remove",	cmd_remove,	CMD_MODE_SYNC },
+		{ "sent",	cmd_sent,	CMD_MODE_SYNC },
+		{ "view",	cmd_view,	CMD_MODE_SYNC }
 	};
 
-	cmd = (const char*) args->data;
+	cmd = args->cmd;
 
 	/* ignore empty */
 	if (strlen (cmd) == 0)
 		return MU_OK;
 
-	for (u = 0; u != G_N_ELEMENTS (cmd_map); ++u)
-		if (g_strcmp0(cmd, cmd_map[u].cmd) == 0)
-			return cmd_map[u].func (ctx, g_slist_next(args), err);
+	/* for 'cancel', the id is the request to cancel */
+	idstr = get_string_from_args (args, "id", TRUE, NULL);
+	id    = idstr ? (unsigned)strtoul (idstr, NULL, 10) : 0;
+
+	for (u = 0; u != G_N_ELEMENTS (cmd_map); ++u) {
+		if (g_strcmp0(cmd, cmd_map[u].cmd) != 0)
+			continue;
+		if (!idstr || cmd_map[u].func == cmd_cancel)
+			return cmd_map[u].func (ctx, args, err);
+		if (cmd_map[u].mode == CMD_MODE_SYNC)
+			return run_request (ctx, cmd_map[u].func, args,
+					    id, err);
+		return start_job (ctx, cmd_map[u].func,
+				  cmd_map[u].mode == CMD_MODE_JOB_SNAPSHOT,
+				  args, id, err);
+	}
 
 	mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
 			     "unknown command '%s'", cmd ? cmd : "");
@@ -1420,52 +2932,699 @@ handle_args (ServerContext *ctx, GSList *args, GError **err)
 
 
 
+/* handle the commands from input, until it ends, the client quits,
+ * or we're terminated */
+static void
+serve (ServerContext *ctx, ServerInput *input)
+{
+	ServerArgs args;
+	gboolean do_quit;
+
+	args.params = g_hash_table_new (g_str_hash, g_str_equal);
+
+	/*  the main REPL */
+	do_quit = FALSE;
+	while (!MU_TERMINATE && !do_quit && !current_output()->broken) {
+
+		char *line;
+		MuError rv;
+		GError *my_err = NULL;
+
+		/* at the end of the input, we're done */
+		if (!(line = read_line (input)))
+			break;
+
+		/* args will receive the command and its
+		 * params; parse_line sets my_err if it fails */
+		lock_store (ctx->store_lock);
+		if (parse_line (line, &args, &my_err))
+			rv = handle_args (ctx, &args, &my_err);
+		else
+			rv = MU_ERROR_IN_PARAMETERS;
+		unlock_store (ctx->store_lock);
+
+		switch (rv) {
+		case MU_OK: break;
+		case MU_STOP:
+			do_quit = TRUE;
+			break;
+		default: /* some error occurred */
+			print_and_clear_g_error (&my_err);
+		}
+
+		flush_output (); /* we're done with this command */
+		reap_jobs (ctx, FALSE);
+	}
+
+	/* when the input ends, we let the running requests finish;
+	 * but not when we quit, are terminated or can't write to
+	 * the client anymore */
+	if (do_quit || MU_TERMINATE || current_output()->broken)
+		cancel_jobs (ctx);
+	reap_jobs (ctx, TRUE);
+	g_hash_table_destroy (args.params);
+}
+
+
+/* broker **************************************************************/
+/*
+ * whoever has the writable store -- mu daemon, server or index --
+ * listens on a unix socket in the mu home directory, and serves any
+ * number of clients there, with the commands of the mu server; so
+ * other mu processes use the store through it, rather than fighting
+ * over the write lock (see mu_cmd_daemon_connect). The clients share
+ * the store, the query and the contacts; each of them gets a thread,
+ * an output and jobs of its own.
+ */
+
+#define DAEMON_BACKLOG	  16
+#define DAEMON_POLL_MSECS 500	/* check for MU_TERMINATE this often */
+
+struct _ServerClient {
+	ServerContext	 ctx;
+	ServerOutput	 output;
+	int		 fd;
+	GThread		*thread;
+	gint		 done;	/* atomic */
+};
+typedef struct _ServerClient ServerClient;
+
+
+static gpointer
+client_run (ServerClient *client)
+{
+	ServerInput input;
+
+	g_static_private_set (&CURRENT_OUTPUT, &client->output, NULL);
+
+	server_input_init (&input, client->fd, FALSE);
+	serve (&client->ctx, &input);
+	server_input_uninit (&input);
+
+	g_atomic_int_set (&client->done, TRUE);
+
+	return NULL;
+}
+
+
+static void
+client_destroy (ServerClient *client)
+{
+	if (client->thread)
+		g_thread_join (client->thread);
+
+	g_hash_table_destroy (client->ctx.jobs);
+	result_cache_destroy (client->ctx.results);
+	server_output_uninit (&client->output);
+	close (client->fd);
+
+	g_free (client);
+}
+
+
+static ServerClient*
+client_start (ServerContext *ctx, int fd, GError **err)
+{
+	ServerClient *client;
+
+	client		 = g_new0 (ServerClient, 1);
+	client->ctx	 = *ctx;
+	client->ctx.jobs = g_hash_table_new (g_direct_hash, g_direct_equal);
+	client->ctx.results = result_cache_new ();
+	client->fd	 = fd;
+	server_output_init (&client->output, fd);
+
+	client->thread = g_thread_create ((GThreadFunc)client_run, client,
+					  TRUE, err);
+	if (!client->thread) {
+		client_destroy (client);
+		return NULL;
+	}
+
+	return client;
+}
+
+
+/* clean up the clients that are gone; or, if all is TRUE, end the
+ * input of the others, and wait for them to finish what they were
+ * asked already */
+static GSList*
+reap_clients (GSList *clients, gboolean all)
+{
+	GSList *cur, *next;
+
+	for (cur = clients; cur; cur = next) {
+		ServerClient *client;
+
+		next   = g_slist_next (cur);
+		client = (ServerClient*)cur->data;
+
+		/* it still reads what was sent before, and
+		 * then finishes like at the end of any input */
+		if (all)
+			shutdown (client->fd, SHUT_RD);
+		else if (!g_atomic_int_get (&client->done))
+			continue;
+
+		client_destroy (client);
+		clients = g_slist_delete_link (clients, cur);
+	}
+
+	return clients;
+}
+
+
+static gboolean
+daemon_address (struct sockaddr_un *addr, GError **err)
+{
+	const char *path;
+
+	path = mu_runtime_path (MU_RUNTIME_PATH_SOCKET);
+
+	memset (addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof(addr->sun_path)) {
+		mu_util_g_set_error (err, MU_ERROR_FILE_INVALID_NAME,
+				     "socket path is too long: %s", path);
+		return FALSE;
+	}
+	strcpy (addr->sun_path, path);
+
+	return TRUE;
+}
+
+
+int
+mu_cmd_daemon_connect (void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!daemon_address (&addr, NULL))
+		return -1;
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	if (connect (fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static int
+daemon_listen (GError **err)
+{
+	struct sockaddr_un addr;
+	mode_t oldmask;
+	int fd, rv;
+
+	if (!daemon_address (&addr, err))
+		return -1;
+
+	if ((fd = mu_cmd_daemon_connect ()) != -1) {
+		close (fd);
+		mu_util_g_set_error (err, MU_ERROR,
+				     "%s is in use already", addr.sun_path);
+		return -1;
+	}
+
+	/* nobody answers, so it's left over from an earlier daemon */
+	unlink (addr.sun_path);
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		mu_util_g_set_error (err, MU_ERROR_FILE,
+				     "cannot create socket: %s",
+				     strerror (errno));
+		return -1;
+	}
+
+	oldmask = umask (0077); /* only for us */
+	rv = bind (fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask (oldmask);
+
+	if (rv != 0 || listen (fd, DAEMON_BACKLOG) != 0) {
+		mu_util_g_set_error (err, MU_ERROR_FILE,
+				     "cannot listen on %s: %s",
+				     addr.sun_path, strerror (errno));
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+struct _MuCmdBroker {
+	ServerContext	 ctx;	 /* shared by the clients */
+	int		 sock;
+	GSList		*clients;
+	GThread		*thread; /* accepting the clients */
+	gint		 stop;	 /* atomic */
+};
+
+
+static StoreLock*
+store_lock_new (void)
+{
+	StoreLock *lock;
+
+	lock	    = g_new0 (StoreLock, 1);
+	lock->mutex = g_mutex_new ();
+	lock->cond  = g_cond_new ();
+
+	return lock;
+}
+
+
+static void
+store_lock_destroy (StoreLock *lock)
+{
+	g_cond_free (lock->cond);
+	g_mutex_free (lock->mutex);
+	g_free (lock);
+}
+
+
+static gpointer
+broker_run (MuCmdBroker *self)
+{
+	while (!MU_TERMINATE && !g_atomic_int_get (&self->stop)) {
+
+		struct pollfd pfd;
+		ServerClient *client;
+		GError *my_err;
+		int fd;
+
+		self->clients = reap_clients (self->clients, FALSE);
+
+		pfd.fd	   = self->sock;
+		pfd.events = POLLIN;
+		if (poll (&pfd, 1, DAEMON_POLL_MSECS) <= 0)
+			continue;
+
+		if ((fd = accept (self->sock, NULL, NULL)) == -1)
+			continue;
+
+		my_err = NULL;
+		if (!(client = client_start (&self->ctx, fd, &my_err))) {
+			g_warning ("cannot start client: %s",
+				   my_err ? my_err->message : "error");
+			g_clear_error (&my_err);
+			continue;
+		}
+
+		self->clients = g_slist_prepend (self->clients, client);
+	}
+
+	return NULL;
+}
+
+
+MuCmdBroker*
+mu_cmd_broker_new (MuStore *store, gboolean daemon, GError **err)
+{
+	MuCmdBroker *self;
+
+	g_return_val_if_fail (store, NULL);
+
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	self		 = g_new0 (MuCmdBroker, 1);
+	self->sock	 = -1;
+	self->ctx.store	 = store;
+	self->ctx.jobs	 = NULL; /* each client has its own */
+	self->ctx.results = NULL; /* likewise */
+	self->ctx.daemon  = daemon;
+
+	if (!(self->ctx.query = mu_query_new (store, err)) ||
+	    (self->sock = daemon_listen (err)) == -1) {
+		mu_cmd_broker_destroy (self);
+		return NULL;
+	}
+
+	self->ctx.store_lock = store_lock_new ();
+
+	signal (SIGPIPE, SIG_IGN); /* clients can go away at any time */
+
+	self->thread = g_thread_create ((GThreadFunc)broker_run, self,
+					TRUE, err);
+	if (!self->thread) {
+		mu_cmd_broker_destroy (self);
+		return NULL;
+	}
+
+	return self;
+}
+
+
+void
+mu_cmd_broker_destroy (MuCmdBroker *self)
+{
+	if (!self)
+		return;
+
+	g_atomic_int_set (&self->stop, TRUE);
+	if (self->thread)
+		g_thread_join (self->thread);
+
+	self->clients = reap_clients (self->clients, TRUE);
+
+	if (self->sock != -1) {
+		close (self->sock);
+		unlink (mu_runtime_path (MU_RUNTIME_PATH_SOCKET));
+	}
+
+	if (self->ctx.store_lock)
+		store_lock_destroy (self->ctx.store_lock);
+	if (self->ctx.query)
+		mu_query_destroy (self->ctx.query);
+
+	g_free (self);
+}
+
+
+void
+mu_cmd_broker_lock_store (MuCmdBroker *self)
+{
+	g_return_if_fail (self);
+	lock_store (self->ctx.store_lock);
+}
+
+
+void
+mu_cmd_broker_unlock_store (MuCmdBroker *self)
+{
+	g_return_if_fail (self);
+	unlock_store (self->ctx.store_lock);
+}
+
+
+void
+mu_cmd_broker_yield_store (MuCmdBroker *self)
+{
+	g_return_if_fail (self);
+	yield_store (self->ctx.store_lock);
+}
+
+
 MuError
 mu_cmd_server (MuStore *store, MuConfig *opts/*unused*/, GError **err)
 {
 	ServerContext ctx;
-	gboolean do_quit;
+	ServerInput input;
+	MuCmdBroker *broker;
+	GError *my_err;
 
 	g_return_val_if_fail (store, MU_ERROR_INTERNAL);
 
-	ctx.store = store;
-	ctx.query = mu_query_new (store, err);
-	if (!ctx.query)
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	install_sig_handler ();
+
+	/* other mu processes can use the store through us */
+	my_err = NULL;
+	if ((broker = mu_cmd_broker_new (store, FALSE, &my_err)))
+		ctx = broker->ctx;
+	else {
+		MU_WRITE_LOG ("not serving other processes: %s",
+			      my_err ? my_err->message : "error");
+		g_clear_error (&my_err);
+
+		ctx.store = store;
+		ctx.query = mu_query_new (store, err);
+		if (!ctx.query)
+			return MU_G_ERROR_CODE (err);
+		ctx.store_lock = store_lock_new ();
+	}
+	ctx.jobs    = g_hash_table_new (g_direct_hash, g_direct_equal);
+	ctx.results = result_cache_new ();
+	ctx.daemon  = FALSE;
+
+	g_print (";; welcome to " PACKAGE_STRING "\n");
+
+	server_output_init (&OUTPUT, fileno (stdout));
+	server_input_init (&input, fileno (stdin), TRUE);
+
+	serve (&ctx, &input);
+
+	server_input_uninit (&input);
+	server_output_uninit (&OUTPUT);
+
+	g_hash_table_destroy (ctx.jobs);
+	result_cache_destroy (ctx.results);
+	if (broker)
+		mu_cmd_broker_destroy (broker);
+	else {
+		store_lock_destroy (ctx.store_lock);
+		mu_query_destroy (ctx.query);
+	}
+
+	mu_store_flush (store);
+
+	return MU_OK;
+}
+
+
+MuError
+mu_cmd_daemon (MuStore *store, MuConfig *opts/*unused*/, GError **err)
+{
+	MuCmdBroker *broker;
+
+	g_return_val_if_fail (store, MU_ERROR_INTERNAL);
+
+	install_sig_handler ();
+
+	if (!(broker = mu_cmd_broker_new (store, TRUE, err)))
 		return MU_G_ERROR_CODE (err);
 
+	/* the broker does all the work */
+	while (!MU_TERMINATE)
+		g_usleep (DAEMON_POLL_MSECS * 1000);
+
+	mu_cmd_broker_destroy (broker);
+	mu_store_flush (store);
+
+	return MU_OK;
+}
+
+
+/* copy what we can read from one fd to the other; FALSE if there's
+ * nothing more */
+static gboolean
+relay_chunk (int from, int to)
+{
+	char buf[INPUT_CHUNK_SIZE];
+	struct iovec iov;
+	ssize_t len;
+
+	do
+		len = read (from, buf, sizeof(buf));
+	while (len == -1 && errno == EINTR && !MU_TERMINATE);
+
+	if (len <= 0)
+		return FALSE;
+
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+
+	return writev_all (to, &iov, 1);
+}
+
+
+MuError
+mu_cmd_server_relay (int fd, MuConfig *opts/*unused*/, GError **err)
+{
+	struct pollfd pfds[2];
+
+	g_return_val_if_fail (fd != -1, MU_ERROR_INTERNAL);
+
 	install_sig_handler ();
 
 	g_print (";; welcome to " PACKAGE_STRING "\n");
 
-	/*  the main REPL */
-	do_quit = FALSE;
-	while (!MU_TERMINATE && !do_quit) {
+	pfds[0].fd     = fileno (stdin);
+	pfds[0].events = POLLIN;
+	pfds[1].fd     = fd;
+	pfds[1].events = POLLIN;
 
-		GSList *args;
-		GError *my_err = NULL;
+	while (!MU_TERMINATE) {
 
-		/* args will receive a the command as a list of
-		 * strings. returning NULL indicates an error */
-		args   = read_line_as_list (&my_err);
-		if (!args || my_err) {
-			print_and_clear_g_error (&my_err);
-			continue;
+		if (poll (pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
 		}
 
-		switch (handle_args (&ctx, args, &my_err)) {
-		case MU_OK: break;
-		case MU_STOP:
-			do_quit = TRUE;
-			break;
-		default: /* some error occurred */
-			print_and_clear_g_error (&my_err);
+		/* at the end of our input, we still wait for the
+		 * responses to what we sent already */
+		if (pfds[0].revents && !relay_chunk (pfds[0].fd, fd)) {
+			shutdown (fd, SHUT_WR);
+			pfds[0].fd = -1; /* poll ignores it */
 		}
 
-		mu_str_free_list (args);
+		if (pfds[1].revents && !relay_chunk (fd, fileno (stdout)))
+			break;
 	}
 
-	mu_store_flush   (ctx.store);
-	mu_query_destroy (ctx.query);
+	close (fd);
 
 	return MU_OK;
 }
+
+
+gboolean
+mu_cmd_daemon_send (int fd, const char *cmdline)
+{
+	struct iovec iov[2];
+
+	g_return_val_if_fail (fd != -1, FALSE);
+	g_return_val_if_fail (cmdline, FALSE);
+
+	iov[0].iov_base = (char*)cmdline;
+	iov[0].iov_len	= strlen (cmdline);
+	iov[1].iov_base = "\n";
+	iov[1].iov_len	= 1;
+
+	return writev_all (fd, iov, 2);
+}
+
+
+/* get the next expression from the daemon's output */
+static char*
+read_frame (int fd, GString *buf)
+{
+	while (TRUE) {
+		char *pre, *post, chunk[INPUT_CHUNK_SIZE];
+		ssize_t len;
+
+		/* COOKIE_PRE <hex-len> COOKIE_POST <sexp> \n */
+		pre  = memchr (buf->str, COOKIE_PRE, buf->len);
+		post = pre ? memchr (pre, COOKIE_POST,
+				     buf->len - (pre - buf->str)) : NULL;
+		if (post) {
+			gsize start, exprlen;
+			start	= post + 1 - buf->str;
+			exprlen = strtoul (pre + 1, NULL, 16);
+			if (buf->len >= start + exprlen) {
+				char *expr;
+				expr = g_strndup (buf->str + start, exprlen);
+				g_string_erase (buf, 0, start + exprlen);
+				return expr;
+			}
+		}
+
+		do
+			len = read (fd, chunk, sizeof(chunk));
+		while (len == -1 && errno == EINTR);
+
+		if (len <= 0)
+			return NULL;
+
+		g_string_append_len (buf, chunk, len);
+	}
+}
+
+
+/* if expr is an ([:id <id>] :error <code> :message "<msg>"), set
+ * err, and return FALSE */
+static gboolean
+check_error_expr (const char *expr, GError **err)
+{
+	const char *cur;
+	char *msg, *end;
+	unsigned code;
+
+	cur = expr + (expr[0] == '(' ? 1 : 0);
+	if (g_str_has_prefix (cur, ":id ")) {
+		for (cur += 4; g_ascii_isdigit (*cur); ++cur);
+		++cur;
+	}
+	if (!g_str_has_prefix (cur, ":error "))
+		return TRUE;
+
+	code = strtoul (cur + 7, (char**)&cur, 10);
+	cur  = strstr (cur, ":message \"");
+	msg  = g_strdup (cur ? cur + 10 : "");
+	if ((end = strrchr (msg, '"')))
+		*end = '\0';
+
+	mu_util_g_set_error (err, code ? code : MU_ERROR, "%s", msg);
+	g_free (msg);
+
+	return FALSE;
+}
+
+
+char*
+mu_cmd_daemon_read_expr (int fd, GString *buf, GError **err)
+{
+	char *expr;
+
+	g_return_val_if_fail (fd != -1, NULL);
+	g_return_val_if_fail (buf, NULL);
+
+	if (!(expr = read_frame (fd, buf))) {
+		mu_util_g_set_error (err, MU_ERROR,
+				     "lost the connection to mu");
+		return NULL;
+	}
+
+	if (!check_error_expr (expr, err)) {
+		g_free (expr);
+		return NULL;
+	}
+
+	return expr;
+}
+
+
+gboolean
+mu_cmd_daemon_is_daemon (int fd)
+{
+	GString *buf;
+	char *expr;
+	gboolean rv;
+
+	g_return_val_if_fail (fd != -1, FALSE);
+
+	buf = g_string_sized_new (256);
+	rv  = FALSE;
+
+	/* only mu daemon says so in its pong */
+	if (mu_cmd_daemon_send (fd, "ping") &&
+	    (expr = mu_cmd_daemon_read_expr (fd, buf, NULL))) {
+		rv = strstr (expr, ":daemon t") != NULL;
+		g_free (expr);
+	}
+
+	g_string_free (buf, TRUE);
+
+	return rv;
+}
+
+
+void
+mu_cmd_daemon_append_param (GString *cmdline, const char *param,
+			    const char *val)
+{
+	const char *cur;
+
+	g_return_if_fail (cmdline);
+	g_return_if_fail (param);
+	g_return_if_fail (val);
+
+	/* quote and escape as eat_token expects */
+	g_string_append_printf (cmdline, " %s:\"", param);
+	for (cur = val; *cur; ++cur) {
+		if (*cur == '"' || *cur == '\\')
+			g_string_append_c (cmdline, '\\');
+		g_string_append_c (cmdline, *cur);
+	}
+	g_string_append_c (cmdline, '"');
+}
@@ -391,12 +391,87 @@ mu_cmd_remove (MuStore *store, MuConfig *opts, GError **err)
 }
 
 
+/* when some other mu has the store, let it add or remove the paths
+ * for us, and commit them */
+static MuError
+remote_add_or_remove (int fd, MuConfig *opts, GError **err)
+{
+	GString *cmdline, *buf;
+	gboolean add, allok;
+	const char *cmd;
+	char *expr;
+	int i;
+
+	add = (opts->cmd == MU_CONFIG_CMD_ADD);
+	cmd = add ? "add" : "remove";
+
+	/* note: params[0] will be 'add' or 'remove' */
+	if (!opts->params[0] || !opts->params[1]) {
+		g_print ("usage: mu %s <file> [<files>]\n", cmd);
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR_IN_PARAMETERS,
+			     "missing source and/or target");
+		close (fd);
+		return MU_ERROR_IN_PARAMETERS;
+	}
+
+	cmdline = g_string_sized_new (256);
+	buf	= g_string_sized_new (256);
+
+	for (i = 1, allok = TRUE; opts->params[i]; ++i) {
+
+		const char* src;
+		GError *my_err;
+
+		src = opts->params[i];
+		if (!check_file_okay (src, add)) {
+			allok = FALSE;
+			continue;
+		}
+
+		g_string_assign (cmdline, cmd);
+		mu_cmd_daemon_append_param (cmdline, "path", src);
+
+		my_err = NULL;
+		if (!mu_cmd_daemon_send (fd, cmdline->str) ||
+		    !(expr = mu_cmd_daemon_read_expr (fd, buf, &my_err))) {
+			MU_WRITE_LOG ("failed to %s %s: %s", cmd, src,
+				      my_err ? my_err->message : "error");
+			g_clear_error (&my_err);
+			allok = FALSE;
+			continue;
+		}
+		g_free (expr);
+	}
+
+	if (!mu_cmd_daemon_send (fd, "commit") ||
+	    !(expr = mu_cmd_daemon_read_expr (fd, buf, NULL)))
+		allok = FALSE;
+	else
+		g_free (expr);
+
+	g_string_free (cmdline, TRUE);
+	g_string_free (buf, TRUE);
+	close (fd);
+
+	if (!allok) {
+		g_set_error (err, MU_ERROR_DOMAIN,
+			     add ? MU_ERROR_XAPIAN_STORE_FAILED :
+			     MU_ERROR_XAPIAN_REMOVE_FAILED,
+			     "%s failed for some message(s)", cmd);
+		return add ? MU_ERROR_XAPIAN_STORE_FAILED :
+			MU_ERROR_XAPIAN_REMOVE_FAILED;
+	}
+
+	return MU_OK;
+}
+
+
 static void
 show_usage (void)
 {
 	g_print ("usage: mu command [options] [parameters]\n");
 	g_print ("where command is one of index, find, cfind, view, mkdir, "
-		   "extract, add, remove or server\n");
+		   "extract, add, remove, server or daemon\n");
 	g_print ("see the mu, mu-<command> or mu-easy manpages for "
 		   "more information\n");
 }
@@ -452,6 +527,8 @@ check_params (MuConfig *opts, GError **err)
 MuError
 mu_cmd_execute (MuConfig *opts, GError **err)
 {
+	int fd;
+
 	g_return_val_if_fail (opts, MU_ERROR_INTERNAL);
 
 	if (opts->version) {
@@ -471,13 +548,29 @@ mu_cmd_execute (MuConfig *opts, GError **err)
 	case MU_CONFIG_CMD_FIND:
 		return with_store (mu_cmd_find, opts, TRUE, err);
 	case MU_CONFIG_CMD_INDEX:
+		/* some other mu has the store; let it do the work */
+		if ((fd = mu_cmd_daemon_connect ()) != -1)
+			return mu_cmd_index_remote (fd, opts, err);
 		return with_store (mu_cmd_index, opts, FALSE, err);
 	case MU_CONFIG_CMD_ADD:
+		if ((fd = mu_cmd_daemon_connect ()) != -1)
+			return remote_add_or_remove (fd, opts, err);
 		return with_store (mu_cmd_add, opts, FALSE, err);
 	case MU_CONFIG_CMD_REMOVE:
+		if ((fd = mu_cmd_daemon_connect ()) != -1)
+			return remote_add_or_remove (fd, opts, err);
 		return with_store (mu_cmd_remove, opts, FALSE, err);
 	case MU_CONFIG_CMD_SERVER:
+		/* only mu daemon stays around for as long as we do;
+		 * other ones would leave us behind when done */
+		if ((fd = mu_cmd_daemon_connect ()) != -1) {
+			if (mu_cmd_daemon_is_daemon (fd))
+				return mu_cmd_server_relay (fd, opts, err);
+			close (fd);
+		}
 		return with_store (mu_cmd_server, opts, FALSE, err);
+	case MU_CONFIG_CMD_DAEMON:
+		return with_store (mu_cmd_daemon, opts, FALSE, err);
 	default:
 		show_usage ();
 		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR_IN_PARAMETERS,
@@ -150,6 +150,161 @@ MuError mu_cmd_remove (MuStore *store, MuConfig *opts, GError **err);
  */
 MuError mu_cmd_server (MuStore *store, MuConfig *opts,GError**/*unused*/);
 
+
+/**
+ * execute the daemon command; this is like the server command, but
+ * for any number of clients, which connect to a unix socket in the
+ * mu home directory
+ *
+ * @param store store object to use
+ * @param opts configuration options
+ * @param err receives error information, or NULL
+ *
+ * @return MU_OK (0) if the command succeeds,
+ * some error code otherwise
+ */
+MuError mu_cmd_daemon (MuStore *store, MuConfig *opts, GError **err);
+
+
+/**
+ * connect to the running mu daemon, if any
+ *
+ * @return a file descriptor for the connection, or -1 if there is no
+ * daemon
+ */
+int mu_cmd_daemon_connect (void);
+
+
+/**
+ * send a command line to the mu daemon
+ *
+ * @param fd the connection (from mu_cmd_daemon_connect)
+ * @param cmdline the command, as for mu server (without the \n)
+ *
+ * @return TRUE if it was sent, FALSE otherwise
+ */
+gboolean mu_cmd_daemon_send (int fd, const char *cmdline);
+
+
+/**
+ * append a param:value argument to a command line for the mu daemon,
+ * quoting the value as needed
+ *
+ * @param cmdline the command line
+ * @param param the name of the parameter
+ * @param val its value
+ */
+void mu_cmd_daemon_append_param (GString *cmdline, const char *param,
+				 const char *val);
+
+/**
+ * read the next expression the mu daemon sends
+ *
+ * @param fd the connection (from mu_cmd_daemon_connect)
+ * @param buf buffer for the input, to be passed to each call (for the
+ * same fd)
+ * @param err receives error information, or NULL; this includes the
+ * errors the daemon sends
+ *
+ * @return the expression (free with g_free), or NULL at the end of
+ * the input, or in case of error
+ */
+char* mu_cmd_daemon_read_expr (int fd, GString *buf, GError **err)
+	G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * check whether whoever listens at the other end of the connection is
+ * mu daemon, which keeps serving until it's terminated, rather than
+ * mu server or mu index, which stop when they're done with the store
+ *
+ * @param fd the connection (from mu_cmd_daemon_connect)
+ *
+ * @return TRUE if it's mu daemon, FALSE otherwise
+ */
+gboolean mu_cmd_daemon_is_daemon (int fd);
+
+
+struct _MuCmdBroker;
+typedef struct _MuCmdBroker MuCmdBroker;
+
+/**
+ * let other mu processes use a writable store through this one; the
+ * broker listens on the socket that mu_cmd_daemon_connect connects
+ * to, and serves the commands of mu server there, from a thread of
+ * its own. The clients take turns using the store with each other,
+ * and with the caller, who can use mu_cmd_broker_lock_store etc. for
+ * that.
+ *
+ * @param store a writable store
+ * @param daemon TRUE for mu daemon, which serves until it's
+ * terminated; mu server only relays to such a broker
+ * @param err receives error information, or NULL
+ *
+ * @return a new broker, or NULL in case of error; use
+ * mu_cmd_broker_destroy when done with it
+ */
+MuCmdBroker* mu_cmd_broker_new (MuStore *store, gboolean daemon,
+			       GError **err)
+	G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * stop serving the other processes, after letting them finish what
+ * they asked for already; the caller must not have the store locked
+ *
+ * @param self a broker, or NULL
+ */
+void mu_cmd_broker_destroy (MuCmdBroker *self);
+
+/**
+ * lock the store, waiting for the clients that are using it
+ *
+ * @param self a broker
+ */
+void mu_cmd_broker_lock_store (MuCmdBroker *self);
+
+/**
+ * unlock the store
+ *
+ * @param self a broker
+ */
+void mu_cmd_broker_unlock_store (MuCmdBroker *self);
+
+/**
+ * with the store locked, let waiting clients use it first
+ *
+ * @param self a broker
+ */
+void mu_cmd_broker_yield_store (MuCmdBroker *self);
+
+
+/**
+ * execute the server command through the running mu daemon, by
+ * relaying between stdin/stdout and the daemon
+ *
+ * @param fd the connection (from mu_cmd_daemon_connect); this
+ * function closes it
+ * @param opts configuration options
+ * @param err receives error information, or NULL
+ *
+ * @return MU_OK (0) if the command succeeds,
+ * some error code otherwise
+ */
+MuError mu_cmd_server_relay (int fd, MuConfig *opts, GError **err);
+
+
+/**
+ * execute the index command through the running mu daemon
+ *
+ * @param fd the connection (from mu_cmd_daemon_connect); this
+ * function closes it
+ * @param opts configuration options
+ * @param err receives error information, or NULL
+ *
+ * @return MU_OK (0) if the command succeeds,
+ * some error code otherwise
+ */
+MuError mu_cmd_index_remote (int fd, MuConfig *opts, GError **err);
+
 /**
  * execute some mu command, based on 'opts'
  *
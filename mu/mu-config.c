@@ -149,6 +149,9 @@ config_options_group_index (void)
 		 "auto-upgrade the database with new mu versions (false)", NULL},
 		{"nocleanup", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.nocleanup,
 		 "don't clean up the database after indexing (false)", NULL},
+		{"date-order", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.date_order,
+		 "renumber messages by date after indexing, for faster "
+		 "date-sorted searches (false)", NULL},
 		{"xbatchsize", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.xbatchsize,
 		 "set transaction batchsize for xapian commits (0)", NULL},
 		{"max-msg-size", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.max_msg_size,
@@ -198,6 +201,18 @@ config_options_group_find (void)
 		 "use a bookmarked query", NULL},
 		{"reverse", 'z', 0, G_OPTION_ARG_NONE, &MU_CONFIG.reverse,
 		 "sort in reverse (descending) order (z -> a)", NULL},
+		{"include-related", 'r', 0, G_OPTION_ARG_NONE,
+		 &MU_CONFIG.include_related,
+		 "include the whole threads of the matches", NULL},
+		{"collapse", 0, 0, G_OPTION_ARG_STRING, &MU_CONFIG.collapse,
+		 "show only one message per thread ('thread')", NULL},
+		{"group-subjects", 0, 0, G_OPTION_ARG_NONE,
+		 &MU_CONFIG.group_subjects,
+		 "with --threads, group threads by subject", NULL},
+		{"stored-threads", 0, 0, G_OPTION_ARG_NONE,
+		 &MU_CONFIG.stored_threads,
+		 "with --threads, use the thread links from the database",
+		 NULL},
 		/* {"summary", 'k', 0, G_OPTION_ARG_NONE, &MU_CONFIG.summary, */
 		/*  "(deprecated; use --summary-len)", NULL}, */
 		{"summary-len", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.summary_len,
@@ -267,6 +282,10 @@ config_options_group_cfind (void)
 		 "whether to only get 'personal' contacts", NULL},
 		{"after", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.after,
 		 "only get addresses last seen after T", NULL},
+		{"complete", 0, 0, G_OPTION_ARG_STRING, &MU_CONFIG.complete,
+		 "complete a prefix of a name or address, best first", NULL},
+		{"limit", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.limit,
+		 "with --complete, return at most <n> contacts", NULL},
 		{NULL, 0, 0, 0, NULL, NULL, NULL}
 	};
 
@@ -380,7 +399,8 @@ parse_cmd (int *argcp, char ***argvp)
 		{ "view",    MU_CONFIG_CMD_VIEW },
 		{ "add",     MU_CONFIG_CMD_ADD },
 		{ "remove",  MU_CONFIG_CMD_REMOVE },
-		{ "server",  MU_CONFIG_CMD_SERVER }
+		{ "server",  MU_CONFIG_CMD_SERVER },
+		{ "daemon",  MU_CONFIG_CMD_DAEMON }
 	};
 
 	MU_CONFIG.cmd	 = MU_CONFIG_CMD_NONE;
@@ -430,6 +450,7 @@ add_context_group (GOptionContext *context)
 		group = config_options_group_view();
 		break;
 	case MU_CONFIG_CMD_SERVER:
+	case MU_CONFIG_CMD_DAEMON:
 		group = config_options_group_server();
 		break;
 	default:
@@ -72,6 +72,7 @@ enum _MuConfigCmd {
 	MU_CONFIG_CMD_ADD,
 	MU_CONFIG_CMD_REMOVE,
 	MU_CONFIG_CMD_SERVER,
+	MU_CONFIG_CMD_DAEMON,
 
 	MU_CONFIG_CMD_NONE
 };
@@ -101,6 +102,8 @@ struct _MuConfig {
 	/* options for indexing */
 	char	        *maildir;	/* where the mails are */
 	gboolean        nocleanup;	/* don't cleanup del'd mails from db */
+	gboolean        date_order;	/* renumber messages by date
+					 * after indexing */
 	gboolean        reindex;	/* re-index existing mails */
 	gboolean        rebuild;	/* empty the database before indexing */
 	gboolean        autoupgrade;    /* automatically upgrade db
@@ -118,6 +121,12 @@ struct _MuConfig {
 	char	        *sortfield;	/* field to sort by (string) */
 	gboolean	 reverse;	/* sort in revers order (z->a) */
 	gboolean	 threads;       /* show message threads */
+	gboolean	 include_related; /* include the other messages
+					   * in the threads of the
+					   * matches */
+	char		*collapse;	/* collapse mode ('thread') */
+	gboolean	 group_subjects; /* group threads by subject */
+	gboolean	 stored_threads; /* threads from the stored links */
 
 	gboolean	 summary;	/* OBSOLETE: use summary_len */
 	int	         summary_len;   /* max # of lines for summary */
@@ -142,6 +151,8 @@ struct _MuConfig {
 					   * view */
 	/* options for cfind (and 'find' --> "after") */
 	gboolean          personal;       /* only show 'personal' addresses */
+	char		 *complete;	  /* prefix to complete */
+	int		  limit;	  /* max # of completions */
 	/* also 'after' --> see above */
 
 	/* output to a maildir with symlinks */
@@ -0,0 +1,512 @@
+/* -*- mode: c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+**
+** Copyright (C) 2008-2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif /*HAVE_CONFIG_H*/
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "test-mu-common.h"
+
+
+/* tests for 'mu server'; as the commands change the messages, each
+ * test uses its own copy of testdir2 */
+
+static gchar*
+fill_database (void)
+{
+	gchar *cmdline, *tmpdir, *maildir;
+
+	tmpdir	= test_mu_common_get_random_tmpdir();
+	maildir = g_strdup_printf ("%s%cmaildir", tmpdir, G_DIR_SEPARATOR);
+	g_assert (g_mkdir_with_parents (tmpdir, 0700) == 0);
+
+	cmdline = g_strdup_printf ("cp -R %s %s", MU_TESTMAILDIR2, maildir);
+	g_assert (g_spawn_command_line_sync (cmdline, NULL, NULL, NULL, NULL));
+	g_free (cmdline);
+
+	cmdline = g_strdup_printf ("%s index --muhome=%s --maildir=%s"
+				   " --quiet", MU_PROGRAM, tmpdir, maildir);
+	if (g_test_verbose())
+		g_print ("%s\n", cmdline);
+	g_assert (g_spawn_command_line_sync (cmdline, NULL, NULL, NULL, NULL));
+
+	g_free (cmdline);
+	g_free (maildir);
+
+	return tmpdir;
+}
+
+
+/* feed cmds to a 'mu server' for muhome, and return what it says */
+static gchar*
+run_server (const char *muhome, const char *cmds)
+{
+	gchar *cmdfile, *shcmd, *quoted, *cmdline, *output;
+
+	cmdfile = g_strdup_printf ("%s%ccommands", muhome, G_DIR_SEPARATOR);
+	g_assert (g_file_set_contents (cmdfile, cmds, -1, NULL));
+
+	shcmd	= g_strdup_printf ("%s server --muhome=%s < %s",
+				   MU_PROGRAM, muhome, cmdfile);
+	quoted	= g_shell_quote (shcmd);
+	cmdline = g_strdup_printf ("/bin/sh -c %s", quoted);
+	if (g_test_verbose())
+		g_print ("%s\n", cmdline);
+
+	output = NULL;
+	g_assert (g_spawn_command_line_sync (cmdline, &output, NULL,
+					     NULL, NULL));
+	if (g_test_verbose())
+		g_print ("\nOutput:\n%s", output);
+
+	g_free (cmdline);
+	g_free (quoted);
+	g_free (shcmd);
+	g_free (cmdfile);
+
+	return output;
+}
+
+
+static unsigned
+count_in_output (const char *output, const char *str)
+{
+	unsigned count;
+
+	for (count = 0; (output = strstr (output, str)); ++count)
+		output += strlen (str);
+
+	return count;
+}
+
+
+static void
+test_mu_server_move_many (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome,
+		 "move-many docids:1,2,9999 flags:+S\n"
+		 "move-many msgids:abc@def,293847329847@web.de flags:+F\n"
+		 "find query:flag:seen handle:true\n"
+		 "find query:flag:flagged handle:true\n");
+
+	/* the message that isn't there is the only one that fails */
+	g_assert (strstr (output, ":found 3 :moved 2 :failed (9999)"));
+	g_assert (strstr (output, ":found 2 :moved 2 :failed ()"));
+	g_assert (strstr (output, "(:found 2 :handle 1)"));
+	g_assert (strstr (output, "(:found 2 :handle 2)"));
+
+	/* and we don't get an update for each message */
+	g_assert_cmpuint (count_in_output (output, "(:update"), ==, 0);
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+static void
+test_mu_server_find_handle_fetch (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome,
+		 "find query:\"\" handle:true\n"
+		 "fetch handle:1 from:2 to:5\n"
+		 "fetch handle:1 from:10\n"
+		 "release handle:1\n"
+		 "fetch handle:1\n");
+
+	/* find itself sends no messages */
+	g_assert (strstr (output, "(:found 12 :handle 1)"));
+	g_assert (!strstr (output, "(:erase t)"));
+
+	g_assert (strstr (output, "(:fetched 1 :from 2 :to 5 :found 12)"));
+	g_assert (strstr (output, "(:fetched 1 :from 10 :to 12 :found 12)"));
+	g_assert_cmpuint (count_in_output (output, ":docid "), ==, 3 + 2);
+
+	g_assert (strstr (output, "(:info release :handle 1)"));
+	g_assert (strstr (output, "no results for handle 1"));
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* a message that's gone by the time we fetch it is sent as a
+ * (:remove ...), in its place */
+static void
+test_mu_server_fetch_removed (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome,
+		 "find query:\"\" handle:true\n"
+		 "remove docid:3\n"
+		 "fetch handle:1\n");
+
+	g_assert (strstr (output, "(:fetched 1 :from 0 :to 12 :found 12)"));
+	g_assert_cmpuint (count_in_output (output, ":docid "), ==, 11);
+	/* one from 'remove', one from 'fetch' */
+	g_assert_cmpuint (count_in_output (output, "(:remove 3)"), ==, 2);
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* a client can keep 16 results; the least recently used go first */
+static void
+test_mu_server_results_lru (void)
+{
+	gchar *muhome, *output;
+	GString *cmds;
+	unsigned u;
+
+	muhome = fill_database ();
+
+	cmds = g_string_new (NULL);
+	for (u = 1; u <= 16; ++u)
+		g_string_append (cmds, "find query:maildir:/bar handle:true\n");
+	g_string_append (cmds, "fetch handle:1 to:1\n"); /* use 1 again */
+	g_string_append (cmds, "find query:maildir:/bar handle:true\n");
+	g_string_append (cmds, "fetch handle:2 to:1\n");
+	g_string_append (cmds, "fetch handle:1 to:1\n");
+	g_string_append (cmds, "fetch handle:17 to:1\n");
+
+	output = run_server (muhome, cmds->str);
+
+	g_assert (strstr (output, "(:found 7 :handle 17)"));
+	g_assert (strstr (output, "no results for handle 2"));
+	g_assert_cmpuint (count_in_output
+			  (output, "(:fetched 1 :from 0 :to 1 :found 7)"),
+			  ==, 2);
+	g_assert (strstr (output, "(:fetched 17 :from 0 :to 1 :found 7)"));
+
+	g_string_free (cmds, TRUE);
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* refreshing only sends what changed; we sort by size, which is
+ * different for all messages in /bar */
+static void
+test_mu_server_find_refresh (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome,
+		 "find query:maildir:/bar sortfield:size handle:true\n"
+		 /* a changed message */
+		 "move-many msgids:abc@def flags:+S\n"
+		 "find query:maildir:/bar sortfield:size refresh-of:1\n"
+		 /* one that's gone */
+		 "move msgid:293847329847@web.de maildir:/Foo\n"
+		 "find query:maildir:/bar sortfield:size refresh-of:2\n"
+		 /* and it's back */
+		 "move msgid:293847329847@web.de maildir:/bar\n"
+		 "find query:maildir:/bar sortfield:size refresh-of:3\n"
+		 /* all in the opposite order; only one stays in place */
+		 "find query:maildir:/bar sortfield:size reverse:true "
+		 "refresh-of:4\n"
+		 "fetch handle:4\n");
+
+	g_assert (strstr (output, "(:found 7 :handle 1)"));
+	g_assert (strstr (output, "(:found 7 :handle 2 :refresh-of 1 "
+			  ":inserted 0 :updated 1 :removed 0)"));
+	g_assert (strstr (output, "(:found 6 :handle 3 :refresh-of 2 "
+			  ":inserted 0 :updated 0 :removed 1)"));
+	g_assert (strstr (output, "(:found 7 :handle 4 :refresh-of 3 "
+			  ":inserted 1 :updated 0 :removed 0)"));
+	g_assert (strstr (output, "(:found 7 :handle 5 :refresh-of 4 "
+			  ":inserted 6 :updated 0 :removed 6)"));
+
+	/* the update, the insert and the reordered ones come with
+	 * their position */
+	g_assert_cmpuint (count_in_output (output, "(:insert ("), ==, 1 + 6);
+	g_assert_cmpuint (count_in_output (output, " :position "), ==, 1 + 7);
+
+	/* the old handle is replaced by the new one */
+	g_assert (strstr (output, "no results for handle 4"));
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* responses to a request with an id carry that id; other ones
+ * don't */
+static void
+test_mu_server_request_id (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome,
+		 "find query:maildir:/bar id:1\n"
+		 "ping id:2\n"
+		 "ping\n");
+
+	g_assert (strstr (output, "(:id 1 :erase t)"));
+	g_assert (strstr (output, "(:id 1 :found 7)"));
+	g_assert_cmpuint (count_in_output (output, "(:id 1 :docid "), ==, 7);
+
+	g_assert (strstr (output, "(:id 2 :pong "));
+	g_assert_cmpuint (count_in_output (output, "(:pong "), ==, 1);
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* a maildir with num (unindexed) copies of the same message */
+static gchar*
+fill_big_maildir (const char *muhome, unsigned num)
+{
+	gchar *maildir, *path, *data;
+	gsize len;
+	unsigned u;
+
+	path = g_strdup_printf ("%s%cbar%ccur%cmail4", MU_TESTMAILDIR2,
+				G_DIR_SEPARATOR, G_DIR_SEPARATOR,
+				G_DIR_SEPARATOR);
+	g_assert (g_file_get_contents (path, &data, &len, NULL));
+	g_free (path);
+
+	maildir = g_strdup_printf ("%s%cbig", muhome, G_DIR_SEPARATOR);
+	path	= g_strdup_printf ("%s%cnew", maildir, G_DIR_SEPARATOR);
+	g_assert (g_mkdir_with_parents (path, 0700) == 0);
+	g_free (path);
+	path	= g_strdup_printf ("%s%ccur", maildir, G_DIR_SEPARATOR);
+	g_assert (g_mkdir_with_parents (path, 0700) == 0);
+	g_free (path);
+
+	for (u = 0; u != num; ++u) {
+		path = g_strdup_printf ("%s%ccur%c%u.big:2,S", maildir,
+					G_DIR_SEPARATOR, G_DIR_SEPARATOR, u);
+		g_assert (g_file_set_contents (path, data, len, NULL));
+		g_free (path);
+	}
+
+	g_free (data);
+
+	return maildir;
+}
+
+
+/* an index with an id runs in the background; we can still talk to
+ * the server, and cancel it */
+static void
+test_mu_server_index_cancel (void)
+{
+	gchar *muhome, *maildir, *cmds, *output;
+
+	muhome	= fill_database ();
+	maildir = fill_big_maildir (muhome, 5000);
+
+	cmds = g_strdup_printf ("index path:%s id:2\n"
+				"ping\n"
+				"cancel id:2\n", maildir);
+	output = run_server (muhome, cmds);
+
+	g_assert (strstr (output, "(:pong "));
+	g_assert (strstr (output, "(:info cancel :request 2)"));
+	g_assert (strstr (output, "(:id 2 :info index :status cancelled "));
+	g_assert (!strstr (output, ":status complete"));
+
+	g_free (output);
+	g_free (cmds);
+	g_free (maildir);
+	g_free (muhome);
+}
+
+
+/* when the input ends, the running requests still finish */
+static void
+test_mu_server_request_eof (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server (muhome, "find query:maildir:/bar id:1\n");
+
+	g_assert (strstr (output, "(:id 1 :found 7)"));
+	g_assert_cmpuint (count_in_output (output, "(:id 1 :docid "), ==, 7);
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* param:value arguments can be quoted, also in part */
+static void
+test_mu_server_parse_quoted (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome,
+		 "find query:\"maildir:/bar OR maildir:/Foo\"\n"
+		 "find query:maildir:\"/wom_bat\"\n");
+
+	g_assert (strstr (output, "(:found 9)"));
+	g_assert (strstr (output, "(:found 3)"));
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* \ escapes a space, a " or a \; but nothing else */
+static void
+test_mu_server_parse_escapes (void)
+{
+	gchar *muhome, *cmds, *output, *path;
+
+	muhome = fill_database ();
+
+	cmds = g_strdup_printf ("mkdir path:%s%ca\\ b\\\"c\\\\d\n"
+				"find query:maildir:/bar\\x\n"
+				"ping\n", muhome, G_DIR_SEPARATOR);
+	output = run_server (muhome, cmds);
+
+	path = g_strdup_printf ("%s%ca b\"c\\d%ccur", muhome,
+				G_DIR_SEPARATOR, G_DIR_SEPARATOR);
+	g_assert (g_file_test (path, G_FILE_TEST_IS_DIR));
+	g_assert (strstr (output, "(:info mkdir "));
+
+	/* the bad one is an error, after which we carry on */
+	g_assert (strstr (output, "(:error "));
+	g_assert (strstr (output, "error parsing string"));
+	g_assert (!strstr (output, "(:found "));
+	g_assert (strstr (output, "(:pong "));
+
+	g_free (path);
+	g_free (output);
+	g_free (cmds);
+	g_free (muhome);
+}
+
+
+/* if a param occurs more than once, the first one wins */
+static void
+test_mu_server_parse_duplicate (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome, "find query:maildir:/Foo query:maildir:/bar\n");
+
+	g_assert (strstr (output, "(:found 2)"));
+	g_assert (!strstr (output, "(:found 7)"));
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+/* the last line doesn't need a \n */
+static void
+test_mu_server_parse_last_line (void)
+{
+	gchar *muhome, *output;
+
+	muhome = fill_database ();
+
+	output = run_server
+		(muhome,
+		 "find query:maildir:/Foo\n"
+		 "find query:maildir:/wom_bat");
+
+	g_assert (strstr (output, "(:found 2)"));
+	g_assert (strstr (output, "(:found 3)"));
+
+	g_free (output);
+	g_free (muhome);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	g_test_init (&argc, &argv, NULL);
+
+	if (!set_en_us_utf8_locale())
+		return 0; /* don't error out... */
+
+	g_test_add_func ("/mu-server/test-mu-server-find-handle-fetch",
+			 test_mu_server_find_handle_fetch);
+	g_test_add_func ("/mu-server/test-mu-server-fetch-removed",
+			 test_mu_server_fetch_removed);
+	g_test_add_func ("/mu-server/test-mu-server-results-lru",
+			 test_mu_server_results_lru);
+	g_test_add_func ("/mu-server/test-mu-server-find-refresh",
+			 test_mu_server_find_refresh);
+	g_test_add_func ("/mu-server/test-mu-server-move-many",
+			 test_mu_server_move_many);
+	g_test_add_func ("/mu-server/test-mu-server-request-id",
+			 test_mu_server_request_id);
+	g_test_add_func ("/mu-server/test-mu-server-index-cancel",
+			 test_mu_server_index_cancel);
+	g_test_add_func ("/mu-server/test-mu-server-request-eof",
+			 test_mu_server_request_eof);
+	g_test_add_func ("/mu-server/test-mu-server-parse-quoted",
+			 test_mu_server_parse_quoted);
+	g_test_add_func ("/mu-server/test-mu-server-parse-escapes",
+			 test_mu_server_parse_escapes);
+	g_test_add_func ("/mu-server/test-mu-server-parse-duplicate",
+			 test_mu_server_parse_duplicate);
+	g_test_add_func ("/mu-server/test-mu-server-parse-last-line",
+			 test_mu_server_parse_last_line);
+
+	g_log_set_handler (NULL,
+			   G_LOG_LEVEL_MASK | G_LOG_LEVEL_WARNING|
+			   G_LOG_FLAG_FATAL| G_LOG_FLAG_RECURSION,
+			   (GLogFunc)black_hole, NULL);
+
+	return g_test_run ();
+}
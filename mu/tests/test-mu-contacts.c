@@ -137,6 +137,21 @@ accumulate_contacts (MuContacts *contacts, const gchar *pattern)
 }
 
 
+/* the path for a contacts cache in a new, empty directory */
+static gchar*
+get_contacts_file (void)
+{
+	gchar *tmpdir, *contactsfile;
+
+	tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert (g_mkdir_with_parents (tmpdir, 0700) == 0);
+	contactsfile = g_strdup_printf ("%s%ccontacts", tmpdir,
+					G_DIR_SEPARATOR);
+	g_free (tmpdir);
+
+	return contactsfile;
+}
+
 static void
 test_mu_contacts_01 (void)
 {
@@ -176,6 +191,265 @@ test_mu_contacts_01 (void)
 	g_free (muhome);
 }
 
+static void
+test_mu_contacts_cache (void)
+{
+	MuContacts *contacts;
+	gchar *contactsfile;
+	GSList *clist;
+
+	contactsfile = get_contacts_file ();
+
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	g_assert (mu_contacts_add (contacts, "b@example.com", "Bee",
+				   FALSE, 100));
+	g_assert (mu_contacts_add (contacts, "a@example.com", NULL,
+				   TRUE, 200));
+	mu_contacts_destroy (contacts); /* writes the cache */
+
+	/* reload; an older entry should not replace the stored one,
+	 * a newer one with a name should */
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	g_assert_cmpuint (mu_contacts_count (contacts), ==, 2);
+	g_assert (!mu_contacts_add (contacts, "b@example.com", "Old Bee",
+				    FALSE, 50));
+	g_assert (mu_contacts_add (contacts, "a@example.com", "Ay",
+				   TRUE, 300));
+	g_assert (mu_contacts_add (contacts, "c@example.com", "Cee",
+				   FALSE, 300));
+	g_assert_cmpuint (mu_contacts_count (contacts), ==, 3);
+	mu_contacts_destroy (contacts);
+
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	clist = accumulate_contacts (contacts, NULL);
+	g_assert_cmpint (g_slist_length (clist), ==, 3);
+	g_assert (has_contact (clist, "Ay", TRUE));
+	g_assert (has_contact (clist, "Bee", TRUE));
+	g_assert (!has_contact (clist, "Old Bee", TRUE));
+	g_assert (has_contact (clist, "c@example.com", FALSE));
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+	mu_contacts_destroy (contacts);
+
+	g_free (contactsfile);
+}
+
+static GSList*
+complete_contacts (MuContacts *contacts, const char *prefix, size_t limit)
+{
+	GSList *lst;
+
+	lst = NULL;
+	g_assert (mu_contacts_complete (contacts, prefix, FALSE, limit,
+					(MuContactsForeachFunc)each_contact,
+					&lst, NULL));
+	return g_slist_reverse (lst);
+}
+
+
+static void
+test_mu_contacts_complete (void)
+{
+	MuContacts *contacts;
+	gchar *contactsfile;
+	GSList *clist;
+	time_t now;
+	int i;
+
+	contactsfile = get_contacts_file ();
+	now = time (NULL);
+
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	for (i = 0; i != 3; ++i)
+		mu_contacts_add (contacts, "joan@example.com", "Joan Doe",
+				 FALSE, now);
+	for (i = 0; i != 2; ++i)
+		mu_contacts_add (contacts, "bob@example.com", "Bob Jones",
+				 FALSE, now);
+	mu_contacts_add (contacts, "john.smith@example.org", "John Smith",
+			 FALSE, now);
+	mu_contacts_destroy (contacts);
+
+	/* from the completion index in the cache */
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+
+	clist = complete_contacts (contacts, "JO", 2);
+	g_assert_cmpuint (g_slist_length (clist), ==, 2);
+	g_assert_cmpstr (((Contact*)clist->data)->email,==,"joan@example.com");
+	g_assert_cmpstr (((Contact*)clist->next->data)->email,==,
+			 "bob@example.com");
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+
+	clist = complete_contacts (contacts, "smi", 0);
+	g_assert_cmpuint (g_slist_length (clist), ==, 1);
+	g_assert (has_contact (clist, "John Smith", TRUE));
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+
+	/* john is now the one we've seen most often */
+	for (i = 0; i != 3; ++i)
+		mu_contacts_add (contacts, "john.smith@example.org",
+				 "John Smith", FALSE, now);
+	clist = complete_contacts (contacts, "jo", 0);
+	g_assert_cmpuint (g_slist_length (clist), ==, 3);
+	g_assert_cmpstr (((Contact*)clist->data)->email,==,
+			 "john.smith@example.org");
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+
+	/* only the best ones, in order */
+	clist = complete_contacts (contacts, "jo", 2);
+	g_assert_cmpuint (g_slist_length (clist), ==, 2);
+	g_assert_cmpstr (((Contact*)clist->data)->email,==,
+			 "john.smith@example.org");
+	g_assert_cmpstr (((Contact*)clist->next->data)->email,==,
+			 "joan@example.com");
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+
+	/* a new name gives new tokens */
+	mu_contacts_add (contacts, "mary@example.net", "Mary Major",
+			 FALSE, now - 10);
+	mu_contacts_add (contacts, "mary@example.net", "Mary Minor",
+			 FALSE, now);
+	clist = complete_contacts (contacts, "maj", 0);
+	g_assert_cmpuint (g_slist_length (clist), ==, 0);
+	clist = complete_contacts (contacts, "min", 0);
+	g_assert_cmpuint (g_slist_length (clist), ==, 1);
+	g_assert (has_contact (clist, "Mary Minor", TRUE));
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+
+	mu_contacts_destroy (contacts);
+
+	g_free (contactsfile);
+}
+
+static GSList*
+contacts_since (MuContacts *contacts, guint32 generation)
+{
+	GSList *lst;
+
+	lst = NULL;
+	g_assert (mu_contacts_foreach_since
+		  (contacts, generation, (MuContactsForeachFunc)each_contact,
+		   &lst, NULL));
+	return lst;
+}
+
+
+static void
+test_mu_contacts_generation (void)
+{
+	MuContacts *contacts;
+	gchar *contactsfile;
+	GSList *clist;
+
+	contactsfile = get_contacts_file ();
+
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	mu_contacts_add (contacts, "a@example.com", "Ay", FALSE, 100);
+	mu_contacts_add (contacts, "b@example.com", "Bee", FALSE, 100);
+	g_assert_cmpuint (mu_contacts_generation (contacts), ==, 2);
+	mu_contacts_destroy (contacts);
+
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	g_assert_cmpuint (mu_contacts_generation (contacts), ==, 2);
+
+	/* seeing a contact again does not change it; a new name does */
+	mu_contacts_add (contacts, "a@example.com", "Ay", FALSE, 50);
+	mu_contacts_add (contacts, "c@example.com", "Cee", FALSE, 100);
+	mu_contacts_add (contacts, "b@example.com", "Bea", FALSE, 200);
+	g_assert_cmpuint (mu_contacts_generation (contacts), ==, 4);
+
+	clist = contacts_since (contacts, 2);
+	g_assert_cmpuint (g_slist_length (clist), ==, 2);
+	g_assert (has_contact (clist, "Bea", TRUE));
+	g_assert (has_contact (clist, "Cee", TRUE));
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+	mu_contacts_destroy (contacts);
+
+	/* now, from the generation index in the cache */
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	clist = contacts_since (contacts, 3);
+	g_assert_cmpuint (g_slist_length (clist), ==, 1);
+	g_assert (has_contact (clist, "Bea", TRUE));
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+
+	clist = contacts_since (contacts, 0);
+	g_assert_cmpuint (g_slist_length (clist), ==, 3);
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+	mu_contacts_destroy (contacts);
+
+	g_free (contactsfile);
+}
+
+
+static void
+test_mu_contacts_keys (void)
+{
+	MuContacts *contacts;
+	MuContactsDelta *delta;
+	gchar *contactsfile;
+	GSList *clist;
+
+	contactsfile = get_contacts_file ();
+
+	/* addresses that differ only in case are the same contact;
+	 * others are not, even if they look alike */
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	g_assert (mu_contacts_add (contacts, "Ann.Bee@Example.com", "Ann",
+				   FALSE, 100));
+	g_assert (mu_contacts_add (contacts, "ann.bee@example.com",
+				   "Ann Bee", FALSE, 200));
+	g_assert (mu_contacts_add (contacts, "ann_bee@example.com",
+				   "Other Ann", FALSE, 200));
+	g_assert_cmpuint (mu_contacts_count (contacts), ==, 2);
+	mu_contacts_destroy (contacts);
+
+	/* merge a delta with the loaded cache */
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	delta = mu_contacts_delta_new ();
+	mu_contacts_delta_add (delta, "ANN.BEE@example.com", "Annie",
+			       FALSE, 300);
+	mu_contacts_delta_add (delta, "ann.bee@example.com", NULL,
+			       FALSE, 250);
+	mu_contacts_delta_add (delta, "d@example.com", "Dee", FALSE, 300);
+	g_assert_cmpuint (mu_contacts_merge (contacts, delta), ==, 2);
+	g_assert_cmpuint (mu_contacts_merge (contacts, delta), ==, 0);
+	mu_contacts_delta_destroy (delta);
+	g_assert_cmpuint (mu_contacts_count (contacts), ==, 3);
+	mu_contacts_destroy (contacts);
+
+	contacts = mu_contacts_new (contactsfile);
+	g_assert (contacts);
+	clist = accumulate_contacts (contacts, NULL);
+	g_assert_cmpint (g_slist_length (clist), ==, 3);
+	g_assert (has_contact (clist, "Ann.Bee@Example.com", FALSE));
+	g_assert (has_contact (clist, "ann_bee@example.com", FALSE));
+	g_assert (has_contact (clist, "Annie", TRUE));
+	g_assert (!has_contact (clist, "Ann Bee", TRUE));
+	g_slist_foreach (clist, (GFunc)contact_destroy, NULL);
+	g_slist_free (clist);
+	mu_contacts_destroy (contacts);
+
+	g_free (contactsfile);
+}
+
 
 int
 main (int argc, char *argv[])
@@ -184,6 +458,14 @@ main (int argc, char *argv[])
 
 	g_test_init (&argc, &argv, NULL);
 	g_test_add_func ("/mu-contacts/test-mu-contacts-01", test_mu_contacts_01);
+	g_test_add_func ("/mu-contacts/test-mu-contacts-cache",
+			 test_mu_contacts_cache);
+	g_test_add_func ("/mu-contacts/test-mu-contacts-complete",
+			 test_mu_contacts_complete);
+	g_test_add_func ("/mu-contacts/test-mu-contacts-generation",
+			 test_mu_contacts_generation);
+	g_test_add_func ("/mu-contacts/test-mu-contacts-keys",
+			 test_mu_contacts_keys);
 
 	g_log_set_handler (NULL,
 			   G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL| G_LOG_FLAG_RECURSION,
@@ -125,8 +125,8 @@ run_and_count_matches (const char *xpath, const char *query)
 	}
 
 
-	iter = mu_query_run (mquery, query, FALSE, MU_MSG_FIELD_ID_NONE,
-			     FALSE, -1, NULL);
+	iter = mu_query_run (mquery, query, MU_MSG_FIELD_ID_NONE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
 	mu_query_destroy (mquery);
 	g_assert (iter);
 
@@ -321,8 +321,8 @@ test_mu_query_accented_chars_01 (void)
 	query = mu_query_new (store, NULL);
 	mu_store_unref (store);
 
-	iter = mu_query_run (query, "fünkÿ", FALSE, MU_MSG_FIELD_ID_NONE,
-			     FALSE, -1, NULL);
+	iter = mu_query_run (query, "fünkÿ", MU_MSG_FIELD_ID_NONE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
 	err = NULL;
 	msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
 	if (!msg) {
@@ -371,6 +371,262 @@ test_mu_query_accented_chars_02 (void)
 }
 
 
+static void
+test_mu_query_rows (void)
+{
+	MuQuery *query;
+	MuMsgIter *iter;
+	MuStore *store;
+	gchar *xpath;
+	guint32 fields;
+
+	xpath = fill_database (MU_TESTMAILDIR);
+	g_assert (xpath != NULL);
+
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+
+	query = mu_query_new (store, NULL);
+	mu_store_unref (store);
+
+	iter = mu_query_run (query, "", MU_MSG_FIELD_ID_NONE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
+	g_assert (iter);
+
+	fields = MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_SUBJECT) |
+		MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_PATH) |
+		MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_DATE);
+
+	/* the projected rows should match the full messages */
+	for (; !mu_msg_iter_is_done (iter); mu_msg_iter_next (iter)) {
+		MuMsgIterRow row;
+		MuMsg *msg;
+
+		g_assert (mu_msg_iter_get_row (iter, fields, &row));
+		msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
+		g_assert (msg);
+
+		g_assert_cmpuint (row.docid,==, mu_msg_iter_get_docid (iter));
+		g_assert_cmpstr (row.str[MU_MSG_FIELD_ID_SUBJECT],==,
+				 mu_msg_get_subject (msg));
+		g_assert_cmpstr (row.str[MU_MSG_FIELD_ID_PATH],==,
+				 mu_msg_get_path (msg));
+		g_assert_cmpint (row.num[MU_MSG_FIELD_ID_DATE],==,
+				 (gint64)mu_msg_get_date (msg));
+		/* not requested */
+		g_assert (row.str[MU_MSG_FIELD_ID_FROM] == NULL);
+	}
+
+	mu_msg_iter_destroy (iter);
+	mu_query_destroy (query);
+	g_free (xpath);
+}
+
+
+#define ROWS_PERF_NUM 100000
+
+/* a maildir with num copies of the same message */
+static gchar*
+fill_perf_maildir (unsigned num)
+{
+	gchar *maildir, *path, *data;
+	gsize len;
+	unsigned u;
+
+	path = g_strdup_printf ("%s%ccur%c1220863042.12663_1.mindcrime!2,S",
+				MU_TESTMAILDIR, G_DIR_SEPARATOR,
+				G_DIR_SEPARATOR);
+	g_assert (g_file_get_contents (path, &data, &len, NULL));
+	g_free (path);
+
+	maildir = test_mu_common_get_random_tmpdir();
+	path	= g_strdup_printf ("%s%ccur", maildir, G_DIR_SEPARATOR);
+	g_assert (g_mkdir_with_parents (path, 0700) == 0);
+	g_free (path);
+	path	= g_strdup_printf ("%s%cnew", maildir, G_DIR_SEPARATOR);
+	g_assert (g_mkdir_with_parents (path, 0700) == 0);
+	g_free (path);
+
+	for (u = 0; u != num; ++u) {
+		path = g_strdup_printf ("%s%ccur%c%u.perf:2,S", maildir,
+					G_DIR_SEPARATOR, G_DIR_SEPARATOR, u);
+		g_assert (g_file_set_contents (path, data, len, NULL));
+		g_free (path);
+	}
+
+	g_free (data);
+
+	return maildir;
+}
+
+
+/* go through all messages, getting the fields 'mu find' shows by
+ * default, either from a MuMsg or from a row; return the time it
+ * took */
+static double
+time_iteration (const char *xpath, gboolean use_rows)
+{
+	MuQuery *query;
+	MuMsgIter *iter;
+	MuStore *store;
+	guint32 fields;
+	unsigned count;
+	double elapsed;
+
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+	query = mu_query_new (store, NULL);
+	mu_store_unref (store);
+
+	fields = MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_DATE) |
+		MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_FROM) |
+		MU_MSG_ITER_FIELD_MASK(MU_MSG_FIELD_ID_SUBJECT);
+
+	g_test_timer_start ();
+
+	iter = mu_query_run (query, "", MU_MSG_FIELD_ID_DATE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
+	g_assert (iter);
+	for (count = 0; !mu_msg_iter_is_done (iter);
+	     mu_msg_iter_next (iter), ++count) {
+		if (use_rows) {
+			MuMsgIterRow row;
+			g_assert (mu_msg_iter_get_row (iter, fields, &row));
+		} else {
+			MuMsg *msg;
+			msg = mu_msg_iter_get_msg_floating (iter);
+			g_assert (msg);
+			mu_msg_get_date (msg);
+			mu_msg_get_from (msg);
+			mu_msg_get_subject (msg);
+		}
+	}
+	mu_msg_iter_destroy (iter);
+
+	elapsed = g_test_timer_elapsed ();
+
+	g_assert_cmpuint (count, ==, ROWS_PERF_NUM);
+	mu_query_destroy (query);
+
+	return elapsed;
+}
+
+
+/* compare iterating over many results with and without rows; run
+ * with '-m perf' */
+static void
+test_mu_query_rows_perf (void)
+{
+	gchar *maildir, *xpath;
+	double msgs, rows;
+
+	if (!g_test_perf ())
+		return;
+
+	maildir = fill_perf_maildir (ROWS_PERF_NUM);
+	xpath	= fill_database (maildir);
+	g_assert (xpath != NULL);
+
+	msgs = time_iteration (xpath, FALSE);
+	rows = time_iteration (xpath, TRUE);
+
+	g_test_minimized_result (msgs, "%u messages: %.3fs",
+				 ROWS_PERF_NUM, msgs);
+	g_test_minimized_result (rows, "%u rows: %.3fs",
+				 ROWS_PERF_NUM, rows);
+
+	g_free (xpath);
+	g_free (maildir);
+}
+
+#define SEXP_PERF_NUM 10000
+
+/* go through all messages, and turn them into sexps, either each in
+ * a new string, or all in the same GString; return the time it
+ * took */
+static double
+time_sexps (const char *xpath, gboolean reuse)
+{
+	MuQuery *query;
+	MuMsgIter *iter;
+	MuStore *store;
+	GString *gstr;
+	unsigned count;
+	double elapsed;
+
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+	query = mu_query_new (store, NULL);
+	mu_store_unref (store);
+
+	gstr = g_string_sized_new (1024);
+
+	g_test_timer_start ();
+
+	iter = mu_query_run (query, "", MU_MSG_FIELD_ID_NONE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
+	g_assert (iter);
+	for (count = 0; !mu_msg_iter_is_done (iter);
+	     mu_msg_iter_next (iter), ++count) {
+		MuMsg *msg;
+		unsigned docid;
+
+		msg   = mu_msg_iter_get_msg_floating (iter);
+		docid = mu_msg_iter_get_docid (iter);
+		g_assert (msg);
+
+		if (reuse) {
+			g_string_assign (gstr, "(\n");
+			mu_msg_append_sexp_props
+				(msg, gstr, docid, NULL,
+				 MU_MSG_SEXP_PROFILE_HEADERS);
+			g_string_append (gstr, ")\n");
+		} else {
+			char *sexp;
+			sexp = mu_msg_to_sexp (msg, docid, NULL, TRUE, FALSE);
+			g_assert (sexp);
+			g_free (sexp);
+		}
+	}
+	mu_msg_iter_destroy (iter);
+
+	elapsed = g_test_timer_elapsed ();
+
+	g_assert_cmpuint (count, ==, SEXP_PERF_NUM);
+	g_string_free (gstr, TRUE);
+	mu_query_destroy (query);
+
+	return elapsed;
+}
+
+
+/* compare getting sexps with mu_msg_to_sexp and appending them to a
+ * reused string; run with '-m perf' */
+static void
+test_mu_query_sexp_perf (void)
+{
+	gchar *maildir, *xpath;
+	double fresh, reused;
+
+	if (!g_test_perf ())
+		return;
+
+	maildir = fill_perf_maildir (SEXP_PERF_NUM);
+	xpath	= fill_database (maildir);
+	g_assert (xpath != NULL);
+
+	fresh  = time_sexps (xpath, FALSE);
+	reused = time_sexps (xpath, TRUE);
+
+	g_test_minimized_result (fresh, "%u sexps, mu_msg_to_sexp: %.3fs",
+				 SEXP_PERF_NUM, fresh);
+	g_test_minimized_result (reused, "%u sexps, one GString: %.3fs",
+				 SEXP_PERF_NUM, reused);
+
+	g_free (xpath);
+	g_free (maildir);
+}
+
 static void
 test_mu_query_wildcards (void)
 {
@@ -642,6 +898,158 @@ test_mu_query_preprocess (void)
 
 
 
+/* get the dates of the messages when sorting by date; when the store
+ * has its docids in date order, they should follow the dates as well */
+static GArray*
+get_dates_by_date (const char *xpath, MuQueryFlags flags, int maxnum)
+{
+	MuQuery *query;
+	MuMsgIter *iter;
+	MuStore *store;
+	GArray *dates;
+	gboolean in_order;
+	unsigned prev;
+
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+	in_order = mu_store_docids_in_date_order (store);
+
+	query = mu_query_new (store, NULL);
+	mu_store_unref (store);
+
+	iter = mu_query_run (query, "", MU_MSG_FIELD_ID_DATE, maxnum,
+			     flags, NULL);
+	g_assert (iter);
+
+	dates = g_array_new (FALSE, FALSE, sizeof(time_t));
+	for (prev = 0; !mu_msg_iter_is_done (iter); mu_msg_iter_next (iter)) {
+		time_t t;
+		unsigned docid;
+
+		t = mu_msg_get_date (mu_msg_iter_get_msg_floating (iter));
+		g_array_append_val (dates, t);
+
+		docid = mu_msg_iter_get_docid (iter);
+		if (in_order && prev != 0) {
+			if (flags & MU_QUERY_FLAG_DESCENDING)
+				g_assert_cmpuint (docid, <, prev);
+			else
+				g_assert_cmpuint (docid, >, prev);
+		}
+		prev = docid;
+	}
+
+	mu_msg_iter_destroy (iter);
+	mu_query_destroy (query);
+
+	return dates;
+}
+
+
+static void
+assert_same_dates (GArray *dates1, GArray *dates2)
+{
+	unsigned u;
+
+	g_assert_cmpuint (dates1->len, ==, dates2->len);
+	for (u = 0; u != dates1->len; ++u)
+		g_assert_cmpint (g_array_index (dates1, time_t, u), ==,
+				 g_array_index (dates2, time_t, u));
+}
+
+
+static void
+check_date_order (const char *xpath, GArray *asc, GArray *desc)
+{
+	GArray *dates;
+
+	dates = get_dates_by_date (xpath, MU_QUERY_FLAG_NONE, -1);
+	assert_same_dates (dates, asc);
+	g_array_free (dates, TRUE);
+
+	dates = get_dates_by_date (xpath, MU_QUERY_FLAG_DESCENDING, -1);
+	assert_same_dates (dates, desc);
+	g_array_free (dates, TRUE);
+
+	/* the first few only */
+	dates = get_dates_by_date (xpath, MU_QUERY_FLAG_NONE, 3);
+	g_assert_cmpuint (dates->len, ==, 3);
+	g_assert (memcmp (dates->data, asc->data, 3 * sizeof(time_t)) == 0);
+	g_array_free (dates, TRUE);
+
+	dates = get_dates_by_date (xpath, MU_QUERY_FLAG_DESCENDING, 3);
+	g_assert_cmpuint (dates->len, ==, 3);
+	g_assert (memcmp (dates->data, desc->data, 3 * sizeof(time_t)) == 0);
+	g_array_free (dates, TRUE);
+}
+
+
+static void
+test_mu_query_date_order (void)
+{
+	MuStore *store;
+	GArray *asc, *desc;
+	gchar *xpath;
+	GError *err;
+
+	xpath = fill_database (MU_TESTMAILDIR2);
+	g_assert (xpath != NULL);
+
+	/* sorted by value */
+	asc  = get_dates_by_date (xpath, MU_QUERY_FLAG_NONE, -1);
+	desc = get_dates_by_date (xpath, MU_QUERY_FLAG_DESCENDING, -1);
+	g_assert_cmpuint (asc->len, ==, 12);
+
+	err   = NULL;
+	store = mu_store_new_writable (xpath, NULL, FALSE, &err);
+	g_assert_no_error (err);
+	g_assert (!mu_store_docids_in_date_order (store));
+	g_assert (mu_store_reorder_by_date (store, &err));
+	g_assert_no_error (err);
+	g_assert (mu_store_docids_in_date_order (store));
+	g_assert_cmpuint (mu_store_count (store, NULL), ==, 12);
+	mu_store_unref (store);
+
+	/* sorted by docid; this should give the same */
+	check_date_order (xpath, asc, desc);
+	g_array_free (asc, TRUE);
+	g_array_free (desc, TRUE);
+
+	/* adding a newer message keeps the order... */
+	store = mu_store_new_writable (xpath, NULL, FALSE, NULL);
+	g_assert (store);
+	g_assert (mu_store_add_path (store, MU_TESTMAILDIR
+				     "/cur/special!2,Sabc", "/cur", NULL)
+		  != MU_STORE_INVALID_DOCID);
+	g_assert (mu_store_docids_in_date_order (store));
+	mu_store_unref (store);
+
+	asc  = get_dates_by_date (xpath, MU_QUERY_FLAG_NONE, -1);
+	g_assert_cmpuint (asc->len, ==, 13);
+	desc = get_dates_by_date (xpath, MU_QUERY_FLAG_DESCENDING, -1);
+	check_date_order (xpath, asc, desc);
+	g_array_free (asc, TRUE);
+	g_array_free (desc, TRUE);
+
+	/* ... an older one does not, and that's remembered */
+	store = mu_store_new_writable (xpath, NULL, FALSE, NULL);
+	g_assert (store);
+	g_assert (mu_store_add_path (store, MU_TESTMAILDIR
+				     "/cur/1252168370_3.14675.cthulhu!2,S",
+				     "/cur", NULL) != MU_STORE_INVALID_DOCID);
+	g_assert (!mu_store_docids_in_date_order (store));
+	mu_store_unref (store);
+
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+	g_assert (!mu_store_docids_in_date_order (store));
+	mu_store_unref (store);
+
+	g_free (xpath);
+}
+
+
+
 int
 main (int argc, char *argv[])
 {
@@ -666,6 +1074,12 @@ main (int argc, char *argv[])
 			 test_mu_query_accented_chars_01);
 	g_test_add_func ("/mu-query/test-mu-query-accented-chars-2",
 			 test_mu_query_accented_chars_02);
+	g_test_add_func ("/mu-query/test-mu-query-rows",
+			 test_mu_query_rows);
+	g_test_add_func ("/mu-query/test-mu-query-rows-perf",
+			 test_mu_query_rows_perf);
+	g_test_add_func ("/mu-query/test-mu-query-sexp-perf",
+			 test_mu_query_sexp_perf);
 	g_test_add_func ("/mu-query/test-mu-query-wildcards",
 			 test_mu_query_wildcards);
 	g_test_add_func ("/mu-query/test-mu-query-sizes",
@@ -684,6 +1098,8 @@ main (int argc, char *argv[])
 			 test_mu_query_tags);
 	g_test_add_func ("/mu-query/test-mu-query-tags_02",
 			 test_mu_query_tags_02);
+	g_test_add_func ("/mu-query/test-mu-query-date-order",
+			 test_mu_query_date_order);
 
 	if (!g_test_verbose())
 	    g_log_set_handler (NULL,
@@ -57,7 +57,7 @@ fill_database (const char *testdir)
 
 /* note: this also *moves the iter* */
 static MuMsgIter*
-run_and_get_iter (const char *xpath, const char *query)
+run_and_get_iter (const char *xpath, const char *query, MuQueryFlags flags)
 {
 	MuQuery  *mquery;
 	MuStore *store;
@@ -70,8 +70,8 @@ run_and_get_iter (const char *xpath, const char *query)
 	mu_store_unref (store);
 	g_assert (query);
 
-	iter = mu_query_run (mquery, query, TRUE, MU_MSG_FIELD_ID_DATE,
-			     FALSE, -1, NULL);
+	iter = mu_query_run (mquery, query, MU_MSG_FIELD_ID_DATE, -1,
+			     flags, NULL);
 	mu_query_destroy (mquery);
 	g_assert (iter);
 
@@ -79,6 +79,17 @@ run_and_get_iter (const char *xpath, const char *query)
 }
 
 
+static void
+assert_thread_path (const MuMsgIterThreadInfo *ti, const char *expected)
+{
+	gchar *path;
+
+	path = mu_msg_iter_thread_info_path (ti);
+	g_assert_cmpstr (path,==,expected);
+	g_free (path);
+}
+
+
 static void
 test_mu_threads_01 (void)
 {
@@ -110,7 +121,7 @@ test_mu_threads_01 (void)
 	xpath = fill_database (MU_TESTMAILDIR3);
 	g_assert (xpath != NULL);
 
-	iter = run_and_get_iter (xpath, "abc");
+	iter = run_and_get_iter (xpath, "abc", MU_QUERY_FLAG_THREADS);
 	g_assert (iter);
 	g_assert (!mu_msg_iter_is_done(iter));
 
@@ -134,7 +145,7 @@ test_mu_threads_01 (void)
 
 		g_assert (u < G_N_ELEMENTS(items));
 
-		g_assert_cmpstr (ti->threadpath,==,items[u].threadpath);
+		assert_thread_path (ti, items[u].threadpath);
 		g_assert_cmpstr (mu_msg_get_subject(msg),==,items[u].subject);
 		g_assert_cmpstr (mu_msg_get_msgid(msg),==,items[u].msgid);
 
@@ -180,7 +191,7 @@ test_mu_threads_rogue (void)
 	xpath = fill_database (MU_TESTMAILDIR3);
 	g_assert (xpath != NULL);
 
-	iter = run_and_get_iter (xpath, "def");
+	iter = run_and_get_iter (xpath, "def", MU_QUERY_FLAG_THREADS);
 	g_assert (iter);
 	g_assert (!mu_msg_iter_is_done(iter));
 
@@ -211,7 +222,7 @@ test_mu_threads_rogue (void)
 
 		g_assert (u < G_N_ELEMENTS(items1));
 
-		g_assert_cmpstr (ti->threadpath,==,(items)[u].threadpath);
+		assert_thread_path (ti, (items)[u].threadpath);
 		g_assert_cmpstr (mu_msg_get_subject(msg),==,(items)[u].subject);
 		g_assert_cmpstr (mu_msg_get_msgid(msg),==,(items)[u].msgid);
 
@@ -225,6 +236,372 @@ test_mu_threads_rogue (void)
 }
 
 
+static void
+test_mu_threads_include_related (void)
+{
+	gchar *xpath;
+	MuMsgIter *iter;
+	unsigned u;
+
+	tinfo items [] = {
+		{"0",     "root0@msg.id",  "root0"},
+		{"0:0",   "child0.0@msg.id", "Re: child 0.0"},
+		{"0:1",   "child0.1@msg.id", "Re: child 0.1"},
+		{"0:1:0", "child0.1.0@msg.id", "Re: child 0.1.0"}
+	};
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	/* we match only one message, but should get its whole
+	 * thread */
+	iter = run_and_get_iter (xpath, "msgid:child0.1.0@msg.id",
+				 MU_QUERY_FLAG_THREADS |
+				 MU_QUERY_FLAG_INCLUDE_RELATED);
+	g_assert (iter);
+
+	for (u = 0; !mu_msg_iter_is_done (iter); ++u, mu_msg_iter_next (iter)) {
+		MuMsg *msg;
+		const MuMsgIterThreadInfo *ti;
+
+		g_assert (u < G_N_ELEMENTS(items));
+
+		ti  = mu_msg_iter_get_thread_info (iter);
+		msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
+		g_assert (ti);
+		g_assert (msg);
+
+		assert_thread_path (ti, items[u].threadpath);
+		g_assert_cmpstr (mu_msg_get_msgid(msg),==,items[u].msgid);
+	}
+	g_assert (u == G_N_ELEMENTS(items));
+
+	g_free (xpath);
+	mu_msg_iter_destroy (iter);
+}
+
+static void
+test_mu_threads_collapse (void)
+{
+	gchar *xpath;
+	MuMsgIter *iter;
+	MuStore *store;
+	MuQuery *query;
+	GHashTable *counts;
+	unsigned threadnum, msgnum;
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	/* there are 10 messages in 5 threads: root0 (4), root1,
+	 * root2 (2), child3 and the children of (absent) root4 (2) */
+	iter = run_and_get_iter (xpath, "abc", MU_QUERY_FLAG_COLLAPSE_THREADS);
+	g_assert (iter);
+
+	counts = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (threadnum = msgnum = 0; !mu_msg_iter_is_done (iter);
+	     mu_msg_iter_next (iter)) {
+		++threadnum;
+		msgnum += 1 + mu_msg_iter_get_collapse_count (iter);
+		g_hash_table_insert
+			(counts, GUINT_TO_POINTER(mu_msg_iter_get_docid (iter)),
+			 GUINT_TO_POINTER(mu_msg_iter_get_collapse_count
+					  (iter)));
+	}
+	mu_msg_iter_destroy (iter);
+
+	g_assert_cmpuint (threadnum,==,5);
+	g_assert_cmpuint (msgnum,==,10);
+
+	/* with a maxnum, we get the same counts for the threads we
+	 * get */
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+	query = mu_query_new (store, NULL);
+	mu_store_unref (store);
+	iter = mu_query_run (query, "abc", MU_MSG_FIELD_ID_DATE, 2,
+			     MU_QUERY_FLAG_COLLAPSE_THREADS, NULL);
+	g_assert (iter);
+	for (threadnum = 0; !mu_msg_iter_is_done (iter);
+	     mu_msg_iter_next (iter), ++threadnum)
+		g_assert_cmpuint
+			(mu_msg_iter_get_collapse_count (iter),==,
+			 GPOINTER_TO_UINT(g_hash_table_lookup
+					  (counts, GUINT_TO_POINTER
+					   (mu_msg_iter_get_docid (iter)))));
+	g_assert_cmpuint (threadnum,==,2);
+
+	mu_msg_iter_destroy (iter);
+	mu_query_destroy (query);
+	g_hash_table_destroy (counts);
+	g_free (xpath);
+}
+
+static void
+test_mu_threads_group_subjects (void)
+{
+	gchar *xpath;
+	MuMsgIter *iter;
+	unsigned u;
+
+	struct {
+		const char* threadpath;
+		const char *msgid;
+	} items [] = {
+		{"0",   "subj0@msg.id"},
+		{"0:0", "subj0.re@msg.id"},
+		{"0:1", "subj0.re2@msg.id"},
+		{"1",   "subj1@msg.id"}
+	};
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	/* the replies have no references, but the same subject */
+	iter = run_and_get_iter (xpath, "ghi",
+				 MU_QUERY_FLAG_THREADS |
+				 MU_QUERY_FLAG_GROUP_SUBJECTS);
+	g_assert (iter);
+
+	for (u = 0; !mu_msg_iter_is_done (iter); ++u, mu_msg_iter_next (iter)) {
+		MuMsg *msg;
+		const MuMsgIterThreadInfo *ti;
+
+		g_assert (u < G_N_ELEMENTS(items));
+
+		ti  = mu_msg_iter_get_thread_info (iter);
+		msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
+		g_assert (ti);
+		g_assert (msg);
+
+		assert_thread_path (ti, items[u].threadpath);
+		g_assert_cmpstr (mu_msg_get_msgid(msg),==,items[u].msgid);
+	}
+	g_assert (u == G_N_ELEMENTS(items));
+
+	g_free (xpath);
+	mu_msg_iter_destroy (iter);
+}
+
+#define GROUP_PERF_NUM 2000
+
+/* a maildir with num messages without references, in pairs with the
+ * same subject, the second one a reply */
+static gchar*
+fill_group_perf_maildir (unsigned num)
+{
+	gchar *maildir, *path;
+	unsigned u;
+
+	maildir = test_mu_common_get_random_tmpdir();
+	path	= g_strdup_printf ("%s%ccur", maildir, G_DIR_SEPARATOR);
+	g_assert (g_mkdir_with_parents (path, 0700) == 0);
+	g_free (path);
+	path	= g_strdup_printf ("%s%cnew", maildir, G_DIR_SEPARATOR);
+	g_assert (g_mkdir_with_parents (path, 0700) == 0);
+	g_free (path);
+
+	for (u = 0; u != num; ++u) {
+		gchar *data;
+		data = g_strdup_printf
+			("From: testfrom@example.com\n"
+			 "To: testto@example.com\n"
+			 "Subject: %ssubject %u\n"
+			 "Message-Id: <perf%u@msg.id>\n"
+			 "Date: Sun, 1 Jan 2012 %02u:%02u:%02u +0000\n"
+			 "\n"
+			 "perf\n",
+			 u % 2 ? "Re: " : "", u / 2, u,
+			 u / 3600, (u / 60) % 60, u % 60);
+		path = g_strdup_printf ("%s%ccur%c%u.perf:2,S", maildir,
+					G_DIR_SEPARATOR, G_DIR_SEPARATOR, u);
+		g_assert (g_file_set_contents (path, data, -1, NULL));
+		g_free (path);
+		g_free (data);
+	}
+
+	return maildir;
+}
+
+
+static double
+time_group_subjects (unsigned num)
+{
+	gchar *maildir, *xpath;
+	MuMsgIter *iter;
+	double elapsed;
+	unsigned count;
+
+	maildir = fill_group_perf_maildir (num);
+	xpath	= fill_database (maildir);
+	g_assert (xpath != NULL);
+
+	g_test_timer_start ();
+	iter = run_and_get_iter (xpath, "perf",
+				 MU_QUERY_FLAG_THREADS |
+				 MU_QUERY_FLAG_GROUP_SUBJECTS);
+	elapsed = g_test_timer_elapsed ();
+
+	for (count = 0; !mu_msg_iter_is_done (iter);
+	     mu_msg_iter_next (iter), ++count);
+	g_assert_cmpuint (count, ==, num);
+
+	mu_msg_iter_destroy (iter);
+	g_free (xpath);
+	g_free (maildir);
+
+	return elapsed;
+}
+
+
+/* grouping by subject should take time linear in the number of
+ * roots; run with '-m perf' */
+static void
+test_mu_threads_group_subjects_perf (void)
+{
+	double small, big;
+
+	if (!g_test_perf ())
+		return;
+
+	small = time_group_subjects (GROUP_PERF_NUM);
+	big   = time_group_subjects (10 * GROUP_PERF_NUM);
+
+	g_test_minimized_result (small, "%u roots: %.3fs",
+				 GROUP_PERF_NUM, small);
+	g_test_minimized_result (big, "%u roots: %.3fs",
+				 10 * GROUP_PERF_NUM, big);
+}
+
+static void
+test_mu_threads_stored (void)
+{
+	gchar *xpath;
+	MuMsgIter *iter;
+	unsigned u;
+
+	struct {
+		const char* threadpath;
+		const char *msgid;
+	} items [] = {
+		{"0",	  "root0@msg.id"},
+		{"0:0",	  "child0.0@msg.id"},
+		{"0:1",	  "child0.1@msg.id"},
+		{"0:1:0", "child0.1.0@msg.id"},
+		{"1",	  "root1@msg.id"},
+		{"2",	  "root2@msg.id"},
+		{"2:0",	  "child2.0.0@msg.id"},
+		{"3",	  "child3.0.0.0.0@msg.id"},
+		/* unlike JWZ, no common parent for the children of the
+		 * absent root4 */
+		{"4",	  "child4.0@msg.id"},
+		{"5",	  "child4.1@msg.id"}
+	};
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	iter = run_and_get_iter (xpath, "abc",
+				 MU_QUERY_FLAG_THREADS |
+				 MU_QUERY_FLAG_STORED_THREADS);
+	g_assert (iter);
+
+	for (u = 0; !mu_msg_iter_is_done (iter); ++u, mu_msg_iter_next (iter)) {
+		MuMsg *msg;
+		const MuMsgIterThreadInfo *ti;
+
+		g_assert (u < G_N_ELEMENTS(items));
+
+		ti  = mu_msg_iter_get_thread_info (iter);
+		msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
+		g_assert (ti);
+		g_assert (msg);
+
+		assert_thread_path (ti, items[u].threadpath);
+		g_assert_cmpstr (mu_msg_get_msgid(msg),==,items[u].msgid);
+	}
+	g_assert (u == G_N_ELEMENTS(items));
+
+	g_free (xpath);
+	mu_msg_iter_destroy (iter);
+}
+
+
+/* index the messages in the given order, rather than in the order
+ * 'mu index' happens to find them in */
+static gchar*
+fill_database_in_order (const char *testdir, const char *maildir,
+			const char **files)
+{
+	MuStore *store;
+	gchar *tmpdir, *xpath;
+	GError *err;
+	unsigned u;
+
+	tmpdir = test_mu_common_get_random_tmpdir();
+	xpath  = g_strdup_printf ("%s%c%s", tmpdir, G_DIR_SEPARATOR, "xapian");
+	g_free (tmpdir);
+
+	err   = NULL;
+	store = mu_store_new_writable (xpath, NULL, FALSE, &err);
+	g_assert_no_error (err);
+
+	for (u = 0; files[u]; ++u) {
+		gchar *path;
+		path = g_strdup_printf ("%s%s%ccur%c%s", testdir, maildir,
+					G_DIR_SEPARATOR, G_DIR_SEPARATOR,
+					files[u]);
+		g_assert (mu_store_add_path (store, path, maildir, &err)
+			  != MU_STORE_INVALID_DOCID);
+		g_assert_no_error (err);
+		g_free (path);
+	}
+
+	mu_store_unref (store);
+
+	return xpath;
+}
+
+
+static unsigned
+count_related (const char *xpath, const char *query)
+{
+	MuMsgIter *iter;
+	unsigned count;
+
+	iter = run_and_get_iter (xpath, query,
+				 MU_QUERY_FLAG_INCLUDE_RELATED);
+	for (count = 0; !mu_msg_iter_is_done (iter); mu_msg_iter_next (iter))
+		++count;
+	mu_msg_iter_destroy (iter);
+
+	return count;
+}
+
+
+/* rogue0's references start with cycle0.0 rather than with the root,
+ * cycle0; when it arrives first, it starts a thread of its own, which
+ * should be merged when cycle0 arrives */
+static void
+test_mu_threads_out_of_order (void)
+{
+	gchar *xpath;
+	const char *files[] = {
+		"rogue0", "cycle0.0.0", "cycle0", "cycle0.0", NULL
+	};
+
+	xpath = fill_database_in_order (MU_TESTMAILDIR3, "/cycle", files);
+
+	g_assert_cmpuint (count_related (xpath, "msgid:cycle0@msg.id"),
+			  ==, 4);
+	g_assert_cmpuint (count_related (xpath, "msgid:rogue0@msg.id"),
+			  ==, 4);
+	g_assert_cmpuint (count_related (xpath, "msgid:cycle0.0@msg.id"),
+			  ==, 4);
+
+	g_free (xpath);
+}
+
 
 int
 main (int argc, char *argv[])
@@ -235,6 +612,18 @@ main (int argc, char *argv[])
 
 	g_test_add_func ("/mu-query/test-mu-threads-01", test_mu_threads_01);
 	g_test_add_func ("/mu-query/test-mu-threads-rogue", test_mu_threads_rogue);
+	g_test_add_func ("/mu-query/test-mu-threads-include-related",
+			 test_mu_threads_include_related);
+	g_test_add_func ("/mu-query/test-mu-threads-collapse",
+			 test_mu_threads_collapse);
+	g_test_add_func ("/mu-query/test-mu-threads-group-subjects",
+			 test_mu_threads_group_subjects);
+	g_test_add_func ("/mu-query/test-mu-threads-group-subjects-perf",
+			 test_mu_threads_group_subjects_perf);
+	g_test_add_func ("/mu-query/test-mu-threads-stored",
+			 test_mu_threads_stored);
+	g_test_add_func ("/mu-query/test-mu-threads-out-of-order",
+			 test_mu_threads_out_of_order);
 
 	g_log_set_handler (NULL,
 			   G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL| G_LOG_FLAG_RECURSION,
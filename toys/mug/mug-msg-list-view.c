@@ -340,8 +340,8 @@ run_query (const char *xpath, const char *query, MugMsgListView * self)
 	}
 	mu_store_unref (store);
 
-	iter = mu_query_run (xapian, query, FALSE, MU_MSG_FIELD_ID_DATE,
-			     TRUE, -1, &err);
+	iter = mu_query_run (xapian, query, MU_MSG_FIELD_ID_DATE, -1,
+			     MU_QUERY_FLAG_DESCENDING, &err);
 	mu_query_destroy (xapian);
 	if (!iter) {
 		g_warning ("Error: %s", err->message);
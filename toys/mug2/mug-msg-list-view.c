@@ -342,8 +342,9 @@ run_query (const char *xpath, const char *query, MugMsgListView * self)
 	}
 	mu_store_unref (store);
 
-	iter = mu_query_run (xapian, query, TRUE, MU_MSG_FIELD_ID_DATE,
-			     TRUE, -1, &err);
+	iter = mu_query_run (xapian, query, MU_MSG_FIELD_ID_DATE, -1,
+			     MU_QUERY_FLAG_THREADS | MU_QUERY_FLAG_DESCENDING,
+			     &err);
 	mu_query_destroy (xapian);
 	if (!iter) {
 		g_warning ("Error: %s", err->message);
@@ -415,8 +416,9 @@ update_model (GtkTreeStore *store, const char *xpath, const char *query,
 
 		ti = mu_msg_iter_get_thread_info (iter);
 
-		if (!prev_ti || !g_str_has_prefix (ti->threadpath,
-						   prev_ti->threadpath))
+		/* in thread order, a deeper message is a descendant
+		 * of the previous one */
+		if (!prev_ti || ti->level <= prev_ti->level)
 			gtk_tree_store_append (store, &treeiter, NULL);
 		else
 			gtk_tree_store_append (store, &treeiter, &prev_treeiter);